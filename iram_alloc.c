@@ -100,8 +100,10 @@ int iram_init(void)
 {
 	if (cpu_is_imx6q() || cpu_is_imx6dl())
 		return iram_init_internal(MX6Q_IRAM_BASE_ADDR, MX6Q_IRAM_SIZE);
-	else
-		return -ENOMEM;
+
+	/* no IRAM on this machine, iram_alloc() will just return NULL */
+	pr_info("i.MX IRAM pool: not available\n");
+	return 0;
 }
 
 
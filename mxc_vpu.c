@@ -36,8 +36,19 @@
 #include <linux/io.h>
 #include <linux/slab.h>
 #include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/suspend.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/compat.h>
+#include <linux/hash.h>
+#include <linux/seq_file.h>
 #include <linux/sched.h>
 #include <linux/vmalloc.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/log2.h>
+#include <linux/poll.h>
 #include <linux/regulator/consumer.h>
 #include <linux/page-flags.h>
 #include <linux/of.h>
@@ -59,25 +70,168 @@
 #else
 #include <asm/sizes.h>
 #endif
+#ifdef CONFIG_MXC_VPU_DEVFREQ
+#include <linux/devfreq.h>
+#endif
+#ifdef CONFIG_HAVE_IMX_BUSFREQ
+#include <linux/busfreq-imx.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 6, 0) && \
+	defined(CONFIG_DMA_SHARED_BUFFER)
+#define MXC_VPU_HAS_DMABUF
+#include <linux/dma-buf.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0) && \
+	defined(CONFIG_DMA_ENGINE)
+#define MXC_VPU_HAS_DMAENGINE
+#include <linux/dmaengine.h>
+#endif
+/*
+ * PMD faults of PFN mappings: vmf_insert_pfn_pmd() takes the vm_fault
+ * from 5.5 on, the fault path offers huge faults to VM_PFNMAP VMAs once
+ * vma_is_special_huge() is there in 5.8, and no longer from 6.1.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(6, 1, 0) && \
+	defined(CONFIG_TRANSPARENT_HUGEPAGE)
+#define MXC_VPU_HAS_HUGE_FAULT
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#endif
 #include "mxc_vpu.h"
 #include "iram_alloc.h"
 
+#define CREATE_TRACE_POINTS
+#include "mxc_vpu_trace.h"
+
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
+#define reinit_completion(x)	INIT_COMPLETION(*(x))
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
+#define trace_vpu_dma_alloc_enabled()	true
+#define trace_vpu_dma_free_enabled()	true
+#endif
 
 /* Define one new pgprot which combined uncached and XN(never executable) */
+#ifdef CONFIG_ARM
 #define pgprot_noncachedxn(prot) \
 	__pgprot_modify(prot, L_PTE_MT_MASK, L_PTE_MT_UNCACHED | L_PTE_XN)
+#else
+#define pgprot_noncachedxn(prot)	pgprot_noncached(prot)
+#endif
+
+/* a mutex that counts contention into vpu_lockstat */
+struct vpu_mutex {
+	struct mutex lock;
+	int site;		/* that took it */
+	s64 since;
+};
+
+#define VPU_MUTEX_INIT(name)	{ .lock = __MUTEX_INITIALIZER(name.lock) }
 
 struct vpu_priv {
 	struct fasync_struct *async_queue;
 	struct work_struct work;
 	struct workqueue_struct *workqueue;
-	struct mutex lock;
+	struct vpu_mutex lock;
+};
+
+/*
+ * A buffer as the driver tracks it. Userspace only ever sees the handle,
+ * never cpu_addr.
+ */
+struct vpu_dma_buf {
+	u32 size;
+	u32 handle;
+	dma_addr_t phy_addr;
+	void *cpu_addr;
+	u64 virt_uaddr;		/* kept for userspace, not used */
 };
 
 /* To track the allocated memory buffer */
 struct memalloc_record {
 	struct list_head list;
-	struct vpu_mem_desc mem;
+	struct kref ref;	/* the list entry, mappings and dma-bufs */
+	struct vpu_dma_buf mem;
+};
+
+/*
+ * Per open file, and what is undone when the file is released. The
+ * buffers it allocates are found by handle in bufs, which does not hold a
+ * reference: a buffer leaves it before it leaves the allocation list.
+ */
+struct vpu_session {
+	struct mutex lock;
+	struct idr bufs;
+	atomic_t clk_refs;	/* CLKGATE_SETTING on without an off */
+	struct vpu_ring *ring;	/* set once, by RING_SETUP */
+	struct vpu_bs *bs;	/* set once, by BS_SETUP */
+	struct vpu_map *map;	/* laid out by MAP_SET, for the next mmap */
+	struct vpu_shm *shm_group;	/* set once, by SHM_GET */
+	bool job_failed;	/* its job was reset, under vpu_hw_lock */
+};
+
+/*
+ * Job rings of a file, laid out as struct vpu_ring_hdr says. sq_head and
+ * cq_tail are the driver's own copies of what it publishes in the
+ * header, which userspace can write to. A CQE is reserved before its
+ * job or copy starts, so that the CQ never overflows.
+ */
+struct vpu_ring {
+	struct vpu_ring_hdr *hdr;	/* vmalloc_user, mapped by userspace */
+	struct vpu_sqe *sqes;
+	struct vpu_cqe *cqes;
+	u32 sq_entries;
+	u32 cq_entries;
+	u32 size;
+	u32 sq_head;
+	u32 cq_tail;
+	u32 cq_reserved;		/* CQEs to come, under cq_lock */
+	spinlock_t cq_lock;
+	atomic_t copies;		/* VPU_COPY_ASYNC not done yet */
+	struct list_head ready;		/* on vpu_ring_ready */
+	wait_queue_head_t wait;		/* CQE posted or SQE consumed */
+	bool inflight;			/* its job runs on the VPU */
+	struct vpu_session *s;		/* whose rings */
+};
+
+/* encoder output of one job */
+struct vpu_bs_chunk {
+	u32 off;
+	u32 len;
+	u32 run_cmd;
+	s64 ts;
+};
+
+#define VPU_BS_MAX_FRAMES	64
+
+/*
+ * Bitstream ring of a codec instance. Decoding, wr is advanced by
+ * write() under lock and rd is where the VPU has read up to, as of its
+ * last interrupt or write(); one byte stays free so that rd == wr means
+ * empty. Encoding, it is the other way round, and the interrupt queues
+ * what the VPU wrote in frames, under vpu_bs_lock.
+ */
+struct vpu_bs {
+	struct vpu_dma_buf mem;
+	u32 instance;
+	u32 size;
+	u32 low;
+	u32 high;
+	u32 rd;
+	u32 wr;
+	bool encode;
+	bool headers;			/* VPU_BS_FRAME_HEADERS */
+	struct mutex lock;
+	wait_queue_head_t wait;		/* rd moved, or a frame came */
+	/* encoder frames, the first of which is read up to frame_pos */
+	u32 frame_first;
+	u32 nr_frames;
+	u32 frame_pos;
+	bool frame_hdr_done;
+	struct vpu_bs_chunk frames[VPU_BS_MAX_FRAMES];
 };
 
 struct iram_setting {
@@ -91,20 +245,55 @@ static int vpu_major;
 static int vpu_clk_usercount;
 static struct class *vpu_class;
 static struct vpu_priv vpu_data;
-static u8 open_count;
+static unsigned int open_count;
 static struct clk *vpu_clk;
-static struct vpu_mem_desc bitwork_mem = { 0 };
-static struct vpu_mem_desc pic_para_mem = { 0 };
-static struct vpu_mem_desc user_data_mem = { 0 };
-static struct vpu_mem_desc share_mem = { 0 };
-static struct vpu_mem_desc vshare_mem = { 0 };
+static struct vpu_dma_buf bitwork_mem = { 0 };
+static bool bitwork_owned;	/* allocated by GET_WORK_ADDR, not a record */
+static struct vpu_dma_buf pic_para_mem = { 0 };
+static struct vpu_dma_buf user_data_mem = { 0 };
+static struct vpu_dma_buf share_mem = { 0 };
+static struct vpu_dma_buf vshare_mem = { 0 };
+static atomic_t vpu_handle_seq = ATOMIC_INIT(0);
+
+/*
+ * mmap offset and handle of the vmalloc'ed shared memory. Legacy userspace
+ * maps it at its cpu_addr, so the handle doubles as the offset; it is
+ * above any physical address the VPU can reach.
+ */
+#define VPU_VSHARE_MMAP_OFFSET	0xFFFF0000UL
+
+/* mmap offset of a file's job rings, next to the vshare one */
+#define VPU_RING_MMAP_OFFSET	0xFFFE0000UL
+
+/* mmap offset of a MAP_SET layout, PMD aligned for huge faults */
+#define VPU_MAP_SET_MMAP_OFFSET	0xFFC00000UL
+
+/*
+ * Shared regions, per instance and then per group, each with an mmap
+ * offset VPU_SHM_MAX_SIZE apart from here on.
+ */
+#define VPU_SHM_REGIONS		(VPU_BS_MAX_INSTANCES + VPU_SHM_MAX_GROUPS)
+#define VPU_SHM_MMAP_OFFSET	0xFFD00000UL
+
+/*
+ * Buffers a file allocates get handles from its IDR, which stay below
+ * VPU_SHARED_HANDLE. Device-wide buffers (share, work) have it set.
+ */
+#define VPU_SHARED_HANDLE	0x80000000U
+
+/*
+ * mmap page offset of a per-file buffer is VPU_MMAP_HANDLE_PGOFF plus its
+ * handle. It starts at 4GB, past any physical address and the vshare
+ * offset, which legacy userspace maps by.
+ */
+#define VPU_MMAP_HANDLE_PGOFF	(1UL << (32 - PAGE_SHIFT))
 
 static void __iomem *vpu_base;
 static int vpu_ipi_irq;
 static u32 phy_vpu_base_addr;
+static struct mxc_vpu_platform_data *vpu_plat;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
 static phys_addr_t top_address_DRAM;
-static struct mxc_vpu_platform_data *vpu_plat;
 #endif
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
@@ -117,6 +306,9 @@ static struct iram_setting iram;
 /* implement the blocking ioctl */
 static int irq_status;
 static int codec_done;
+static bool vpu_bit_irq;		/* the BIT processor interrupted */
+static u32 vpu_bit_irq_done;		/* reason of a done interrupt not seen yet */
+static u32 vpu_bit_irq_index;		/* BIT_RUN_INDEX of that job */
 static wait_queue_head_t vpu_queue;
 
 #ifdef CONFIG_SOC_IMX6Q
@@ -134,6 +326,78 @@ static struct regulator *vpu_regulator;
 static unsigned int pc_before_suspend;
 static atomic_t clk_cnt_from_ioc = ATOMIC_INIT(0);
 
+/*
+ * Codec activity accounting. A busy period starts when userspace gates the
+ * clock on for a command and ends at the completion interrupt (or when the
+ * clock is gated off again); engines are charged separately, see
+ * vpu_engine_since. vpu_queued counts clients waiting for the hardware,
+ * either in WAIT4INT or for the device lock.
+ */
+static DEFINE_SPINLOCK(vpu_busy_lock);
+static s64 vpu_busy_since;
+static s64 vpu_busy_ns;
+static s64 vpu_busy_window;
+static atomic_t vpu_queued = ATOMIC_INIT(0);
+
+/*
+ * Hang watchdog. A job is a ring job, from its BIT_RUN_COMMAND write to
+ * its interrupt, or a LOCK_DEV hold, whose deadline moves on with every
+ * interrupt. vpu_wdt_job names the running one (0 for none) and changes
+ * with the hardware owner, under vpu_hw_lock. On expiry the VPU is reset
+ * and its firmware context restored, and only the job that hung is failed.
+ */
+static unsigned int watchdog_ms = 500;
+module_param(watchdog_ms, uint, 0644);
+MODULE_PARM_DESC(watchdog_ms, "Time before a running job is declared hung, 0 to disable");
+
+static void vpu_wdt_work_fn(struct work_struct *w);
+static DECLARE_DELAYED_WORK(vpu_wdt_work, vpu_wdt_work_fn);
+static u32 vpu_wdt_seq;
+static u32 vpu_wdt_job;
+static void vpu_wdt_next(void);
+static unsigned long vpu_wdt_recoveries;
+static s64 vpu_wdt_recover_ns;
+
+/*
+ * Job admission is closed from suspend prepare until resume, the running
+ * job is drained by waiting on vpu_idle_queue.
+ */
+static bool vpu_suspending;
+static DECLARE_WAIT_QUEUE_HEAD(vpu_admit_queue);
+static DECLARE_WAIT_QUEUE_HEAD(vpu_idle_queue);
+#define VPU_SUSPEND_DRAIN_MS	200
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+#define smp_load_acquire(p)						\
+({									\
+	typeof(*(p)) ___v = ACCESS_ONCE(*(p));				\
+	smp_mb();							\
+	___v;								\
+})
+#define smp_store_release(p, v)						\
+do {									\
+	smp_mb();							\
+	ACCESS_ONCE(*(p)) = (v);					\
+} while (0)
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 19, 0)
+#define READ_ONCE(x)		ACCESS_ONCE(x)
+#define WRITE_ONCE(x, v)	(ACCESS_ONCE(x) = (v))
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 16, 0)
+#define vpu_poll_t		__poll_t
+#else
+#define vpu_poll_t		unsigned int
+#define EPOLLIN			POLLIN
+#define EPOLLRDNORM		POLLRDNORM
+#define EPOLLOUT		POLLOUT
+#define EPOLLWRNORM		POLLWRNORM
+#define EPOLLWRBAND		POLLWRBAND
+#define EPOLLRDBAND		POLLRDBAND
+#endif
+
 #define	READ_REG(x)		readl_relaxed(vpu_base + x)
 #define	WRITE_REG(val, x)	writel_relaxed(val, vpu_base + x)
 
@@ -202,18 +466,413 @@ static int cpu_is_mx6q(void)
 #define SRC_IPU1_SWRST                  0x0080
 #define SRC_IPU2_SWRST                  0x1000
 
+/* upper bounds for the reset and power sequences */
+#define VPU_RESET_TIMEOUT_US            1000
+#define VPU_PU_TIMEOUT_US               1000
+#define VPU_BOOT_TIMEOUT_US             500000
+/* the reset bounds itself, this only covers the work being scheduled */
+#define VPU_RESET_WAIT_MS               1000
+
 static DEFINE_SPINLOCK(scr_lock);
 
 
 static void __iomem *gpc_base;
+static void __iomem *src_base;
 static u32 gpc_wake_irqs[IMR_NUM];
 static u32 gpc_saved_imrs[IMR_NUM];
 static u32 gpc_pu_count;
 static bool pu_clk_get;
-static struct mutex pu_lock;
+static DEFINE_MUTEX(pu_lock);
 static struct clk *gpu3d_clk, *gpu3d_shader_clk, *gpu2d_clk, *gpu2d_axi_clk;
 static struct clk *openvg_axi_clk, *vpu_clk;
 
+/* Duration of the last reset and power sequences */
+static struct {
+	s64 reset_ns;
+	s64 pu_up_ns;
+	s64 pu_down_ns;
+	s64 boot_ns;
+	s64 suspend_ns;
+	s64 resume_ns;
+} vpu_seq_times;
+
+static int vpu_hw_reset(void);
+static void vpu_reset_work_fn(struct work_struct *w);
+static void vpu_power_off_work_fn(struct work_struct *w);
+static DECLARE_WORK(vpu_reset_work, vpu_reset_work_fn);
+static DECLARE_WORK(vpu_power_off_work, vpu_power_off_work_fn);
+static DECLARE_COMPLETION(vpu_reset_done);
+static int vpu_reset_result;
+static DEFINE_MUTEX(vpu_reset_lock);	/* one SYS_SW_RESET at a time */
+
+/*
+ * Performance counters. Kept per cpu so the interrupt and ioctl paths
+ * only do a local add, and summed up when read through debugfs/sysfs.
+ * Every field is a u64, vpu_stats_sum() relies on it.
+ */
+enum {
+	VPU_ENGINE_BIT,
+	VPU_ENGINE_JPU,
+	VPU_ENGINE_NUM,
+};
+
+struct vpu_stats {
+	u64 busy_ns[VPU_ENGINE_NUM];
+	u64 jobs[VPU_ENGINE_NUM];
+	u64 irqs[VPU_ENGINE_NUM];
+	u64 wait_timeouts;
+	u64 alloc_count;
+	u64 alloc_bytes;
+	u64 free_count;
+	u64 free_bytes;
+	u64 clk_on;
+	u64 clk_off;
+	u64 pu_on;
+	u64 pu_off;
+	u64 freq_changes;
+};
+
+static DEFINE_PER_CPU(struct vpu_stats, vpu_stats);
+static s64 vpu_stats_since;
+static struct dentry *vpu_debugfs;
+static struct device *vpu_dev;
+
+#define vpu_stat_inc(field)		this_cpu_inc(vpu_stats.field)
+#define vpu_stat_add(field, val)	this_cpu_add(vpu_stats.field, val)
+
+/*
+ * Latency histograms, per engine, with log2 microsecond buckets: bucket 0
+ * counts samples below 1us, bucket n samples in [2^(n-1), 2^n) us, the
+ * last one everything above.
+ */
+#define VPU_HIST_BUCKETS	26
+
+enum {
+	VPU_HIST_IRQ_WAKE,	/* completion interrupt to waiter running */
+	VPU_HIST_WAIT,		/* time spent in WAIT4INT */
+	VPU_HIST_JOB,		/* job start to completion interrupt */
+	VPU_HIST_NUM,
+};
+
+struct vpu_hist {
+	u64 bucket[VPU_HIST_NUM][VPU_ENGINE_NUM][VPU_HIST_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct vpu_hist, vpu_hist);
+
+/* time (0 once a waiter took it) and engine of the last completion */
+static atomic64_t vpu_irq_ns = ATOMIC64_INIT(0);
+static int vpu_irq_engine;
+
+static void vpu_hist_add(int hist, int engine, s64 ns)
+{
+	u64 us = ns > 0 ? div_u64(ns, NSEC_PER_USEC) : 0;
+	int b = us ? min(fls64(us), VPU_HIST_BUCKETS - 1) : 0;
+
+	this_cpu_inc(vpu_hist.bucket[hist][engine][b]);
+}
+
+/*
+ * Contention counters per acquiring call site. Each site belongs to one
+ * lock (the prefix of its name in debugfs):
+ *
+ *   dev    vpu_data.lock, open/release, suspend/resume and the
+ *          watchdog
+ *   buf    vpu_buf_lock, the allocation list and the work buffer
+ *   share  vpu_share_lock, creation of share_mem, vshare_mem and the
+ *          shared regions
+ *   hw     hardware ownership taken by VPU_IOC_LOCK_DEV
+ *
+ * The counters of a site are only updated with its lock held, so need no
+ * locking of their own; hold time is charged to the site that took the
+ * lock, wherever it is dropped.
+ */
+enum {
+	VPU_LS_OPEN,
+	VPU_LS_RELEASE,
+	VPU_LS_SUSPEND,
+	VPU_LS_RESUME,
+	VPU_LS_WATCHDOG,
+	VPU_LS_ALLOC,
+	VPU_LS_FREE,
+	VPU_LS_PUT_BUFS,
+	VPU_LS_BITWORK,
+	VPU_LS_MMAP,
+	VPU_LS_BENCH,
+	VPU_LS_SHARE_MEM,
+	VPU_LS_VSHARE_MEM,
+	VPU_LS_SHARE_MMAP,
+	VPU_LS_SHM,
+	VPU_LS_LOCK_DEV,
+	VPU_LS_NUM,
+};
+
+struct vpu_lockstat {
+	u64 acquired;
+	u64 contended;
+	u64 wait_ns;
+	u64 wait_max_ns;
+	u64 hold_ns;
+	u64 hold_max_ns;
+};
+
+static struct vpu_lockstat vpu_lockstat[VPU_LS_NUM];
+
+/*
+ * Counting is turned on through debugfs mxc_vpu/lockstat_enable; off,
+ * taking a lock costs one test. A lock taken while it was off has no
+ * start time and is not charged when it is dropped.
+ */
+static bool vpu_ls_on;
+
+static struct vpu_mutex vpu_buf_lock = VPU_MUTEX_INIT(vpu_buf_lock);
+static struct vpu_mutex vpu_share_lock = VPU_MUTEX_INIT(vpu_share_lock);
+
+static void vpu_lockstat_acquired(int site, s64 start, s64 now)
+{
+	struct vpu_lockstat *ls = &vpu_lockstat[site];
+
+	ls->acquired++;
+	if (start) {
+		ls->contended++;
+		ls->wait_ns += now - start;
+		ls->wait_max_ns = max_t(u64, ls->wait_max_ns, now - start);
+	}
+}
+
+static void vpu_lockstat_released(int site, s64 since)
+{
+	struct vpu_lockstat *ls = &vpu_lockstat[site];
+	s64 held;
+
+	if (!since)
+		return;
+	held = ktime_to_ns(ktime_get()) - since;
+	ls->hold_ns += held;
+	ls->hold_max_ns = max_t(u64, ls->hold_max_ns, held);
+}
+
+static void vpu_mutex_lock(struct vpu_mutex *m, int site)
+{
+	s64 start = 0, now;
+
+	if (likely(!READ_ONCE(vpu_ls_on))) {
+		mutex_lock(&m->lock);
+		m->since = 0;
+		return;
+	}
+	if (!mutex_trylock(&m->lock)) {
+		start = ktime_to_ns(ktime_get());
+		mutex_lock(&m->lock);
+	}
+	now = ktime_to_ns(ktime_get());
+
+	vpu_lockstat_acquired(site, start, now);
+	m->site = site;
+	m->since = now;
+}
+
+static void vpu_mutex_unlock(struct vpu_mutex *m)
+{
+	vpu_lockstat_released(m->site, m->since);
+	mutex_unlock(&m->lock);
+}
+
+/* vpu_data.lock, the device state */
+static inline void vpu_lock(int site)
+{
+	vpu_mutex_lock(&vpu_data.lock, site);
+}
+
+static inline void vpu_unlock(void)
+{
+	vpu_mutex_unlock(&vpu_data.lock);
+}
+
+/*
+ * Hardware ownership, what VPU_IOC_LOCK_DEV hands to userspace. It is
+ * held across system calls, so it is a session pointer rather than a
+ * mutex: any context can drop it, a waiter can be interrupted, and
+ * nothing else in the driver waits for it.
+ */
+static struct vpu_session *vpu_hw_owner;
+static s64 vpu_hw_since;
+static DEFINE_SPINLOCK(vpu_hw_lock);
+static DECLARE_WAIT_QUEUE_HEAD(vpu_hw_queue);
+
+static bool vpu_hw_try_acquire(struct vpu_session *s)
+{
+	bool ok;
+
+	spin_lock(&vpu_hw_lock);
+	ok = !vpu_hw_owner;
+	if (ok)
+		vpu_hw_owner = s;
+	spin_unlock(&vpu_hw_lock);
+	return ok;
+}
+
+static int vpu_hw_acquire(struct vpu_session *s)
+{
+	bool ls = READ_ONCE(vpu_ls_on);
+	s64 start = 0, now;
+	int ret;
+
+	if (!vpu_hw_try_acquire(s)) {
+		if (ls)
+			start = ktime_to_ns(ktime_get());
+		ret = wait_event_interruptible_exclusive(vpu_hw_queue,
+						vpu_hw_try_acquire(s));
+		if (ret)
+			return ret;
+	}
+	vpu_hw_since = 0;
+	if (!ls)
+		return 0;
+	now = ktime_to_ns(ktime_get());
+
+	vpu_lockstat_acquired(VPU_LS_LOCK_DEV, start, now);
+	vpu_hw_since = now;
+	return 0;
+}
+
+static inline bool vpu_hw_owned(struct vpu_session *s)
+{
+	/* only meaningful to s itself, which is what asks */
+	return vpu_hw_owner == s;
+}
+
+/*
+ * Ring dispatch. Rings that may have SQEs are on vpu_ring_ready; the
+ * dispatcher takes them round-robin and runs one job at a time, holding
+ * the device as vpu_ring_owner so that LOCK_DEV of the ring's own file
+ * neither sees nor drops it. vpu_ring_job is claimed by whichever of
+ * the interrupt and the watchdog completes the job; vpu_ring_busy stays
+ * set until that completion is done with the device.
+ */
+static struct vpu_session vpu_ring_owner;
+static LIST_HEAD(vpu_ring_ready);
+static DEFINE_SPINLOCK(vpu_ring_lock);
+static DEFINE_MUTEX(vpu_ring_dispatch);
+static bool vpu_ring_busy;
+static struct vpu_ring *vpu_ring_job;
+static u64 vpu_ring_job_data;
+static u32 vpu_ring_job_wdt;
+static s64 vpu_ring_job_start;
+static DECLARE_WAIT_QUEUE_HEAD(vpu_ring_idle);
+static void vpu_ring_work_fn(struct work_struct *w);
+static DECLARE_WORK(vpu_ring_work, vpu_ring_work_fn);
+static bool vpu_ring_complete(struct vpu_ring *want, u32 job, int result,
+			      u32 reason);
+
+/* tests under the lock the dispatcher puts a ring back with */
+static inline void vpu_ring_kick(void)
+{
+	bool ready;
+
+	spin_lock(&vpu_ring_lock);
+	ready = !list_empty(&vpu_ring_ready);
+	spin_unlock(&vpu_ring_lock);
+	if (ready)
+		queue_work(vpu_data.workqueue, &vpu_ring_work);
+}
+
+static void vpu_hw_release(void)
+{
+	vpu_lockstat_released(VPU_LS_LOCK_DEV, vpu_hw_since);
+	spin_lock(&vpu_hw_lock);
+	vpu_hw_owner = NULL;
+	vpu_wdt_job = 0;
+	spin_unlock(&vpu_hw_lock);
+	wake_up(&vpu_hw_queue);
+	vpu_ring_kick();
+}
+
+/*
+ * Timeline recorder. When enabled through debugfs mxc_vpu/record_enable,
+ * every open, release, ioctl, mmap and interrupt is logged to a ring of
+ * record_entries struct vpu_rec, read back in binary from mxc_vpu/record
+ * and re-issued by tools/vpu_replay. Disabled, it costs one test per call.
+ */
+static unsigned int record_entries = 16384;
+module_param(record_entries, uint, 0444);
+MODULE_PARM_DESC(record_entries, "Size of the timeline record ring");
+
+static int vpu_get_desc(u_long arg, bool v2, struct vpu_mem_desc_v2 *desc);
+
+static DEFINE_SPINLOCK(vpu_rec_lock);
+static struct vpu_rec *vpu_rec_buf;
+static unsigned int vpu_rec_head;
+static unsigned int vpu_rec_count;
+static bool vpu_rec_on;
+
+static void vpu_record(u32 type, struct file *filp, u32 cmd, s32 ret,
+		       s64 start, const u32 *arg)
+{
+	s64 dur = ktime_to_ns(ktime_get()) - start;
+	unsigned long flags;
+	struct vpu_rec *r;
+
+	spin_lock_irqsave(&vpu_rec_lock, flags);
+	if (vpu_rec_on && vpu_rec_buf) {
+		r = &vpu_rec_buf[vpu_rec_head];
+		if (++vpu_rec_head == record_entries)
+			vpu_rec_head = 0;
+		if (vpu_rec_count < record_entries)
+			vpu_rec_count++;
+
+		r->ts_ns = start;
+		r->dur_ns = min_t(s64, dur, U32_MAX);
+		r->client = filp ? hash_ptr(filp, 32) : 0;
+		r->type = type;
+		r->cmd = cmd;
+		r->ret = ret;
+		if (arg)
+			memcpy(r->arg, arg, sizeof(r->arg));
+		else
+			memset(r->arg, 0, sizeof(r->arg));
+		r->reserved = 0;
+	}
+	spin_unlock_irqrestore(&vpu_rec_lock, flags);
+}
+
+/* logs an ioctl with its argument as the driver left it */
+static void vpu_record_ioctl(struct file *filp, u_int cmd, u_long arg,
+			     bool v2, long ret, s64 start)
+{
+	struct vpu_mem_desc_v2 desc;
+	u32 a[4] = { 0 };
+
+	switch (cmd) {
+	case VPU_IOC_PHYMEM_ALLOC:
+	case VPU_IOC_PHYMEM_FREE:
+	case VPU_IOC_GET_SHARE_MEM:
+	case VPU_IOC_REQ_VSHARE_MEM:
+	case VPU_IOC_GET_WORK_ADDR:
+	case VPU_IOC_QUERY_BITWORK_MEM:
+	case VPU_IOC_SET_BITWORK_MEM:
+	case VPU_IOC_PHYMEM_CHECK:
+		if (vpu_get_desc(arg, v2, &desc))
+			break;
+		a[0] = desc.size;
+		a[1] = desc.phy_addr;
+		a[2] = desc.handle;
+		a[3] = desc.virt_uaddr;
+		break;
+	case VPU_IOC_CLKGATE_SETTING:
+	case VPU_IOC_LOCK_DEV:
+		if (get_user(a[0], (u32 __user *)arg))
+			a[0] = 0;
+		break;
+	case VPU_IOC_WAIT4INT:
+		a[0] = arg;
+		if (v2 && get_user(a[0], (u32 __user *)arg))
+			a[0] = 0;
+		break;
+	}
+	vpu_record(VPU_REC_IOCTL, filp, cmd, ret, start, a);
+}
+
 void imx_anatop_pu_vol(bool enable)
 {
 	struct regmap *anatop;
@@ -324,9 +983,45 @@ static void imx_gpc_pu_clk_init(void)
                 printk(KERN_ERR "%s: failed to get openvg_clk!\n", __func__);
 }
 
-void imx_gpc_power_up_pu(bool flag)
+/*
+ * Poll a register until all bits in @mask read back as zero, for at most
+ * @timeout_us. With @sleep_us == 0 the wait spins, otherwise it sleeps
+ * between reads. The time spent is returned through @elapsed_ns.
+ */
+static int vpu_poll_clear(void __iomem *addr, u32 mask,
+			  unsigned int timeout_us, unsigned int sleep_us,
+			  s64 *elapsed_ns)
+{
+	s64 start = ktime_to_ns(ktime_get());
+	s64 deadline = start + (s64)timeout_us * NSEC_PER_USEC;
+	s64 now;
+	int ret = 0;
+
+	for (;;) {
+		if (!(readl_relaxed(addr) & mask))
+			break;
+		now = ktime_to_ns(ktime_get());
+		if (now > deadline) {
+			/* one last look, we may have been preempted */
+			if (readl_relaxed(addr) & mask)
+				ret = -ETIMEDOUT;
+			break;
+		}
+		if (sleep_us)
+			usleep_range(sleep_us, sleep_us * 2);
+		else
+			cpu_relax();
+	}
+
+	if (elapsed_ns)
+		*elapsed_ns = ktime_to_ns(ktime_get()) - start;
+	return ret;
+}
+
+int imx_gpc_power_up_pu(bool flag)
 {
         unsigned int reg;
+        int ret = 0;
 
         mutex_lock(&pu_lock);
 
@@ -338,15 +1033,19 @@ void imx_gpc_power_up_pu(bool flag)
         if (gpc_pu_count && flag) {
                 gpc_pu_count++;
                 mutex_unlock(&pu_lock);
-                return;
+                return 0;
         }
         if ((gpc_pu_count > 1) && !flag) {
                 gpc_pu_count--;
                 mutex_unlock(&pu_lock);
-                return;
+                return 0;
         }
 
         if (!gpc_pu_count && flag) {
+                if (!gpc_base) {
+                        gpc_pu_count++;
+                        goto out;
+                }
                 /* turn on vddpu */
                 imx_anatop_pu_vol(true);
                 /* enable pu clock */
@@ -358,12 +1057,24 @@ void imx_gpc_power_up_pu(bool flag)
                 reg = __raw_readl(gpc_base + GPC_CNTR);
                 __raw_writel(reg | 0x2, gpc_base + GPC_CNTR);
                 /* Wait for the power up bit to clear */
-                while (__raw_readl(gpc_base + GPC_CNTR) & 0x2)
-                        ;
+                ret = vpu_poll_clear(gpc_base + GPC_CNTR, 0x2,
+                                     VPU_PU_TIMEOUT_US, 0,
+                                     &vpu_seq_times.pu_up_ns);
                 /* disable pu clock */
                 imx_pu_clk(false);
+                trace_vpu_pu_power(1, vpu_seq_times.pu_up_ns, ret);
+                if (ret) {
+                        printk(KERN_ERR "%s: PU power up timeout\n",
+                               __func__);
+                        imx_anatop_pu_vol(false);
+                        goto out;
+                }
                 gpc_pu_count++;
+                vpu_stat_inc(pu_on);
         } else if ((gpc_pu_count == 1) && !flag) {
+                gpc_pu_count--;
+                if (!gpc_base)
+                        goto out;
                 /* enable power down request */
                 reg = __raw_readl(gpc_base + GPC_PGC_GPU_PGCR);
                 __raw_writel(reg | 0x1, gpc_base + GPC_PGC_GPU_PGCR);
@@ -371,26 +1082,33 @@ void imx_gpc_power_up_pu(bool flag)
                 reg = __raw_readl(gpc_base + GPC_CNTR);
                 __raw_writel(reg | 0x1, gpc_base + GPC_CNTR);
                 /* Wait for power down to complete */
-                while (__raw_readl(gpc_base + GPC_CNTR) & 0x1)
-                        ;
+                ret = vpu_poll_clear(gpc_base + GPC_CNTR, 0x1,
+                                     VPU_PU_TIMEOUT_US, 0,
+                                     &vpu_seq_times.pu_down_ns);
+                trace_vpu_pu_power(0, vpu_seq_times.pu_down_ns, ret);
+                /* keep vddpu on if the domain did not go down cleanly */
+                if (ret) {
+                        printk(KERN_ERR "%s: PU power down timeout\n",
+                               __func__);
+                        goto out;
+                }
                 /* turn off vddpu */
                 imx_anatop_pu_vol(false);
-                gpc_pu_count--;
+                vpu_stat_inc(pu_off);
         }
+out:
         mutex_unlock(&pu_lock);
-        return;
+        return ret;
 }
 
 int imx_src_reset_vpu(void)
 {
         u32 val;
         unsigned long flags;
-	void __iomem *src_base;
-	struct device_node *np;
+        int ret;
 
-        np = of_find_compatible_node(NULL, NULL, "fsl,imx6q-src");
-        src_base = of_iomap(np, 0);
-        WARN_ON(!src_base);
+        if (!src_base)
+                return -ENODEV;
 
         /* mask interrupt due to vpu passed reset */
         val = readl_relaxed(src_base + SRC_SIMR);
@@ -399,667 +1117,4553 @@ int imx_src_reset_vpu(void)
 
         spin_lock_irqsave(&scr_lock, flags);
         val = readl_relaxed(src_base + SRC_SCR);
-        val |= (1 << BP_SRC_SCR_VPU_RST);        writel_relaxed(val, src_base + SRC_SCR);
+        val |= (1 << BP_SRC_SCR_VPU_RST);
+        writel_relaxed(val, src_base + SRC_SCR);
         spin_unlock_irqrestore(&scr_lock, flags);
 
-        while (readl_relaxed(src_base + SRC_SCR) & (1 << BP_SRC_SCR_VPU_RST))
-                ;
-        return 0;
+        ret = vpu_poll_clear(src_base + SRC_SCR, 1 << BP_SRC_SCR_VPU_RST,
+                             VPU_RESET_TIMEOUT_US, 0,
+                             &vpu_seq_times.reset_ns);
+        if (ret)
+                printk(KERN_ERR "%s: VPU reset timeout\n", __func__);
+        return ret;
 }
 
+static void vpu_reset_work_fn(struct work_struct *w)
+{
+	vpu_reset_result = vpu_hw_reset();
+	complete_all(&vpu_reset_done);
+}
 
 /*!
- * Private function to alloc dma buffer
- * @return status  0 success.
+ * @brief reset the VPU from a work item and sleep until it is done
+ * @return 0 once reset, -ETIMEDOUT or -ERESTARTSYS otherwise
  */
-static int vpu_alloc_dma_buffer(struct vpu_mem_desc *mem)
+static int vpu_sw_reset(void)
 {
-	mem->cpu_addr = (unsigned long)
-	    dma_alloc_coherent(NULL, PAGE_ALIGN(mem->size),
-			       (dma_addr_t *) (&mem->phy_addr),
-			       GFP_DMA | GFP_KERNEL);
-	pr_debug("[ALLOC] mem alloc cpu_addr = 0x%x\n", mem->cpu_addr);
-	if ((void *)(mem->cpu_addr) == NULL) {
-		printk(KERN_ERR "Physical memory allocation error!\n");
-		return -1;
-	}
-	return 0;
+	long left;
+	int ret;
+
+	mutex_lock(&vpu_reset_lock);
+	/* a reset whose caller stopped waiting may still be running */
+	flush_work(&vpu_reset_work);
+	reinit_completion(&vpu_reset_done);
+	schedule_work(&vpu_reset_work);
+	left = wait_for_completion_interruptible_timeout(&vpu_reset_done,
+			msecs_to_jiffies(VPU_RESET_WAIT_MS));
+	if (left < 0)
+		ret = left;
+	else if (!left)
+		ret = -ETIMEDOUT;
+	else
+		ret = vpu_reset_result;
+	mutex_unlock(&vpu_reset_lock);
+	return ret;
 }
 
-/*!
- * Private function to free dma buffer
+/*
+ * PU power, through the platform hooks when the board (or a simulated
+ * VPU) provides them, through the GPC otherwise.
  */
-static void vpu_free_dma_buffer(struct vpu_mem_desc *mem)
+static int vpu_pu_power(bool on)
 {
-	if (mem->cpu_addr != 0) {
-		dma_free_coherent(0, PAGE_ALIGN(mem->size),
-				  (void *)mem->cpu_addr, mem->phy_addr);
+	if (vpu_plat && vpu_plat->pg) {
+		vpu_plat->pg(!on);
+		return 0;
 	}
+	return imx_gpc_power_up_pu(on);
 }
 
-/*!
- * Private function to free buffers
- * @return status  0 success.
- */
-static int vpu_free_buffers(void)
+/* Drop the PU power reference taken at open, off the release path */
+static void vpu_power_off_work_fn(struct work_struct *w)
 {
-	struct memalloc_record *rec, *n;
-	struct vpu_mem_desc mem;
+	vpu_pu_power(false);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	pm_runtime_put_sync_suspend(&vpu_pdev->dev);
+#endif
+}
 
-	list_for_each_entry_safe(rec, n, &head, list) {
-		mem = rec->mem;
-		if (mem.cpu_addr != 0) {
-			vpu_free_dma_buffer(&mem);
-			pr_debug("[FREE] freed paddr=0x%08X\n", mem.phy_addr);
-			/* delete from list */
-			list_del(&rec->list);
-			kfree(rec);
-		}
-	}
+/* Map the SRC and GPC blocks once, instead of on every reset */
+static void vpu_map_pgc_regs(void)
+{
+	struct device_node *np;
 
-	return 0;
+	np = of_find_compatible_node(NULL, NULL, "fsl,imx6q-src");
+	if (np) {
+		src_base = of_iomap(np, 0);
+		of_node_put(np);
+	}
+	np = of_find_compatible_node(NULL, NULL, "fsl,imx6q-gpc");
+	if (np) {
+		gpc_base = of_iomap(np, 0);
+		of_node_put(np);
+	}
+	WARN_ON(!src_base || !gpc_base);
 }
 
-static inline void vpu_worker_callback(struct work_struct *w)
+static void vpu_unmap_pgc_regs(void)
 {
-	struct vpu_priv *dev = container_of(w, struct vpu_priv,
-				work);
+	if (src_base)
+		iounmap(src_base);
+	if (gpc_base)
+		iounmap(gpc_base);
+	src_base = gpc_base = NULL;
+}
 
-	if (dev->async_queue)
-		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+/*
+ * Which engine runs a job is only known when it completes, so a busy
+ * period starts for every engine and each is charged up to its own
+ * completion interrupt. An engine that completed nothing by the time
+ * the clock goes off is not charged.
+ */
+static s64 vpu_engine_since[VPU_ENGINE_NUM];
 
-	irq_status = 1;
-	/*
-	 * Clock is gated on when dec/enc started, gate it off when
-	 * codec is done.
-	 */
-	if (codec_done)
-		codec_done = 0;
+static void vpu_busy_start(void)
+{
+	unsigned long flags;
+	int i;
 
-	wake_up_interruptible(&vpu_queue);
+	spin_lock_irqsave(&vpu_busy_lock, flags);
+	if (!vpu_busy_since) {
+		vpu_busy_since = ktime_to_ns(ktime_get());
+		for (i = 0; i < VPU_ENGINE_NUM; i++)
+			vpu_engine_since[i] = vpu_busy_since;
+	}
+	spin_unlock_irqrestore(&vpu_busy_lock, flags);
 }
 
-/*!
- * @brief vpu interrupt handler
+/*
+ * Ends the busy period at a completion of engine, or with VPU_ENGINE_NUM
+ * when the clock goes off. Returns the time charged to engine.
  */
-static irqreturn_t vpu_ipi_irq_handler(int irq, void *dev_id)
+static s64 vpu_busy_stop(int engine)
 {
-	struct vpu_priv *dev = dev_id;
-	unsigned long reg;
+	unsigned long flags;
+	s64 now, delta = 0;
+
+	spin_lock_irqsave(&vpu_busy_lock, flags);
+	now = ktime_to_ns(ktime_get());
+	if (vpu_busy_since) {
+		vpu_busy_ns += now - vpu_busy_since;
+		vpu_busy_since = 0;
+	}
+	if (engine < VPU_ENGINE_NUM) {
+		if (vpu_engine_since[engine]) {
+			delta = now - vpu_engine_since[engine];
+			vpu_engine_since[engine] = 0;
+			vpu_stat_add(busy_ns[engine], delta);
+		}
+	} else {
+		memset(vpu_engine_since, 0, sizeof(vpu_engine_since));
+	}
+	spin_unlock_irqrestore(&vpu_busy_lock, flags);
+	wake_up(&vpu_idle_queue);
+	return delta;
+}
 
-	reg = READ_REG(BIT_INT_REASON);
-	if (reg & 0x8)
-		codec_done = 1;
-	WRITE_REG(0x1, BIT_INT_CLEAR);
+static bool vpu_is_busy(void)
+{
+	unsigned long flags;
+	bool busy;
 
-	queue_work(dev->workqueue, &dev->work);
+	spin_lock_irqsave(&vpu_busy_lock, flags);
+	busy = vpu_busy_since != 0;
+	spin_unlock_irqrestore(&vpu_busy_lock, flags);
+	return busy;
+}
 
-	return IRQ_HANDLED;
+/* Hold back a new job while the system is suspending */
+static int vpu_admit_job(void)
+{
+	return wait_event_interruptible(vpu_admit_queue, !vpu_suspending);
 }
 
-/*!
- * @brief vpu jpu interrupt handler
- */
-#ifdef MXC_VPU_HAS_JPU
-static irqreturn_t vpu_jpu_irq_handler(int irq, void *dev_id)
+static int vpu_pm_notify(struct notifier_block *nb, unsigned long event,
+			 void *unused)
 {
-	struct vpu_priv *dev = dev_id;
-	unsigned long reg;
+	switch (event) {
+	case PM_SUSPEND_PREPARE:
+		vpu_suspending = true;
+		break;
+	case PM_POST_SUSPEND:
+		vpu_suspending = false;
+		wake_up_all(&vpu_admit_queue);
+		vpu_ring_kick();
+		break;
+	}
+	return NOTIFY_OK;
+}
 
-	reg = READ_REG(MJPEG_PIC_STATUS_REG);
-	if (reg & 0x3)
-		codec_done = 1;
+static struct notifier_block vpu_pm_nb = {
+	.notifier_call = vpu_pm_notify,
+};
 
-	queue_work(dev->workqueue, &dev->work);
+#ifdef CONFIG_HAVE_IMX_BUSFREQ
+static bool vpu_bus_high;
 
-	return IRQ_HANDLED;
+/* Hold the bus at high frequency while the VPU runs at its top setpoint */
+static void vpu_bus_freq(bool high)
+{
+	if (high == vpu_bus_high)
+		return;
+	if (high)
+		request_bus_freq(BUS_FREQ_HIGH);
+	else
+		release_bus_freq(BUS_FREQ_HIGH);
+	vpu_bus_high = high;
 }
+#else
+static inline void vpu_bus_freq(bool high) { }
 #endif
 
-/*!
- * @brief check phy memory prepare to pass to vpu is valid or not, we
- * already address some issue that if pass a wrong address to vpu
- * (like virtual address), system will hang.
- *
- * @return true return is a valid phy memory address, false return not.
- */
-bool vpu_is_valid_phy_memory(u32 paddr)
+#ifdef CONFIG_MXC_VPU_DEVFREQ
+/* Candidate VPU clock rates, filtered against the clock at probe */
+static unsigned long vpu_devfreq_table[] = {
+	264000000,
+	352000000,
+};
+static int vpu_devfreq_states;
+static struct devfreq *vpu_devfreq;
+
+static struct devfreq_simple_ondemand_data vpu_ondemand_data = {
+	.upthreshold = 70,
+	.downdifferential = 20,
+};
+
+static int vpu_devfreq_target(struct device *dev, unsigned long *freq,
+			      u32 flags)
 {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
-	if (paddr > top_address_DRAM)
-		return false;
-#endif
+	unsigned long rate;
+	int i, ret;
+
+	/* pick the closest supported rate in the requested direction */
+	if (flags & DEVFREQ_FLAG_LEAST_UPPER_BOUND) {
+		rate = vpu_devfreq_table[vpu_devfreq_states - 1];
+		for (i = vpu_devfreq_states - 1; i >= 0; i--)
+			if (vpu_devfreq_table[i] >= *freq)
+				rate = vpu_devfreq_table[i];
+	} else {
+		rate = vpu_devfreq_table[0];
+		for (i = 0; i < vpu_devfreq_states; i++)
+			if (vpu_devfreq_table[i] <= *freq)
+				rate = vpu_devfreq_table[i];
+	}
 
-	return true;
+	if (rate != clk_get_rate(vpu_clk)) {
+		ret = clk_set_rate(vpu_clk, rate);
+		if (ret) {
+			dev_err(dev, "failed to set vpu clock to %lu: %d\n",
+				rate, ret);
+			return ret;
+		}
+		vpu_stat_inc(freq_changes);
+	}
+	*freq = clk_get_rate(vpu_clk);
+
+	vpu_bus_freq(*freq >= vpu_devfreq_table[vpu_devfreq_states - 1]);
+	return 0;
 }
 
-/*!
- * @brief open function for vpu file operation
- *
- * @return  0 on success or negative error code on error
- */
-static int vpu_open(struct inode *inode, struct file *filp)
+static int vpu_devfreq_get_dev_status(struct device *dev,
+				      struct devfreq_dev_status *stat)
 {
+	unsigned long flags;
+	s64 now, busy;
+
+	spin_lock_irqsave(&vpu_busy_lock, flags);
+	now = ktime_to_ns(ktime_get());
+	busy = vpu_busy_ns;
+	if (vpu_busy_since) {
+		busy += now - vpu_busy_since;
+		vpu_busy_since = now;
+	}
+	stat->total_time = (unsigned long)div_s64(now - vpu_busy_window,
+						  NSEC_PER_USEC);
+	stat->busy_time = (unsigned long)div_s64(busy, NSEC_PER_USEC);
+	vpu_busy_ns = 0;
+	vpu_busy_window = now;
+	spin_unlock_irqrestore(&vpu_busy_lock, flags);
 
-	mutex_lock(&vpu_data.lock);
+	/*
+	 * Work is queued behind the running job: measured busy time lags
+	 * behind, so report the window as saturated to ramp up right away.
+	 */
+	if (atomic_read(&vpu_queued) > 1)
+		stat->busy_time = stat->total_time;
+	if (stat->busy_time > stat->total_time)
+		stat->busy_time = stat->total_time;
 
-	if (open_count++ == 0) {
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
-		if (!IS_ERR(vpu_regulator))
-			regulator_enable(vpu_regulator);
-#else
-		pm_runtime_get_sync(&vpu_pdev->dev);
-		imx_gpc_power_up_pu(true);
+	stat->current_frequency = clk_get_rate(vpu_clk);
+	return 0;
+}
+
+static int vpu_devfreq_get_cur_freq(struct device *dev, unsigned long *freq)
+{
+	*freq = clk_get_rate(vpu_clk);
+	return 0;
+}
+
+static struct devfreq_dev_profile vpu_devfreq_profile = {
+	.polling_ms = 50,
+	.target = vpu_devfreq_target,
+	.get_dev_status = vpu_devfreq_get_dev_status,
+	.get_cur_freq = vpu_devfreq_get_cur_freq,
+	.freq_table = vpu_devfreq_table,
+};
+
+static int vpu_devfreq_init(struct device *dev)
+{
+	long rate;
+	int i;
+
+	/* keep only the rates the clock provider can actually produce */
+	vpu_devfreq_states = 0;
+	for (i = 0; i < ARRAY_SIZE(vpu_devfreq_table); i++) {
+		rate = clk_round_rate(vpu_clk, vpu_devfreq_table[i]);
+		if (rate <= 0)
+			continue;
+		if (vpu_devfreq_states &&
+		    vpu_devfreq_table[vpu_devfreq_states - 1] >= rate)
+			continue;
+		vpu_devfreq_table[vpu_devfreq_states++] = rate;
+	}
+	if (!vpu_devfreq_states)
+		return -EINVAL;
+
+	vpu_devfreq_profile.initial_freq = clk_get_rate(vpu_clk);
+	vpu_devfreq_profile.max_state = vpu_devfreq_states;
+	vpu_busy_window = ktime_to_ns(ktime_get());
+
+	vpu_devfreq = devfreq_add_device(dev, &vpu_devfreq_profile,
+					 "simple_ondemand", &vpu_ondemand_data);
+	if (IS_ERR(vpu_devfreq)) {
+		i = PTR_ERR(vpu_devfreq);
+		vpu_devfreq = NULL;
+		return i;
+	}
+	return 0;
+}
+
+static void vpu_devfreq_exit(void)
+{
+	if (vpu_devfreq)
+		devfreq_remove_device(vpu_devfreq);
+	vpu_devfreq = NULL;
+	vpu_bus_freq(false);
+}
 #endif
 
-#ifdef CONFIG_SOC_IMX6Q
-		clk_prepare(vpu_clk);
-		clk_enable(vpu_clk);
-		if (READ_REG(BIT_CUR_PC))
-			pr_debug("Not power off before vpu open!\n");
-		clk_disable(vpu_clk);
-		clk_unprepare(vpu_clk);
+
+static inline struct device *vpu_dma_dev(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	return vpu_pdev ? &vpu_pdev->dev : NULL;
+#else
+	return NULL;
 #endif
+}
+
+/*
+ * Handle of a device-wide buffer. Never 0, which userspace uses for "no
+ * buffer", and never one a file's IDR hands out.
+ */
+static u32 vpu_new_handle(void)
+{
+	u32 h;
+
+	do {
+		h = atomic_inc_return(&vpu_handle_seq) | VPU_SHARED_HANDLE;
+	} while (h == VPU_VSHARE_MMAP_OFFSET);
+	return h;
+}
+
+/*
+ * Buffer descriptors are handled as struct vpu_mem_desc_v2 inside the
+ * driver; these convert from and to what the caller passed, the original
+ * struct vpu_mem_desc or the _V2 one.
+ */
+static int vpu_get_desc(u_long arg, bool v2, struct vpu_mem_desc_v2 *desc)
+{
+	struct vpu_mem_desc mem;
+
+	if (v2) {
+		if (copy_from_user(desc, (void __user *)arg, sizeof(*desc)))
+			return -EFAULT;
+		return desc->flags ? -EINVAL : 0;
 	}
 
-	filp->private_data = (void *)(&vpu_data);
-	mutex_unlock(&vpu_data.lock);
+	if (copy_from_user(&mem, (void __user *)arg, sizeof(mem)))
+		return -EFAULT;
+	memset(desc, 0, sizeof(*desc));
+	desc->size = mem.size;
+	desc->handle = mem.cpu_addr;
+	desc->phy_addr = mem.phy_addr;
+	desc->virt_uaddr = mem.virt_uaddr;
 	return 0;
 }
 
+static int vpu_put_desc(u_long arg, bool v2,
+			const struct vpu_mem_desc_v2 *desc)
+{
+	struct vpu_mem_desc mem;
+
+	if (v2)
+		return copy_to_user((void __user *)arg, desc, sizeof(*desc)) ?
+			-EFAULT : 0;
+
+	mem.size = desc->size;
+	mem.phy_addr = desc->phy_addr;
+	mem.cpu_addr = desc->handle;
+	mem.virt_uaddr = desc->virt_uaddr;
+	return copy_to_user((void __user *)arg, &mem, sizeof(mem)) ?
+		-EFAULT : 0;
+}
+
+static void vpu_buf_to_desc(const struct vpu_dma_buf *mem,
+			    struct vpu_mem_desc_v2 *desc)
+{
+	memset(desc, 0, sizeof(*desc));
+	desc->size = mem->size;
+	desc->handle = mem->handle;
+	desc->phy_addr = mem->phy_addr;
+	desc->virt_uaddr = mem->virt_uaddr;
+	if (mem->handle == VPU_VSHARE_MMAP_OFFSET)
+		desc->mmap_offset = VPU_VSHARE_MMAP_OFFSET;
+	else if (mem->handle & VPU_SHARED_HANDLE)
+		desc->mmap_offset = mem->phy_addr;
+	else
+		desc->mmap_offset = (u64)(VPU_MMAP_HANDLE_PGOFF +
+					  mem->handle) << PAGE_SHIFT;
+}
+
 /*!
- * @brief IO ctrl function for vpu file operation
- * @param cmd IO ctrl command
- * @return  0 on success or negative error code on error
+ * Private function to alloc dma buffer
+ * @return status  0 success.
  */
-static long vpu_ioctl(struct file *filp, u_int cmd,
-		     u_long arg)
+static int vpu_alloc_dma_buffer(struct vpu_dma_buf *mem)
 {
-	int ret = 0;
+	s64 start = 0;
+
+	/* only timed for the tracepoint, this is the allocation fast path */
+	if (trace_vpu_dma_alloc_enabled())
+		start = ktime_to_ns(ktime_get());
+
+	mem->cpu_addr = dma_alloc_coherent(vpu_dma_dev(),
+					   PAGE_ALIGN(mem->size),
+					   &mem->phy_addr,
+					   GFP_DMA | GFP_KERNEL);
+	pr_debug("[ALLOC] mem alloc cpu_addr = %p\n", mem->cpu_addr);
+	if (mem->cpu_addr == NULL) {
+		printk(KERN_ERR "Physical memory allocation error!\n");
+		return -1;
+	}
+	mem->handle = vpu_new_handle();
+	if (start)
+		trace_vpu_dma_alloc(mem->size, mem->phy_addr,
+				    ktime_to_ns(ktime_get()) - start);
+	return 0;
+}
 
-	switch (cmd) {
-	case VPU_IOC_PHYMEM_ALLOC:
-		{
-			struct memalloc_record *rec;
+/*!
+ * Private function to free dma buffer
+ */
+static void vpu_free_dma_buffer(struct vpu_dma_buf *mem)
+{
+	s64 start = 0;
+
+	if (mem->cpu_addr) {
+		if (trace_vpu_dma_free_enabled())
+			start = ktime_to_ns(ktime_get());
+		dma_free_coherent(vpu_dma_dev(), PAGE_ALIGN(mem->size),
+				  mem->cpu_addr, mem->phy_addr);
+		if (start)
+			trace_vpu_dma_free(mem->size, mem->phy_addr,
+					   ktime_to_ns(ktime_get()) - start);
+		mem->cpu_addr = NULL;
+	}
+}
 
-			rec = kzalloc(sizeof(*rec), GFP_KERNEL);
-			if (!rec)
-				return -ENOMEM;
+static inline bool vpu_is_bitwork(const struct vpu_dma_buf *mem)
+{
+	/* handles are per file, the memory is not */
+	return !bitwork_owned && bitwork_mem.cpu_addr &&
+		bitwork_mem.cpu_addr == mem->cpu_addr;
+}
 
-			ret = copy_from_user(&(rec->mem),
-					     (struct vpu_mem_desc *)arg,
-					     sizeof(struct vpu_mem_desc));
-			if (ret) {
-				kfree(rec);
-				return -EFAULT;
-			}
+/* a buffer registered with SET_BITWORK_MEM is going away */
+static void vpu_forget_bitwork(struct vpu_dma_buf *mem)
+{
+	if (vpu_is_bitwork(mem))
+		memset(&bitwork_mem, 0, sizeof(bitwork_mem));
+}
 
-			pr_debug("[ALLOC] mem alloc size = 0x%x\n",
-				 rec->mem.size);
+static void vpu_buf_release(struct kref *ref)
+{
+	struct memalloc_record *rec =
+		container_of(ref, struct memalloc_record, ref);
 
-			ret = vpu_alloc_dma_buffer(&(rec->mem));
-			if (ret == -1) {
-				kfree(rec);
-				printk(KERN_ERR
-				       "Physical memory allocation error!\n");
-				break;
-			}
-			ret = copy_to_user((void __user *)arg, &(rec->mem),
-					   sizeof(struct vpu_mem_desc));
-			if (ret) {
-				kfree(rec);
-				ret = -EFAULT;
-				break;
-			}
+	vpu_free_dma_buffer(&rec->mem);
+	kfree(rec);
+}
 
-			mutex_lock(&vpu_data.lock);
-			list_add(&rec->list, &head);
-			mutex_unlock(&vpu_data.lock);
+/* the memory goes once the last mapping or dma-buf of it is gone */
+static inline void vpu_buf_put(struct memalloc_record *rec)
+{
+	kref_put(&rec->ref, vpu_buf_release);
+}
 
-			break;
-		}
-	case VPU_IOC_PHYMEM_FREE:
-		{
-			struct memalloc_record *rec, *n;
-			struct vpu_mem_desc vpu_mem;
+static struct vpu_session *vpu_session_alloc(void)
+{
+	struct vpu_session *s;
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s)
+		return NULL;
+	mutex_init(&s->lock);
+	idr_init(&s->bufs);
+	return s;
+}
 
-			ret = copy_from_user(&vpu_mem,
-					     (struct vpu_mem_desc *)arg,
-					     sizeof(struct vpu_mem_desc));
-			if (ret)
-				return -EACCES;
+static void vpu_session_free(struct vpu_session *s)
+{
+	idr_destroy(&s->bufs);
+	kfree(s);
+}
 
-			pr_debug("[FREE] mem freed cpu_addr = 0x%x\n",
-				 vpu_mem.cpu_addr);
-			if ((void *)vpu_mem.cpu_addr != NULL)
-				vpu_free_dma_buffer(&vpu_mem);
-
-			mutex_lock(&vpu_data.lock);
-			list_for_each_entry_safe(rec, n, &head, list) {
-				if (rec->mem.cpu_addr == vpu_mem.cpu_addr) {
-					/* delete from list */
-					list_del(&rec->list);
-					kfree(rec);
-					break;
-				}
-			}
-			mutex_unlock(&vpu_data.lock);
+static int vpu_session_put_buf(int id, void *p, void *data)
+{
+	struct memalloc_record *rec = p;
 
-			break;
-		}
-	case VPU_IOC_WAIT4INT:
-		{
-			u_long timeout = (u_long) arg;
-			if (!wait_event_interruptible_timeout
-			    (vpu_queue, irq_status != 0,
-			     msecs_to_jiffies(timeout))) {
-				printk(KERN_WARNING "VPU blocking: timeout.\n");
-				ret = -ETIME;
-			} else if (signal_pending(current)) {
-				printk(KERN_WARNING
-				       "VPU interrupt received.\n");
-				ret = -ERESTARTSYS;
-			} else
-				irq_status = 0;
-			break;
-		}
-	case VPU_IOC_IRAM_SETTING:
-		{
-			ret = copy_to_user((void __user *)arg, &iram,
-					   sizeof(struct iram_setting));
-			if (ret)
-				ret = -EFAULT;
+	/*
+	 * The registered work buffer is used by every instance, it stays on
+	 * the list for the last close.
+	 */
+	if (vpu_is_bitwork(&rec->mem))
+		return 0;
+	list_del_init(&rec->list);
+	vpu_stat_inc(free_count);
+	vpu_stat_add(free_bytes, PAGE_ALIGN(rec->mem.size));
+	vpu_buf_put(rec);
+	return 0;
+}
 
-			break;
-		}
-	case VPU_IOC_CLKGATE_SETTING:
-		{
-			u32 clkgate_en;
+/* gives rec a handle of the session */
+static int vpu_session_add(struct vpu_session *s,
+			   struct memalloc_record *rec)
+{
+	int id, ret = 0;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 9, 0)
+	mutex_lock(&s->lock);
+	id = idr_alloc(&s->bufs, rec, 1, 0, GFP_KERNEL);
+	mutex_unlock(&s->lock);
+	if (id < 0)
+		ret = id;
+#else
+	do {
+		if (!idr_pre_get(&s->bufs, GFP_KERNEL))
+			return -ENOMEM;
+		mutex_lock(&s->lock);
+		ret = idr_get_new_above(&s->bufs, rec, 1, &id);
+		mutex_unlock(&s->lock);
+	} while (ret == -EAGAIN);
+#endif
+	if (ret)
+		return ret;
+	rec->mem.handle = id;
+	return 0;
+}
 
-			if (get_user(clkgate_en, (u32 __user *) arg))
-				return -EFAULT;
+/* looks up a buffer of the session and takes a reference on it */
+static struct memalloc_record *vpu_session_get(struct vpu_session *s,
+					       u64 handle)
+{
+	struct memalloc_record *rec;
+
+	if (!handle || handle >= VPU_SHARED_HANDLE)
+		return NULL;
+	mutex_lock(&s->lock);
+	rec = idr_find(&s->bufs, handle);
+	if (rec)
+		kref_get(&rec->ref);
+	mutex_unlock(&s->lock);
+	return rec;
+}
 
-			if (clkgate_en) {
-				clk_prepare(vpu_clk);
-				clk_enable(vpu_clk);
-				atomic_inc(&clk_cnt_from_ioc);
-			} else {
-				clk_disable(vpu_clk);
-				clk_unprepare(vpu_clk);
-				atomic_dec(&clk_cnt_from_ioc);
-			}
+/* takes a buffer out of the session; the caller inherits its reference */
+static struct memalloc_record *vpu_session_remove(struct vpu_session *s,
+						  u64 handle)
+{
+	struct memalloc_record *rec;
+
+	if (!handle || handle >= VPU_SHARED_HANDLE)
+		return NULL;
+	mutex_lock(&s->lock);
+	rec = idr_find(&s->bufs, handle);
+	if (rec)
+		idr_remove(&s->bufs, handle);
+	mutex_unlock(&s->lock);
+	return rec;
+}
 
-			break;
-		}
-	case VPU_IOC_GET_SHARE_MEM:
-		{
-			mutex_lock(&vpu_data.lock);
-			if (share_mem.cpu_addr != 0) {
-				ret = copy_to_user((void __user *)arg,
-						   &share_mem,
-						   sizeof(struct vpu_mem_desc));
-				mutex_unlock(&vpu_data.lock);
-				break;
-			} else {
-				if (copy_from_user(&share_mem,
-						   (struct vpu_mem_desc *)arg,
-						 sizeof(struct vpu_mem_desc))) {
-					mutex_unlock(&vpu_data.lock);
-					return -EFAULT;
-				}
-				if (vpu_alloc_dma_buffer(&share_mem) == -1)
-					ret = -EFAULT;
-				else {
-					if (copy_to_user((void __user *)arg,
-							 &share_mem,
-							 sizeof(struct
-								vpu_mem_desc)))
-						ret = -EFAULT;
-				}
-			}
-			mutex_unlock(&vpu_data.lock);
-			break;
-		}
-	case VPU_IOC_REQ_VSHARE_MEM:
-		{
-			mutex_lock(&vpu_data.lock);
-			if (vshare_mem.cpu_addr != 0) {
-				ret = copy_to_user((void __user *)arg,
-						   &vshare_mem,
-						   sizeof(struct vpu_mem_desc));
-				mutex_unlock(&vpu_data.lock);
-				break;
-			} else {
-				if (copy_from_user(&vshare_mem,
-						   (struct vpu_mem_desc *)arg,
-						   sizeof(struct
-							  vpu_mem_desc))) {
-					mutex_unlock(&vpu_data.lock);
-					return -EFAULT;
-				}
-				/* vmalloc shared memory if not allocated */
-				if (!vshare_mem.cpu_addr)
-					vshare_mem.cpu_addr =
-					    (unsigned long)
-					    vmalloc_user(vshare_mem.size);
-				if (copy_to_user
-				     ((void __user *)arg, &vshare_mem,
-				     sizeof(struct vpu_mem_desc)))
-					ret = -EFAULT;
-			}
-			mutex_unlock(&vpu_data.lock);
-			break;
-		}
-	case VPU_IOC_GET_WORK_ADDR:
-		{
-			if (bitwork_mem.cpu_addr != 0) {
-				ret =
-				    copy_to_user((void __user *)arg,
-						 &bitwork_mem,
-						 sizeof(struct vpu_mem_desc));
-				break;
-			} else {
-				if (copy_from_user(&bitwork_mem,
-						   (struct vpu_mem_desc *)arg,
-						   sizeof(struct vpu_mem_desc)))
-					return -EFAULT;
+/* PHYMEM_ALLOC: a buffer on the allocation list, with a handle of s */
+static struct memalloc_record *vpu_buf_alloc(struct vpu_session *s,
+					     u32 size)
+{
+	struct memalloc_record *rec;
+	int ret;
 
-				if (vpu_alloc_dma_buffer(&bitwork_mem) == -1)
-					ret = -EFAULT;
-				else if (copy_to_user((void __user *)arg,
-						      &bitwork_mem,
-						      sizeof(struct
-							     vpu_mem_desc)))
-					ret = -EFAULT;
-			}
-			break;
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return ERR_PTR(-ENOMEM);
+	kref_init(&rec->ref);
+	rec->mem.size = size;
+
+	pr_debug("[ALLOC] mem alloc size = 0x%x\n", rec->mem.size);
+
+	ret = vpu_alloc_dma_buffer(&(rec->mem));
+	if (ret == -1) {
+		kfree(rec);
+		printk(KERN_ERR "Physical memory allocation error!\n");
+		return ERR_PTR(ret);
+	}
+
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_ALLOC);
+	list_add(&rec->list, &head);
+	vpu_mutex_unlock(&vpu_buf_lock);
+
+	/* the handle makes it visible to FREE */
+	ret = vpu_session_add(s, rec);
+	if (ret) {
+		vpu_mutex_lock(&vpu_buf_lock, VPU_LS_ALLOC);
+		list_del_init(&rec->list);
+		vpu_mutex_unlock(&vpu_buf_lock);
+		vpu_buf_put(rec);
+		return ERR_PTR(ret);
+	}
+
+	vpu_stat_inc(alloc_count);
+	vpu_stat_add(alloc_bytes, PAGE_ALIGN(rec->mem.size));
+	return rec;
+}
+
+/* PHYMEM_FREE: only a buffer s allocated is ever freed */
+static int vpu_buf_free(struct vpu_session *s, u64 handle)
+{
+	struct memalloc_record *rec;
+
+	rec = vpu_session_remove(s, handle);
+	if (!rec)
+		return -EINVAL;
+
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_FREE);
+	/* delete from list */
+	list_del_init(&rec->list);
+	vpu_forget_bitwork(&rec->mem);
+	vpu_mutex_unlock(&vpu_buf_lock);
+
+	vpu_stat_inc(free_count);
+	vpu_stat_add(free_bytes, PAGE_ALIGN(rec->mem.size));
+	/* mappings and dma-bufs of it keep the memory */
+	vpu_buf_put(rec);
+	return 0;
+}
+
+/*!
+ * Private function to free buffers
+ * @return status  0 success.
+ */
+static int vpu_free_buffers(void)
+{
+	struct memalloc_record *rec, *n;
+
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_PUT_BUFS);
+	list_for_each_entry_safe(rec, n, &head, list) {
+		vpu_forget_bitwork(&rec->mem);
+		pr_debug("[FREE] freed handle=0x%08X\n", rec->mem.handle);
+		/* delete from list */
+		list_del_init(&rec->list);
+		vpu_buf_put(rec);
+	}
+	vpu_mutex_unlock(&vpu_buf_lock);
+
+	return 0;
+}
+
+/*
+ * Shared regions, created by SHM_GET under vpu_share_lock and freed with
+ * the last close. seq and completed are the driver's own copies of what
+ * it publishes, which userspace can write to.
+ */
+struct vpu_shm {
+	struct vpu_shm_hdr *hdr;	/* vmalloc_user, mapped by userspace */
+	u32 size;
+	spinlock_t lock;		/* completions */
+	u32 seq;
+	u32 completed;
+	u32 failed;
+};
+
+static struct vpu_shm *vpu_shm[VPU_SHM_REGIONS];
+
+static void vpu_shm_post(struct vpu_shm *shm, int result, u32 reason,
+			 s64 now)
+{
+	struct vpu_shm_hdr *h = shm->hdr;
+
+	spin_lock(&shm->lock);
+	WRITE_ONCE(h->seq, ++shm->seq);
+	smp_wmb();
+	h->last_result = result;
+	h->last_int_reason = reason;
+	h->last_done_ns = now;
+	if (result)
+		WRITE_ONCE(h->failed, ++shm->failed);
+	smp_wmb();
+	WRITE_ONCE(h->seq, ++shm->seq);
+	smp_store_release(&h->completed, ++shm->completed);
+	spin_unlock(&shm->lock);
+}
+
+/*
+ * A job completed, as the worker (on its done interrupt) or the watchdog
+ * sees it: before the device is released, so its owner is still the
+ * file it ran for.
+ */
+static void vpu_shm_complete(int result, u32 reason, u32 instance)
+{
+	struct vpu_shm *inst = NULL, *group = NULL;
+	struct vpu_session *s;
+	s64 now = ktime_to_ns(ktime_get());
+
+	if (instance < VPU_BS_MAX_INSTANCES)
+		inst = READ_ONCE(vpu_shm[instance]);
+
+	spin_lock(&vpu_ring_lock);
+	if (vpu_ring_job)
+		group = READ_ONCE(vpu_ring_job->s->shm_group);
+	spin_unlock(&vpu_ring_lock);
+	if (!group) {
+		spin_lock(&vpu_hw_lock);
+		s = vpu_hw_owner;
+		if (s && s != &vpu_ring_owner)
+			group = READ_ONCE(s->shm_group);
+		spin_unlock(&vpu_hw_lock);
+	}
+
+	if (inst)
+		vpu_shm_post(inst, result, reason, now);
+	if (group)
+		vpu_shm_post(group, result, reason, now);
+}
+
+static int vpu_shm_get(struct vpu_session *s, u_long arg)
+{
+	struct vpu_shm_req req;
+	struct vpu_shm *shm;
+	u32 idx;
+	int ret = 0;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+	if (req.flags & ~VPU_SHM_GROUP || req.reserved ||
+	    req.size > VPU_SHM_MAX_SIZE)
+		return -EINVAL;
+	if (req.flags & VPU_SHM_GROUP) {
+		if (req.id >= VPU_SHM_MAX_GROUPS)
+			return -EINVAL;
+		idx = VPU_BS_MAX_INSTANCES + req.id;
+	} else {
+		if (req.id >= VPU_BS_MAX_INSTANCES)
+			return -EINVAL;
+		idx = req.id;
+	}
+
+	vpu_mutex_lock(&vpu_share_lock, VPU_LS_SHM);
+	shm = vpu_shm[idx];
+	if (!shm) {
+		shm = kzalloc(sizeof(*shm), GFP_KERNEL);
+		if (shm) {
+			shm->size = PAGE_ALIGN(max_t(u32, req.size,
+					sizeof(struct vpu_shm_hdr)));
+			shm->hdr = vmalloc_user(shm->size);
+		}
+		if (!shm || !shm->hdr) {
+			kfree(shm);
+			vpu_mutex_unlock(&vpu_share_lock);
+			return -ENOMEM;
 		}
+		spin_lock_init(&shm->lock);
+		shm->hdr->magic = VPU_SHM_MAGIC;
+		shm->hdr->size = shm->size;
+		shm->hdr->data_off = ALIGN(sizeof(struct vpu_shm_hdr), 64);
+		shm->hdr->id = req.id;
+		shm->hdr->flags = req.flags;
+		/* the pointer is read by completions without the lock */
+		smp_store_release(&vpu_shm[idx], shm);
+	}
+	vpu_mutex_unlock(&vpu_share_lock);
+
+	if (req.flags & VPU_SHM_GROUP) {
+		mutex_lock(&s->lock);
+		if (!s->shm_group)
+			WRITE_ONCE(s->shm_group, shm);
+		else if (s->shm_group != shm)
+			ret = -EBUSY;
+		mutex_unlock(&s->lock);
+		if (ret)
+			return ret;
+	}
+
+	req.size = shm->size;
+	req.mmap_offset = VPU_SHM_MMAP_OFFSET + idx * VPU_SHM_MAX_SIZE;
+	return copy_to_user((void __user *)arg, &req, sizeof(req)) ?
+		-EFAULT : 0;
+}
+
+/* with the last close, nothing completes any more */
+static void vpu_shm_free(void)
+{
+	int i;
+
+	for (i = 0; i < VPU_SHM_REGIONS; i++) {
+		if (!vpu_shm[i])
+			continue;
+		vfree(vpu_shm[i]->hdr);
+		kfree(vpu_shm[i]);
+		vpu_shm[i] = NULL;
+	}
+}
+
+static inline void vpu_worker_callback(struct work_struct *w)
+{
+	struct vpu_priv *dev = container_of(w, struct vpu_priv,
+				work);
+
+	u32 done;
+
+	trace_vpu_worker_wakeup(codec_done);
+
 	/*
-	 * The following two ioctl is used when user allocates working buffer
-	 * and register it to vpu driver.
+	 * A ring job has no waiter, its done interrupt completes it on the
+	 * ring; other interrupts on the way are not for anybody.
 	 */
-	case VPU_IOC_QUERY_BITWORK_MEM:
-		{
-			if (copy_to_user((void __user *)arg,
-					 &bitwork_mem,
-					 sizeof(struct vpu_mem_desc)))
-				ret = -EFAULT;
-			break;
-		}
-	case VPU_IOC_SET_BITWORK_MEM:
-		{
-			if (copy_from_user(&bitwork_mem,
-					   (struct vpu_mem_desc *)arg,
-					   sizeof(struct vpu_mem_desc)))
-				ret = -EFAULT;
-			break;
+	if (vpu_bit_irq) {
+		vpu_bit_irq = false;
+		done = xchg(&vpu_bit_irq_done, 0);
+		if (done) {
+			vpu_shm_complete(0, done, vpu_bit_irq_index);
+			if (vpu_ring_complete(NULL, 0, 0, done)) {
+				codec_done = 0;
+				return;
+			}
+		} else if (READ_ONCE(vpu_ring_busy)) {
+			return;
 		}
-	case VPU_IOC_SYS_SW_RESET:
-		{
+	}
+
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+
+	vpu_wdt_next();
+	irq_status = 1;
+	/*
+	 * Clock is gated on when dec/enc started, gate it off when
+	 * codec is done.
+	 */
+	if (codec_done)
+		codec_done = 0;
+
+	wake_up_interruptible(&vpu_queue);
+}
+
+/*
+ * Instances with a bitstream ring, whose read pointers the interrupt
+ * handler picks up.
+ */
+static struct vpu_bs *vpu_bs_inst[VPU_BS_MAX_INSTANCES];
+static DEFINE_SPINLOCK(vpu_bs_lock);
+
+/*
+ * Codec instances taken by bitstream rings, under vpu_bs_lock. Legacy
+ * clients pick theirs in userspace through BIT_RUN_INDEX and are not
+ * seen here.
+ */
+static unsigned long vpu_inst_used;
+
+/* takes instance, -EBUSY if it is taken */
+static int vpu_inst_get(u32 instance)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&vpu_bs_lock, flags);
+	if (test_bit(instance, &vpu_inst_used))
+		ret = -EBUSY;
+	else
+		__set_bit(instance, &vpu_inst_used);
+	spin_unlock_irqrestore(&vpu_bs_lock, flags);
+	return ret;
+}
+
+static void vpu_inst_put(u32 instance)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vpu_bs_lock, flags);
+	__clear_bit(instance, &vpu_inst_used);
+	spin_unlock_irqrestore(&vpu_bs_lock, flags);
+}
+
+static inline u32 vpu_bs_used(struct vpu_bs *bs)
+{
+	return (READ_ONCE(bs->wr) - READ_ONCE(bs->rd)) & (bs->size - 1);
+}
+
+/* reads back how far the VPU got, clock must be on */
+static void vpu_bs_sync_rd(struct vpu_bs *bs)
+{
+	u32 rd = READ_REG(BIT_RD_PTR_REG(bs->instance)) - (u32)bs->mem.phy_addr;
+
+	/* until the codec is opened on the ring, it may point elsewhere */
+	if (rd <= bs->size)
+		WRITE_ONCE(bs->rd, rd & (bs->size - 1));
+}
+
+/* queues what the encoder wrote in the job that just finished */
+static void vpu_bs_frame_done(struct vpu_bs *bs)
+{
+	struct vpu_bs_chunk *f;
+	u32 wr, len;
+
+	wr = READ_REG(BIT_WR_PTR_REG(bs->instance)) - (u32)bs->mem.phy_addr;
+	if (wr > bs->size)
+		return;
+	wr &= bs->size - 1;
+	len = (wr - bs->wr) & (bs->size - 1);
+	if (!len)
+		return;
+
+	if (bs->nr_frames == VPU_BS_MAX_FRAMES) {
+		/* nobody reads, the boundary goes rather than the data */
+		f = &bs->frames[(bs->frame_first + bs->nr_frames - 1) %
+				VPU_BS_MAX_FRAMES];
+		f->len += len;
+	} else {
+		f = &bs->frames[(bs->frame_first + bs->nr_frames) %
+				VPU_BS_MAX_FRAMES];
+		f->off = bs->wr;
+		f->len = len;
+		f->run_cmd = READ_REG(BIT_RUN_COMMAND);
+		f->ts = ktime_to_ns(ktime_get());
+		bs->nr_frames++;
+	}
+	WRITE_ONCE(bs->wr, wr);
+}
+
+/* idx is the instance of the job that finished, if one did */
+static void vpu_bs_irq(u32 idx)
+{
+	struct vpu_bs *bs;
+	int i;
+
+	spin_lock(&vpu_bs_lock);
+	for (i = 0; i < VPU_BS_MAX_INSTANCES; i++) {
+		bs = vpu_bs_inst[i];
+		if (!bs)
+			continue;
+		if (!bs->encode)
+			vpu_bs_sync_rd(bs);
+		else if (i == idx)
+			vpu_bs_frame_done(bs);
+		wake_up_interruptible(&bs->wait);
+	}
+	spin_unlock(&vpu_bs_lock);
+}
+
+/*!
+ * @brief vpu interrupt handler
+ */
+static irqreturn_t vpu_ipi_irq_handler(int irq, void *dev_id)
+{
+	struct vpu_priv *dev = dev_id;
+	u32 idx = VPU_BS_MAX_INSTANCES;
+	unsigned long reg;
+	s64 job_ns;
+
+	vpu_stat_inc(irqs[VPU_ENGINE_BIT]);
+	reg = READ_REG(BIT_INT_REASON);
+	trace_vpu_irq(VPU_ENGINE_BIT, reg, !!(reg & 0x8));
+	if (unlikely(vpu_rec_on)) {
+		u32 a[4] = { reg };
+
+		vpu_record(VPU_REC_IRQ, NULL, VPU_ENGINE_BIT, 0,
+			   ktime_to_ns(ktime_get()), a);
+	}
+	if (reg & 0x8) {
+		codec_done = 1;
+		job_ns = vpu_busy_stop(VPU_ENGINE_BIT);
+		if (job_ns)
+			vpu_hist_add(VPU_HIST_JOB, VPU_ENGINE_BIT, job_ns);
+		vpu_stat_inc(jobs[VPU_ENGINE_BIT]);
+		vpu_irq_engine = VPU_ENGINE_BIT;
+		atomic64_set(&vpu_irq_ns, ktime_to_ns(ktime_get()));
+		idx = READ_REG(BIT_RUN_INDEX);
+		vpu_bit_irq_index = idx;
+		WRITE_ONCE(vpu_bit_irq_done, reg);
+	}
+	vpu_bit_irq = true;
+	vpu_bs_irq(idx);
+	WRITE_REG(0x1, BIT_INT_CLEAR);
+
+	queue_work(dev->workqueue, &dev->work);
+
+	return IRQ_HANDLED;
+}
+
+/*!
+ * @brief vpu jpu interrupt handler
+ */
+#ifdef MXC_VPU_HAS_JPU
+static irqreturn_t vpu_jpu_irq_handler(int irq, void *dev_id)
+{
+	struct vpu_priv *dev = dev_id;
+	unsigned long reg;
+	s64 job_ns;
+
+	vpu_stat_inc(irqs[VPU_ENGINE_JPU]);
+	reg = READ_REG(MJPEG_PIC_STATUS_REG);
+	trace_vpu_irq(VPU_ENGINE_JPU, reg, !!(reg & 0x3));
+	if (unlikely(vpu_rec_on)) {
+		u32 a[4] = { reg };
+
+		vpu_record(VPU_REC_IRQ, NULL, VPU_ENGINE_JPU, 0,
+			   ktime_to_ns(ktime_get()), a);
+	}
+	if (reg & 0x3) {
+		codec_done = 1;
+		job_ns = vpu_busy_stop(VPU_ENGINE_JPU);
+		if (job_ns)
+			vpu_hist_add(VPU_HIST_JOB, VPU_ENGINE_JPU, job_ns);
+		vpu_stat_inc(jobs[VPU_ENGINE_JPU]);
+		vpu_irq_engine = VPU_ENGINE_JPU;
+		atomic64_set(&vpu_irq_ns, ktime_to_ns(ktime_get()));
+	}
+
+	queue_work(dev->workqueue, &dev->work);
+
+	return IRQ_HANDLED;
+}
+#endif
+
+static int vpu_hw_reset(void)
+{
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
-			imx_src_reset_vpu();
+	if (vpu_plat && vpu_plat->reset) {
+		vpu_plat->reset();
+		return 0;
+	}
+	return imx_src_reset_vpu();
 #else
-			if (vpu_plat->reset)
-				vpu_plat->reset();
+	if (vpu_plat->reset)
+		vpu_plat->reset();
+	return 0;
 #endif
+}
 
-			break;
-		}
-	case VPU_IOC_REG_DUMP:
-		break;
-	case VPU_IOC_PHYMEM_DUMP:
-		break;
-	case VPU_IOC_PHYMEM_CHECK:
-	{
-		struct vpu_mem_desc check_memory;
-		ret = copy_from_user(&check_memory,
-				     (void __user *)arg,
-				     sizeof(struct vpu_mem_desc));
-		if (ret != 0) {
-			printk(KERN_ERR "copy from user failure:%d\n", ret);
-			ret = -EFAULT;
-			break;
-		}
-		ret = vpu_is_valid_phy_memory((u32)check_memory.phy_addr);
+#ifdef CONFIG_SOC_IMX6Q
+/*
+ * Ask the VPU to stop issuing bus transactions before it is reset.
+ * Clock must be on. Returns -ETIMEDOUT if the bus never went idle.
+ */
+static int vpu_bus_idle_handshake(unsigned int timeout_us)
+{
+	unsigned long timeout = jiffies + usecs_to_jiffies(timeout_us) + 1;
 
-		pr_debug("vpu: memory phy:0x%x %s phy memory\n",
-		       check_memory.phy_addr, (ret ? "is" : "isn't"));
-		/* borrow .size to pass back the result. */
-		check_memory.size = ret;
-		ret = copy_to_user((void __user *)arg, &check_memory,
-				   sizeof(struct vpu_mem_desc));
-		if (ret) {
-			ret = -EFAULT;
+	WRITE_REG(0x11, 0x10F0);
+	while (READ_REG(0x10F4) != 0x77) {
+		if (time_after(jiffies, timeout))
 			break;
-		}
-		break;
+		usleep_range(100, 200);
 	}
-	case VPU_IOC_LOCK_DEV:
-		{
-			u32 lock_en;
 
-			if (get_user(lock_en, (u32 __user *) arg))
-				return -EFAULT;
+	if (READ_REG(0x10F4) != 0x77) {
+		WRITE_REG(0x0, 0x10F0);
+		return -ETIMEDOUT;
+	}
+	return 0;
+}
+#endif
+
+/* Save the firmware context registers, clock must be on */
+static void vpu_save_context(void)
+{
+	int i;
+
+	/* Save 64 registers from BIT_CODE_BUF_ADDR */
+	for (i = 0; i < 64; i++)
+		regBk[i] = READ_REG(BIT_CODE_BUF_ADDR + (i * 4));
+	pc_before_suspend = READ_REG(BIT_CUR_PC);
+}
+
+/*
+ * Restore the context saved by vpu_save_context() into a freshly reset
+ * or powered up VPU, re-load the boot code and restart it. Clock must be
+ * on and bitwork_mem allocated.
+ */
+static int vpu_restore_context(void)
+{
+	u32 *p = bitwork_mem.cpu_addr;
+	u32 data;
+	u16 data_hi;
+	u16 data_lo;
+	int i;
+
+	/* Restore registers */
+	for (i = 0; i < 64; i++)
+		WRITE_REG(regBk[i], BIT_CODE_BUF_ADDR + (i * 4));
+
+	WRITE_REG(0x0, BIT_RESET_CTRL);
+	WRITE_REG(0x0, BIT_CODE_RUN);
+	/* MX6 RTL has a bug not to init MBC_SET_SUBBLK_EN on reset */
+#ifdef CONFIG_SOC_IMX6Q
+	WRITE_REG(0x0, MBC_SET_SUBBLK_EN);
+#endif
+
+	/*
+	 * Re-load boot code, from the codebuffer in external RAM.
+	 * Thankfully, we only need 4096 bytes, same for all platforms.
+	 */
+	for (i = 0; i < 2048; i += 4) {
+		data = p[(i / 2) + 1];
+		data_hi = (data >> 16) & 0xFFFF;
+		data_lo = data & 0xFFFF;
+		WRITE_REG((i << 16) | data_hi, BIT_CODE_DOWN);
+		WRITE_REG(((i + 1) << 16) | data_lo,
+				BIT_CODE_DOWN);
+
+		data = p[i / 2];
+		data_hi = (data >> 16) & 0xFFFF;
+		data_lo = data & 0xFFFF;
+		WRITE_REG(((i + 2) << 16) | data_hi,
+				BIT_CODE_DOWN);
+		WRITE_REG(((i + 3) << 16) | data_lo,
+				BIT_CODE_DOWN);
+	}
+
+	if (!pc_before_suspend) {
+		printk(KERN_WARNING "PC=0 before suspend\n");
+		return 0;
+	}
+
+	WRITE_REG(0x1, BIT_BUSY_FLAG);
+	WRITE_REG(0x1, BIT_CODE_RUN);
+	return vpu_poll_clear(vpu_base + BIT_BUSY_FLAG, 0x1,
+			      VPU_BOOT_TIMEOUT_US, 50, &vpu_seq_times.boot_ns);
+}
+
+static void vpu_wdt_schedule(void)
+{
+	/* freezable: it never runs between suspend and resume */
+	if (watchdog_ms)
+		mod_delayed_work(system_freezable_wq, &vpu_wdt_work,
+				 msecs_to_jiffies(watchdog_ms));
+}
+
+/* names the next job, under vpu_hw_lock */
+static u32 vpu_wdt_next_job(void)
+{
+	if (!++vpu_wdt_seq)
+		vpu_wdt_seq = 1;
+	vpu_wdt_job = vpu_wdt_seq;
+	return vpu_wdt_job;
+}
+
+/* a job starts on the device its caller owns */
+static u32 vpu_wdt_arm(void)
+{
+	u32 job;
+
+	spin_lock(&vpu_hw_lock);
+	job = vpu_wdt_next_job();
+	spin_unlock(&vpu_hw_lock);
+	vpu_wdt_schedule();
+	return job;
+}
+
+/* a LOCK_DEV holder's job finished, its next one gets a deadline anew */
+static void vpu_wdt_next(void)
+{
+	bool held;
+
+	spin_lock(&vpu_hw_lock);
+	held = vpu_wdt_job && vpu_hw_owner != &vpu_ring_owner;
+	if (held)
+		vpu_wdt_next_job();
+	spin_unlock(&vpu_hw_lock);
+	if (held)
+		vpu_wdt_schedule();
+}
+
+/*
+ * Reset a VPU stuck in a job and bring its firmware back with the current
+ * context. Clock must be on.
+ */
+static int vpu_hw_recover(void)
+{
+	int ret;
+
+	vpu_save_context();
+#ifdef CONFIG_SOC_IMX6Q
+	if ((cpu_is_mx6dl() || cpu_is_mx6q()) &&
+	    vpu_bus_idle_handshake(10 * USEC_PER_MSEC))
+		printk(KERN_ERR "VPU: bus did not go idle before reset\n");
+#endif
+	ret = vpu_hw_reset();
+	if (!ret && bitwork_mem.cpu_addr)
+		ret = vpu_restore_context();
+	return ret;
+}
+
+/*
+ * Completes job (0 for whichever runs) towards its waiter, failed or
+ * not: a ring job posts its CQE, a LOCK_DEV holder's WAIT4INT returns.
+ */
+static void vpu_wdt_complete_job(u32 job, bool failed)
+{
+	struct vpu_session *s;
+	int result = failed ? -EIO : 0;
+
+	spin_lock(&vpu_hw_lock);
+	s = vpu_hw_owner;
+	if (!vpu_wdt_job || (job && job != vpu_wdt_job))
+		s = NULL;
+	spin_unlock(&vpu_hw_lock);
+	if (!s)
+		return;
+
+	vpu_busy_stop(VPU_ENGINE_BIT);
+	codec_done = 0;
+	vpu_shm_complete(result, 0, VPU_BS_MAX_INSTANCES);
+	if (s == &vpu_ring_owner) {
+		vpu_ring_complete(NULL, job, result, 0);
+		return;
+	}
+
+	/* unless it unlocked meanwhile, the holder goes on with the device */
+	spin_lock(&vpu_hw_lock);
+	if (vpu_hw_owner != s || !vpu_wdt_job) {
+		spin_unlock(&vpu_hw_lock);
+		return;
+	}
+	if (failed)
+		s->job_failed = true;
+	vpu_wdt_next_job();
+	spin_unlock(&vpu_hw_lock);
+	vpu_wdt_schedule();
+
+	irq_status = 1;
+	wake_up_interruptible(&vpu_queue);
+}
+
+static void vpu_wdt_work_fn(struct work_struct *w)
+{
+	struct vpu_session *s;
+	s64 start;
+	u32 job;
+	int ret;
+
+	/* suspend and release save and restore the context under it too */
+	vpu_lock(VPU_LS_WATCHDOG);
+	spin_lock(&vpu_hw_lock);
+	job = vpu_wdt_job;
+	s = vpu_hw_owner;
+	spin_unlock(&vpu_hw_lock);
+	if (!job || !s)
+		goto unlock;
+
+	start = ktime_to_ns(ktime_get());
+	clk_prepare(vpu_clk);
+	clk_enable(vpu_clk);
+
+	if (!READ_REG(BIT_BUSY_FLAG)) {
+		/* a holder between jobs, nobody waits for an interrupt */
+		if (s != &vpu_ring_owner && !waitqueue_active(&vpu_queue)) {
+			vpu_wdt_next();
+			goto out;
+		}
+		/* finished, but the interrupt got lost on the way */
+		printk(KERN_WARNING "VPU watchdog: job done, no interrupt\n");
+		vpu_wdt_complete_job(job, false);
+		goto out;
+	}
+
+	printk(KERN_ERR "VPU watchdog: job hung for %u ms (PC=0x%x), resetting\n",
+	       watchdog_ms, READ_REG(BIT_CUR_PC));
+
+	ret = vpu_hw_recover();
+	if (ret)
+		printk(KERN_ERR "VPU watchdog: recovery failed (%d)\n", ret);
+
+	vpu_wdt_complete_job(job, true);
+	vpu_wdt_recoveries++;
+	vpu_wdt_recover_ns = ktime_to_ns(ktime_get()) - start;
+	printk(KERN_INFO "VPU watchdog: recovered in %lld us\n",
+	       div_s64(vpu_wdt_recover_ns, NSEC_PER_USEC));
+out:
+	clk_disable(vpu_clk);
+	clk_unprepare(vpu_clk);
+unlock:
+	vpu_unlock();
+}
+
+/*!
+ * @brief check phy memory prepare to pass to vpu is valid or not, we
+ * already address some issue that if pass a wrong address to vpu
+ * (like virtual address), system will hang.
+ *
+ * @return true return is a valid phy memory address, false return not.
+ */
+bool vpu_is_valid_phy_memory(u32 paddr)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
+	if (paddr > top_address_DRAM)
+		return false;
+#endif
+
+	return true;
+}
+
+/* maps pages of a DMA buffer write-combined, as the VPU sees them */
+static int vpu_remap_dma(struct vm_area_struct *vm, unsigned long pfn)
+{
+	vm->vm_flags |= VM_IO;
+	vm->vm_page_prot = pgprot_writecombine(vm->vm_page_prot);
+
+	return remap_pfn_range(vm, vm->vm_start, pfn,
+			       vm->vm_end - vm->vm_start,
+			       vm->vm_page_prot) ? -EAGAIN : 0;
+}
+
+#ifdef MXC_VPU_HAS_DMABUF
+/*
+ * Exported buffers hold a reference on their record, so the memory
+ * outlives a FREE or the close of the file that allocated it.
+ */
+static struct sg_table *vpu_dmabuf_map(struct dma_buf_attachment *at,
+				       enum dma_data_direction dir)
+{
+	struct memalloc_record *rec = at->dmabuf->priv;
+	struct sg_table *sgt;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	ret = dma_get_sgtable(vpu_dma_dev(), sgt, rec->mem.cpu_addr,
+			      rec->mem.phy_addr, PAGE_ALIGN(rec->mem.size));
+	if (ret < 0)
+		goto err_free;
+	sgt->nents = dma_map_sg(at->dev, sgt->sgl, sgt->orig_nents, dir);
+	if (!sgt->nents) {
+		ret = -ENOMEM;
+		goto err_table;
+	}
+	return sgt;
+
+err_table:
+	sg_free_table(sgt);
+err_free:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void vpu_dmabuf_unmap(struct dma_buf_attachment *at,
+			     struct sg_table *sgt,
+			     enum dma_data_direction dir)
+{
+	dma_unmap_sg(at->dev, sgt->sgl, sgt->orig_nents, dir);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void vpu_dmabuf_release(struct dma_buf *dmabuf)
+{
+	vpu_buf_put(dmabuf->priv);
+}
+
+static int vpu_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vm)
+{
+	struct memalloc_record *rec = dmabuf->priv;
+
+	/* the dma-buf core has checked vm_pgoff against the size */
+	return vpu_remap_dma(vm, PFN_DOWN(rec->mem.phy_addr) + vm->vm_pgoff);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+static void *vpu_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page)
+{
+	struct memalloc_record *rec = dmabuf->priv;
+
+	return rec->mem.cpu_addr + (page << PAGE_SHIFT);
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 11, 0)
+static void *vpu_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+	struct memalloc_record *rec = dmabuf->priv;
+
+	return rec->mem.cpu_addr;
+}
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5, 18, 0)
+static int vpu_dmabuf_vmap(struct dma_buf *dmabuf, struct dma_buf_map *map)
+{
+	struct memalloc_record *rec = dmabuf->priv;
+
+	dma_buf_map_set_vaddr(map, rec->mem.cpu_addr);
+	return 0;
+}
+#else
+static int vpu_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map)
+{
+	struct memalloc_record *rec = dmabuf->priv;
+
+	iosys_map_set_vaddr(map, rec->mem.cpu_addr);
+	return 0;
+}
+#endif
+
+static const struct dma_buf_ops vpu_dmabuf_ops = {
+	.map_dma_buf = vpu_dmabuf_map,
+	.unmap_dma_buf = vpu_dmabuf_unmap,
+	.release = vpu_dmabuf_release,
+	.mmap = vpu_dmabuf_mmap,
+	.vmap = vpu_dmabuf_vmap,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+	.kmap = vpu_dmabuf_kmap,
+	.kmap_atomic = vpu_dmabuf_kmap,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 19, 0)
+	.map = vpu_dmabuf_kmap,
+	.map_atomic = vpu_dmabuf_kmap,
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	.map = vpu_dmabuf_kmap,
+#endif
+};
+
+/*!
+ * @brief export a buffer of the file as a dma-buf
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_export_buf(struct vpu_session *s, u_long arg)
+{
+	struct vpu_export_buf exp;
+	struct memalloc_record *rec;
+	struct dma_buf *dmabuf;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	DEFINE_DMA_BUF_EXPORT_INFO(info);
+#endif
+	int fd;
+
+	if (copy_from_user(&exp, (void __user *)arg, sizeof(exp)))
+		return -EFAULT;
+	if (exp.flags & ~O_CLOEXEC)
+		return -EINVAL;
+
+	rec = vpu_session_get(s, exp.handle);
+	if (!rec)
+		return -EINVAL;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
+	dmabuf = dma_buf_export(rec, &vpu_dmabuf_ops,
+				PAGE_ALIGN(rec->mem.size), O_RDWR);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 1, 0)
+	dmabuf = dma_buf_export(rec, &vpu_dmabuf_ops,
+				PAGE_ALIGN(rec->mem.size), O_RDWR, NULL);
+#else
+	info.ops = &vpu_dmabuf_ops;
+	info.size = PAGE_ALIGN(rec->mem.size);
+	info.flags = O_RDWR;
+	info.priv = rec;
+	dmabuf = dma_buf_export(&info);
+#endif
+	if (IS_ERR(dmabuf)) {
+		vpu_buf_put(rec);
+		return PTR_ERR(dmabuf);
+	}
+
+	fd = dma_buf_fd(dmabuf, exp.flags);
+	if (fd < 0) {
+		/* drops the reference through vpu_dmabuf_release */
+		dma_buf_put(dmabuf);
+		return fd;
+	}
+
+	/* the fd is installed by now and stays with the process */
+	exp.fd = fd;
+	return copy_to_user((void __user *)arg, &exp, sizeof(exp)) ?
+		-EFAULT : 0;
+}
+#else
+static int vpu_export_buf(struct vpu_session *s, u_long arg)
+{
+	return -ENOTTY;
+}
+#endif
+
+/*
+ * Whoever registered the device (the simulator) is held by every open,
+ * so that the device is not removed under a file.
+ */
+static struct module *vpu_dev_owner(void)
+{
+	return vpu_plat ? vpu_plat->owner : NULL;
+}
+
+/*!
+ * @brief open function for vpu file operation
+ *
+ * @return  0 on success or negative error code on error
+ */
+/* a new session, the first of which powers the VPU up */
+static struct vpu_session *vpu_session_open(void)
+{
+	struct vpu_session *s;
+
+	if (!try_module_get(vpu_dev_owner()))
+		return ERR_PTR(-ENODEV);
+
+	s = vpu_session_alloc();
+	if (!s) {
+		module_put(vpu_dev_owner());
+		return ERR_PTR(-ENOMEM);
+	}
+
+	vpu_lock(VPU_LS_OPEN);
+
+	if (open_count++ == 0) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
+		if (!IS_ERR(vpu_regulator))
+			regulator_enable(vpu_regulator);
+#else
+		/*
+		 * A power-off still pending from the last close keeps its PU
+		 * and runtime PM references for this open; one that already
+		 * ran is waited for and powered up again.
+		 */
+		if (!cancel_work_sync(&vpu_power_off_work)) {
+			pm_runtime_get_sync(&vpu_pdev->dev);
+			if (vpu_pu_power(true)) {
+				pm_runtime_put_sync_suspend(&vpu_pdev->dev);
+				open_count--;
+				vpu_unlock();
+				vpu_session_free(s);
+				module_put(vpu_dev_owner());
+				return ERR_PTR(-EIO);
+			}
+		}
+#endif
+
+#ifdef CONFIG_SOC_IMX6Q
+		clk_prepare(vpu_clk);
+		clk_enable(vpu_clk);
+		if (READ_REG(BIT_CUR_PC))
+			pr_debug("Not power off before vpu open!\n");
+		clk_disable(vpu_clk);
+		clk_unprepare(vpu_clk);
+#endif
+	}
+
+	vpu_unlock();
+	return s;
+}
+
+static int vpu_open(struct inode *inode, struct file *filp)
+{
+	struct vpu_session *s = vpu_session_open();
+
+	if (IS_ERR(s))
+		return PTR_ERR(s);
+	filp->private_data = s;
+	if (unlikely(vpu_rec_on))
+		vpu_record(VPU_REC_OPEN, filp, 0, 0,
+			   ktime_to_ns(ktime_get()), NULL);
+	return 0;
+}
+
+/*
+ * Frame buffers released with RELEASE_FRAMES, per instance, waiting for
+ * the VPU to be between jobs.
+ */
+static u32 vpu_frm_release[VPU_BS_MAX_INSTANCES];
+static bool vpu_frm_pending;
+static DEFINE_SPINLOCK(vpu_frm_lock);
+
+static int vpu_release_frames(u_long arg)
+{
+	struct vpu_frame_release r;
+	unsigned long flags;
+
+	if (copy_from_user(&r, (void __user *)arg, sizeof(r)))
+		return -EFAULT;
+	if (r.instance >= VPU_BS_MAX_INSTANCES)
+		return -EINVAL;
+
+	spin_lock_irqsave(&vpu_frm_lock, flags);
+	vpu_frm_release[r.instance] |= r.mask;
+	vpu_frm_pending = true;
+	spin_unlock_irqrestore(&vpu_frm_lock, flags);
+	return 0;
+}
+
+/* clears the released display flags, clock on and no job running */
+static void vpu_frm_apply(void)
+{
+	u32 mask[VPU_BS_MAX_INSTANCES];
+	unsigned long flags;
+	int i;
+
+	if (!READ_ONCE(vpu_frm_pending))
+		return;
+	spin_lock_irqsave(&vpu_frm_lock, flags);
+	memcpy(mask, vpu_frm_release, sizeof(mask));
+	memset(vpu_frm_release, 0, sizeof(vpu_frm_release));
+	vpu_frm_pending = false;
+	spin_unlock_irqrestore(&vpu_frm_lock, flags);
+
+	for (i = 0; i < VPU_BS_MAX_INSTANCES; i++)
+		if (mask[i])
+			WRITE_REG(READ_REG(BIT_FRM_DIS_FLG_REG(i)) & ~mask[i],
+				  BIT_FRM_DIS_FLG_REG(i));
+}
+
+/* for a new LOCK_DEV holder, before its first job; the clock may be off */
+static void vpu_frm_apply_idle(void)
+{
+	if (!READ_ONCE(vpu_frm_pending))
+		return;
+	clk_prepare(vpu_clk);
+	clk_enable(vpu_clk);
+	vpu_frm_apply();
+	clk_disable(vpu_clk);
+	clk_unprepare(vpu_clk);
+}
+
+/* the instances are gone with the last close, so are their frames */
+static void vpu_frm_forget(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vpu_frm_lock, flags);
+	memset(vpu_frm_release, 0, sizeof(vpu_frm_release));
+	vpu_frm_pending = false;
+	spin_unlock_irqrestore(&vpu_frm_lock, flags);
+}
+
+/*
+ * Takes a clock reference for a job. The first one starts a busy
+ * period.
+ */
+static void vpu_clkgate_on(void)
+{
+	clk_prepare(vpu_clk);
+	clk_enable(vpu_clk);
+	trace_vpu_clk_gate(1, atomic_inc_return(&clk_cnt_from_ioc));
+	vpu_stat_inc(clk_on);
+	vpu_busy_start();
+}
+
+/* drops one clock reference taken by vpu_clkgate_on() */
+static void vpu_clkgate_off(void)
+{
+	int cnt;
+
+	clk_disable(vpu_clk);
+	clk_unprepare(vpu_clk);
+	vpu_stat_inc(clk_off);
+	cnt = atomic_dec_return(&clk_cnt_from_ioc);
+	trace_vpu_clk_gate(0, cnt);
+	if (cnt <= 0)
+		vpu_busy_stop(VPU_ENGINE_NUM);
+}
+
+static struct vpu_ring *vpu_session_ring(struct vpu_session *s)
+{
+	struct vpu_ring *r;
+
+	mutex_lock(&s->lock);
+	r = s->ring;
+	mutex_unlock(&s->lock);
+	return r;
+}
+
+/* CQEs userspace has not consumed yet */
+static inline u32 vpu_ring_cq_count(struct vpu_ring *r)
+{
+	return READ_ONCE(r->cq_tail) - READ_ONCE(r->hdr->cq_head);
+}
+
+/* takes a CQ slot for a completion to come */
+static bool vpu_ring_reserve(struct vpu_ring *r)
+{
+	bool ok;
+
+	spin_lock(&r->cq_lock);
+	ok = r->cq_tail + r->cq_reserved - READ_ONCE(r->hdr->cq_head) <
+		r->cq_entries;
+	if (ok)
+		r->cq_reserved++;
+	spin_unlock(&r->cq_lock);
+	return ok;
+}
+
+/* an SQE is pending, and its CQE is reserved */
+static inline bool vpu_ring_has_sqe(struct vpu_ring *r)
+{
+	u32 pending = smp_load_acquire(&r->hdr->sq_tail) - r->sq_head;
+
+	/* a tail past the SQ is garbage, not work */
+	return pending && pending <= r->sq_entries && vpu_ring_reserve(r);
+}
+
+static void vpu_ring_queue(struct vpu_ring *r)
+{
+	spin_lock(&vpu_ring_lock);
+	if (list_empty(&r->ready))
+		list_add_tail(&r->ready, &vpu_ring_ready);
+	spin_unlock(&vpu_ring_lock);
+}
+
+/*
+ * Takes the next SQE of r, if there is one with room in the CQ for its
+ * completion, which is reserved. If not, r is not looked at again until
+ * RING_ENTER, which
+ * VPU_RING_NEED_WAKEUP tells userspace; it is set before a last look so
+ * that an SQE added meanwhile is not missed.
+ */
+static bool vpu_ring_next(struct vpu_ring *r, struct vpu_sqe *sqe)
+{
+	if (!vpu_ring_has_sqe(r)) {
+		WRITE_ONCE(r->hdr->flags, VPU_RING_NEED_WAKEUP);
+		smp_mb();
+		if (!vpu_ring_has_sqe(r))
+			return false;
+		WRITE_ONCE(r->hdr->flags, 0);
+	}
+	memcpy(sqe, &r->sqes[r->sq_head & (r->sq_entries - 1)], sizeof(*sqe));
+	r->sq_head++;
+	smp_store_release(&r->hdr->sq_head, r->sq_head);
+	wake_up_interruptible(&r->wait);
+	return true;
+}
+
+static int vpu_ring_check(const struct vpu_sqe *sqe)
+{
+	int i;
+
+	if (sqe->flags || !sqe->run_cmd || sqe->nr_regs > VPU_SQE_REGS)
+		return -EINVAL;
+	for (i = 0; i < sqe->nr_regs; i++)
+		if (sqe->regs[i].offset >= SZ_16K || sqe->regs[i].offset & 3)
+			return -EINVAL;
+	return 0;
+}
+
+/*
+ * Posts a CQE reserved with vpu_ring_reserve(): from the dispatcher, the
+ * completion of the ring's job, and copies, which can all run at once.
+ */
+static void vpu_ring_post(struct vpu_ring *r, u64 user_data, int result,
+			  u32 reason, u64 duration_ns)
+{
+	struct vpu_cqe *cqe;
+
+	spin_lock(&r->cq_lock);
+	cqe = &r->cqes[r->cq_tail & (r->cq_entries - 1)];
+	cqe->user_data = user_data;
+	cqe->result = result;
+	cqe->int_reason = reason;
+	cqe->duration_ns = duration_ns;
+	r->cq_tail++;
+	r->cq_reserved--;
+	smp_store_release(&r->hdr->cq_tail, r->cq_tail);
+	spin_unlock(&r->cq_lock);
+	wake_up_interruptible(&r->wait);
+}
+
+/* runs sqe on the VPU, which the dispatcher holds */
+static void vpu_ring_start(struct vpu_ring *r, const struct vpu_sqe *sqe)
+{
+	u32 job;
+	int i;
+
+	job = vpu_wdt_arm();
+	spin_lock(&vpu_ring_lock);
+	vpu_ring_busy = true;
+	vpu_ring_job = r;
+	vpu_ring_job_data = sqe->user_data;
+	vpu_ring_job_wdt = job;
+	vpu_ring_job_start = ktime_to_ns(ktime_get());
+	r->inflight = true;
+	spin_unlock(&vpu_ring_lock);
+
+	vpu_clkgate_on();
+	vpu_frm_apply();
+	for (i = 0; i < sqe->nr_regs; i++)
+		WRITE_REG(sqe->regs[i].value, sqe->regs[i].offset);
+	WRITE_REG(1, BIT_BUSY_FLAG);
+	WRITE_REG(sqe->run_cmd, BIT_RUN_COMMAND);
+}
+
+/*
+ * Completes the running ring job, if there is one and it is the caller's:
+ * one of want (NULL for any ring) and watchdog job job (0 for any). From
+ * the interrupt worker, the watchdog, suspend or ring teardown. Returns
+ * false if the device is not running that job, so the caller completes
+ * a LOCK_DEV one instead.
+ */
+static bool vpu_ring_complete(struct vpu_ring *want, u32 job, int result,
+			      u32 reason)
+{
+	struct vpu_ring *r;
+
+	spin_lock(&vpu_ring_lock);
+	r = vpu_ring_job;
+	if (r && ((want && r != want) || (job && job != vpu_ring_job_wdt)))
+		r = NULL;
+	if (r)
+		vpu_ring_job = NULL;
+	spin_unlock(&vpu_ring_lock);
+	if (!r)
+		return false;
+
+	vpu_ring_post(r, vpu_ring_job_data, result, reason,
+		      ktime_to_ns(ktime_get()) - vpu_ring_job_start);
+	irq_status = 0;
+	vpu_clkgate_off();
+
+	spin_lock(&vpu_ring_lock);
+	r->inflight = false;
+	vpu_ring_busy = false;
+	spin_unlock(&vpu_ring_lock);
+	wake_up(&vpu_ring_idle);
+	/* r may be gone from here, its file waits on vpu_ring_idle */
+	vpu_hw_release();
+	return true;
+}
+
+static void vpu_ring_work_fn(struct work_struct *w)
+{
+	struct vpu_sqe sqe;
+	struct vpu_ring *r;
+	bool owned = false;
+	bool retry;
+	s64 now;
+	int ret;
+
+	mutex_lock(&vpu_ring_dispatch);
+	while (!vpu_suspending) {
+		r = NULL;
+		spin_lock(&vpu_ring_lock);
+		if (!vpu_ring_busy && !list_empty(&vpu_ring_ready)) {
+			r = list_first_entry(&vpu_ring_ready, struct vpu_ring,
+					     ready);
+			list_del_init(&r->ready);
+		}
+		spin_unlock(&vpu_ring_lock);
+		if (!r)
+			break;
+
+		if (!owned) {
+			if (!vpu_hw_try_acquire(&vpu_ring_owner)) {
+				/*
+				 * LOCK_DEV has it, its release kicks us. That
+				 * kick tests the list under vpu_ring_lock, so a
+				 * release it missed shows here.
+				 */
+				spin_lock(&vpu_ring_lock);
+				if (list_empty(&r->ready))
+					list_add(&r->ready, &vpu_ring_ready);
+				retry = !READ_ONCE(vpu_hw_owner);
+				spin_unlock(&vpu_ring_lock);
+				if (retry)
+					continue;
+				break;
+			}
+			vpu_hw_since = 0;
+			if (READ_ONCE(vpu_ls_on)) {
+				now = ktime_to_ns(ktime_get());
+				vpu_lockstat_acquired(VPU_LS_LOCK_DEV, 0, now);
+				vpu_hw_since = now;
+			}
+			owned = true;
+		}
+
+		if (!vpu_ring_next(r, &sqe))
+			continue;
+		ret = vpu_ring_check(&sqe);
+		if (ret) {
+			vpu_ring_post(r, sqe.user_data, ret, 0, 0);
+			vpu_ring_queue(r);
+			continue;
+		}
+		/* the device goes with the job; r gets another turn later */
+		vpu_ring_start(r, &sqe);
+		owned = false;
+		vpu_ring_queue(r);
+		break;
+	}
+	if (owned)
+		vpu_hw_release();
+	mutex_unlock(&vpu_ring_dispatch);
+}
+
+/* gives s its rings, as p asks, and fills in the rest of p */
+static int vpu_ring_alloc(struct vpu_session *s, struct vpu_ring_setup *p)
+{
+	struct vpu_ring *r;
+	u32 sq_off, cq_off;
+	int ret = 0;
+
+	if (!is_power_of_2(p->sq_entries) || !is_power_of_2(p->cq_entries) ||
+	    p->cq_entries < p->sq_entries ||
+	    p->cq_entries > VPU_RING_MAX_ENTRIES)
+		return -EINVAL;
+
+	r = kzalloc(sizeof(*r), GFP_KERNEL);
+	if (!r)
+		return -ENOMEM;
+	sq_off = ALIGN(sizeof(struct vpu_ring_hdr), 64);
+	cq_off = sq_off + p->sq_entries * sizeof(struct vpu_sqe);
+	r->size = PAGE_ALIGN(cq_off + p->cq_entries * sizeof(struct vpu_cqe));
+	r->hdr = vmalloc_user(r->size);
+	if (!r->hdr) {
+		kfree(r);
+		return -ENOMEM;
+	}
+	r->sqes = (void *)r->hdr + sq_off;
+	r->cqes = (void *)r->hdr + cq_off;
+	r->sq_entries = p->sq_entries;
+	r->cq_entries = p->cq_entries;
+	r->hdr->sq_entries = p->sq_entries;
+	r->hdr->cq_entries = p->cq_entries;
+	r->hdr->flags = VPU_RING_NEED_WAKEUP;
+	r->s = s;
+	spin_lock_init(&r->cq_lock);
+	atomic_set(&r->copies, 0);
+	INIT_LIST_HEAD(&r->ready);
+	init_waitqueue_head(&r->wait);
+
+	mutex_lock(&s->lock);
+	if (s->ring)
+		ret = -EBUSY;
+	else
+		s->ring = r;
+	mutex_unlock(&s->lock);
+	if (ret) {
+		vfree(r->hdr);
+		kfree(r);
+		return ret;
+	}
+
+	p->sq_off = sq_off;
+	p->cq_off = cq_off;
+	p->mmap_offset = VPU_RING_MMAP_OFFSET;
+	p->mmap_size = r->size;
+	return 0;
+}
+
+static int vpu_ring_setup(struct vpu_session *s, u_long arg)
+{
+	struct vpu_ring_setup p;
+	int ret;
+
+	if (copy_from_user(&p, (void __user *)arg, sizeof(p)))
+		return -EFAULT;
+	ret = vpu_ring_alloc(s, &p);
+	if (ret)
+		return ret;
+	if (copy_to_user((void __user *)arg, &p, sizeof(p)))
+		return -EFAULT;
+	return 0;
+}
+
+/* new SQEs: back on dispatch */
+static void vpu_ring_wake(struct vpu_ring *r)
+{
+	WRITE_ONCE(r->hdr->flags, 0);
+	vpu_ring_queue(r);
+	vpu_ring_kick();
+}
+
+static int vpu_ring_enter(struct vpu_session *s, u_long arg)
+{
+	struct vpu_ring_enter e;
+	struct vpu_ring *r;
+	long ret;
+
+	if (copy_from_user(&e, (void __user *)arg, sizeof(e)))
+		return -EFAULT;
+	r = vpu_session_ring(s);
+	if (!r || e.min_complete > r->cq_entries)
+		return -EINVAL;
+
+	vpu_ring_wake(r);
+	if (!e.min_complete)
+		return 0;
+
+	if (!e.timeout_ms)
+		return wait_event_interruptible(r->wait,
+				vpu_ring_cq_count(r) >= e.min_complete);
+	ret = wait_event_interruptible_timeout(r->wait,
+				vpu_ring_cq_count(r) >= e.min_complete,
+				msecs_to_jiffies(e.timeout_ms));
+	if (ret < 0)
+		return ret;
+	return ret ? 0 : -ETIME;
+}
+
+/*
+ * VPU_IOC_COPY. The DMA channel is a memcpy one taken at probe, if the
+ * platform has one. Descriptors of one channel complete in order, but a
+ * copy only counts its descriptors down rather than rely on that.
+ */
+static unsigned int dma_copy_min = 4096;
+module_param(dma_copy_min, uint, 0644);
+MODULE_PARM_DESC(dma_copy_min, "Smallest VPU_IOC_COPY done by DMA rather than the CPU, in bytes");
+
+#ifdef MXC_VPU_HAS_DMAENGINE
+static struct dma_chan *vpu_copy_chan;
+#endif
+
+struct vpu_copy_job {
+	struct work_struct work;
+	struct vpu_copy c;
+	struct memalloc_record *rec;	/* holds a reference */
+	struct vpu_ring *ring;		/* VPU_COPY_ASYNC, else done */
+	struct completion done;
+	int result;
+	s64 start;
+#ifdef MXC_VPU_HAS_DMAENGINE
+	struct page **pages;		/* pinned user pages */
+	dma_addr_t *addrs;		/* of the pages, for the channel */
+	int nr_pages;
+	int nr_mapped;
+	atomic_t pending;		/* descriptors, + 1 while submitting */
+#endif
+};
+
+static int vpu_copy_cpu(struct vpu_copy_job *job)
+{
+	struct vpu_copy *c = &job->c;
+	void *buf = job->rec->mem.cpu_addr + c->offset;
+	u64 uaddr = c->user_addr;
+	void __user *u;
+	u32 i;
+
+	for (i = 0; i < c->height; i++) {
+		u = (void __user *)(uintptr_t)uaddr;
+		if (c->flags & VPU_COPY_TO_USER) {
+			if (copy_to_user(u, buf, c->width))
+				return -EFAULT;
+		} else if (copy_from_user(buf, u, c->width)) {
+			return -EFAULT;
+		}
+		buf += c->buf_stride;
+		uaddr += c->user_stride;
+	}
+	return 0;
+}
+
+#ifdef MXC_VPU_HAS_DMAENGINE
+static int vpu_pin_pages(unsigned long start, int nr, bool write,
+			 struct page **pages)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	return pin_user_pages_fast(start, nr, write ? FOLL_WRITE : 0, pages);
+#else
+	return get_user_pages_fast(start, nr, write ? FOLL_WRITE : 0, pages);
+#endif
+}
+
+static void vpu_unpin_pages(struct page **pages, int nr, bool dirty)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
+	unpin_user_pages_dirty_lock(pages, nr, dirty);
+#else
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (dirty)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+#endif
+}
+
+static inline enum dma_data_direction vpu_copy_dir(struct vpu_copy_job *job)
+{
+	return job->c.flags & VPU_COPY_TO_USER ? DMA_FROM_DEVICE :
+						 DMA_TO_DEVICE;
+}
+
+static void vpu_copy_unmap(struct vpu_copy_job *job)
+{
+	struct device *dev = vpu_copy_chan->device->dev;
+	int i;
+
+	for (i = 0; i < job->nr_mapped; i++)
+		dma_unmap_page(dev, job->addrs[i], PAGE_SIZE,
+			       vpu_copy_dir(job));
+	vpu_unpin_pages(job->pages, job->nr_pages,
+			vpu_copy_dir(job) == DMA_FROM_DEVICE);
+	kfree(job->pages);
+	job->pages = NULL;
+}
+#endif
+
+/* from process context, once the copy is over either way */
+static void vpu_copy_finish(struct vpu_copy_job *job)
+{
+	struct vpu_ring *r = job->ring;
+
+#ifdef MXC_VPU_HAS_DMAENGINE
+	if (job->pages)
+		vpu_copy_unmap(job);
+#endif
+	vpu_buf_put(job->rec);
+	if (!r) {
+		complete(&job->done);
+		return;
+	}
+	vpu_ring_post(r, job->c.user_data, job->result, 0,
+		      ktime_to_ns(ktime_get()) - job->start);
+	kfree(job);
+	if (atomic_dec_and_test(&r->copies))
+		wake_up(&vpu_ring_idle);
+}
+
+#ifdef MXC_VPU_HAS_DMAENGINE
+static void vpu_copy_work_fn(struct work_struct *w)
+{
+	vpu_copy_finish(container_of(w, struct vpu_copy_job, work));
+}
+
+/* channel callback, in its tasklet: unpinning can sleep */
+static void vpu_copy_dma_done(void *arg)
+{
+	struct vpu_copy_job *job = arg;
+
+	if (atomic_dec_and_test(&job->pending))
+		queue_work(vpu_data.workqueue, &job->work);
+}
+
+static int vpu_copy_submit(struct vpu_copy_job *job, dma_addr_t dst,
+			   dma_addr_t src, size_t len)
+{
+	struct dma_async_tx_descriptor *tx;
+
+	tx = dmaengine_prep_dma_memcpy(vpu_copy_chan, dst, src, len,
+				       DMA_PREP_INTERRUPT | DMA_CTRL_ACK);
+	if (!tx)
+		return -ENOMEM;
+	tx->callback = vpu_copy_dma_done;
+	tx->callback_param = job;
+	atomic_inc(&job->pending);
+	if (dma_submit_error(dmaengine_submit(tx))) {
+		atomic_dec(&job->pending);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Pins and maps the user pages and queues a descriptor per line and
+ * page. Fails without having started if the pages cannot be had; once
+ * started, job is finished from the work queue. The buffer's DMA
+ * address is used by the channel as is: on i.MX neither it nor the VPU
+ * is behind an IOMMU.
+ */
+static int vpu_copy_dma(struct vpu_copy_job *job)
+{
+	struct vpu_copy *c = &job->c;
+	struct device *dev = vpu_copy_chan->device->dev;
+	bool to_user = c->flags & VPU_COPY_TO_USER;
+	unsigned long first = c->user_addr & PAGE_MASK;
+	u64 span = (u64)(c->height - 1) * c->user_stride + c->width;
+	u64 uoff = c->user_addr - first, o;
+	dma_addr_t buf, ua;
+	u32 i, done, n;
+	int got, ret = 0;
+
+	job->nr_pages = (PAGE_ALIGN(c->user_addr + span) - first) >> PAGE_SHIFT;
+	job->pages = kcalloc(job->nr_pages,
+			     sizeof(*job->pages) + sizeof(*job->addrs),
+			     GFP_KERNEL);
+	if (!job->pages)
+		return -ENOMEM;
+	job->addrs = (dma_addr_t *)(job->pages + job->nr_pages);
+	got = vpu_pin_pages(first, job->nr_pages, to_user, job->pages);
+	if (got != job->nr_pages) {
+		if (got > 0)
+			vpu_unpin_pages(job->pages, got, false);
+		kfree(job->pages);
+		job->pages = NULL;
+		return -EFAULT;
+	}
+	for (i = 0; i < job->nr_pages; i++) {
+		job->addrs[i] = dma_map_page(dev, job->pages[i], 0, PAGE_SIZE,
+					     vpu_copy_dir(job));
+		if (dma_mapping_error(dev, job->addrs[i])) {
+			vpu_copy_unmap(job);
+			return -ENOMEM;
+		}
+		job->nr_mapped++;
+	}
+
+	INIT_WORK(&job->work, vpu_copy_work_fn);
+	atomic_set(&job->pending, 1);
+	buf = job->rec->mem.phy_addr + c->offset;
+	for (i = 0; i < c->height && !ret; i++) {
+		for (done = 0; done < c->width; done += n) {
+			o = uoff + done;
+			n = min_t(u64, c->width - done,
+				  PAGE_SIZE - (o & ~PAGE_MASK));
+			ua = job->addrs[o >> PAGE_SHIFT] + (o & ~PAGE_MASK);
+			if (to_user)
+				ret = vpu_copy_submit(job, ua, buf + done, n);
+			else
+				ret = vpu_copy_submit(job, buf + done, ua, n);
+			if (ret)
+				break;
+		}
+		buf += c->buf_stride;
+		uoff += c->user_stride;
+	}
+	dma_async_issue_pending(vpu_copy_chan);
+
+	/* what was queued still runs, the copy then fails */
+	job->result = ret;
+	if (atomic_dec_and_test(&job->pending))
+		vpu_copy_finish(job);
+	return 0;
+}
+
+static void vpu_copy_init(void)
+{
+	dma_cap_mask_t mask;
+	struct dma_chan *chan;
+
+	dma_cap_zero(mask);
+	dma_cap_set(DMA_MEMCPY, mask);
+	chan = dma_request_chan_by_mask(&mask);
+	if (IS_ERR(chan)) {
+		printk(KERN_INFO "vpu: no DMA memcpy channel, copies use the CPU\n");
+		return;
+	}
+	vpu_copy_chan = chan;
+}
+
+static void vpu_copy_exit(void)
+{
+	if (vpu_copy_chan)
+		dma_release_channel(vpu_copy_chan);
+	vpu_copy_chan = NULL;
+}
+#endif
+
+static int vpu_do_copy(struct vpu_session *s, u_long arg, bool compat)
+{
+	struct vpu_copy_job *job;
+	struct vpu_ring *r = NULL;
+	struct vpu_copy c;
+	u64 span, end;
+	int ret;
+
+	if (copy_from_user(&c, (void __user *)arg, sizeof(c)))
+		return -EFAULT;
+#ifdef CONFIG_COMPAT
+	if (compat)
+		c.user_addr = (uintptr_t)compat_ptr(c.user_addr);
+#endif
+	if (c.flags & ~(VPU_COPY_TO_USER | VPU_COPY_ASYNC) ||
+	    !c.width || !c.height)
+		return -EINVAL;
+	if (c.height > 1 && (c.user_stride < c.width || c.buf_stride < c.width))
+		return -EINVAL;
+	span = (u64)(c.height - 1) * c.user_stride + c.width;
+	end = c.offset + (u64)(c.height - 1) * c.buf_stride + c.width;
+	if (span > VPU_COPY_MAX_SIZE)
+		return -EINVAL;
+	/* packed lines are one line */
+	if (c.user_stride == c.width && c.buf_stride == c.width) {
+		c.width *= c.height;
+		c.height = 1;
+	}
+	if (c.flags & VPU_COPY_ASYNC) {
+		r = vpu_session_ring(s);
+		if (!r)
+			return -EINVAL;
+	}
+
+	job = kzalloc(sizeof(*job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+	job->rec = vpu_session_get(s, c.handle);
+	if (!job->rec || end > job->rec->mem.size) {
+		ret = -EINVAL;
+		goto err;
+	}
+	if (r && !vpu_ring_reserve(r)) {
+		ret = -EAGAIN;
+		goto err;
+	}
+	job->c = c;
+	job->ring = r;
+	job->start = ktime_to_ns(ktime_get());
+	init_completion(&job->done);
+	if (r)
+		atomic_inc(&r->copies);
+
+	ret = -ENODEV;
+#ifdef MXC_VPU_HAS_DMAENGINE
+	if (vpu_copy_chan && span >= dma_copy_min)
+		ret = vpu_copy_dma(job);
+#endif
+	if (ret) {
+		job->result = vpu_copy_cpu(job);
+		vpu_copy_finish(job);
+	}
+	if (r)
+		return 0;
+
+	/* the pages are the device's until the DMA is done */
+	wait_for_completion(&job->done);
+	ret = job->result;
+	kfree(job);
+	return ret;
+
+err:
+	if (job->rec)
+		vpu_buf_put(job->rec);
+	kfree(job);
+	return ret;
+}
+
+/*
+ * Several buffers of a file in one mapping, laid out by MAP_SET. Each
+ * VMA of it, split or forked, holds a reference; the set holds one on
+ * each of its buffers.
+ */
+struct vpu_map_seg {
+	unsigned long off;		/* into the mapping */
+	unsigned long size;		/* page aligned */
+	struct memalloc_record *rec;
+};
+
+struct vpu_map {
+	struct kref ref;
+	unsigned long size;
+	u32 nr;
+	struct vpu_map_seg segs[];	/* by offset */
+};
+
+static void vpu_map_release(struct kref *ref)
+{
+	struct vpu_map *m = container_of(ref, struct vpu_map, ref);
+	u32 i;
+
+	for (i = 0; i < m->nr; i++)
+		vpu_buf_put(m->segs[i].rec);
+	kfree(m);
+}
+
+static void vpu_map_put(struct vpu_map *m)
+{
+	kref_put(&m->ref, vpu_map_release);
+}
+
+/* where a buffer goes: in line with its PMDs, if it is big enough */
+static unsigned long vpu_map_place(unsigned long off, dma_addr_t phys,
+				   unsigned long size)
+{
+#ifdef MXC_VPU_HAS_HUGE_FAULT
+	if (size >= PMD_SIZE)
+		return off + ((phys - off) & ~PMD_MASK);
+#endif
+	return off;
+}
+
+static int vpu_map_set(struct vpu_session *s, u_long arg, bool compat)
+{
+	struct vpu_map_set __user *ums = (struct vpu_map_set __user *)arg;
+	struct vpu_map_entry __user *ue;
+	struct vpu_map_entry e;
+	struct vpu_map_set ms;
+	struct vpu_map_seg *seg;
+	struct vpu_map *m, *old;
+	unsigned long off = 0;
+	int ret = 0;
+	u32 i;
+
+	if (copy_from_user(&ms, ums, sizeof(ms)))
+		return -EFAULT;
+	if (!ms.count || ms.count > VPU_MAP_SET_MAX || ms.reserved)
+		return -EINVAL;
+	ue = (struct vpu_map_entry __user *)(uintptr_t)ms.entries;
+#ifdef CONFIG_COMPAT
+	if (compat)
+		ue = compat_ptr(ms.entries);
+#endif
+
+	m = kzalloc(sizeof(*m) + ms.count * sizeof(*seg), GFP_KERNEL);
+	if (!m)
+		return -ENOMEM;
+	kref_init(&m->ref);
+	for (i = 0; i < ms.count; i++) {
+		if (copy_from_user(&e, &ue[i], sizeof(e))) {
+			ret = -EFAULT;
+			break;
+		}
+		seg = &m->segs[m->nr];
+		seg->rec = vpu_session_get(s, e.handle);
+		if (!seg->rec) {
+			ret = -EINVAL;
+			break;
+		}
+		m->nr++;
+		seg->size = PAGE_ALIGN(seg->rec->mem.size);
+		seg->off = vpu_map_place(off, seg->rec->mem.phy_addr,
+					 seg->size);
+		if (seg->off + seg->size < off) {
+			ret = -ENOMEM;
+			break;
+		}
+		off = seg->off + seg->size;
+		if (put_user((u64)seg->off, &ue[i].offset)) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	m->size = off;
+	ms.mmap_offset = VPU_MAP_SET_MMAP_OFFSET;
+	ms.mmap_size = off;
+	if (!ret && copy_to_user(ums, &ms, sizeof(ms)))
+		ret = -EFAULT;
+	if (ret) {
+		vpu_map_put(m);
+		return ret;
+	}
+
+	mutex_lock(&s->lock);
+	old = s->map;
+	s->map = m;
+	mutex_unlock(&s->lock);
+	if (old)
+		vpu_map_put(old);
+	return 0;
+}
+
+static struct vpu_bs *vpu_session_bs(struct vpu_session *s)
+{
+	struct vpu_bs *bs;
+
+	mutex_lock(&s->lock);
+	bs = s->bs;
+	mutex_unlock(&s->lock);
+	return bs;
+}
+
+static int vpu_bs_setup(struct vpu_session *s, u_long arg)
+{
+	struct vpu_bs_setup p;
+	struct vpu_bs *bs;
+	unsigned long flags;
+	int ret = 0;
+
+	if (copy_from_user(&p, (void __user *)arg, sizeof(p)))
+		return -EFAULT;
+	if (p.flags & ~(VPU_BS_ENCODE | VPU_BS_FRAME_HEADERS) ||
+	    p.flags == VPU_BS_FRAME_HEADERS)
+		return -EINVAL;
+	if (p.instance >= VPU_BS_MAX_INSTANCES ||
+	    !is_power_of_2(p.size) || p.size < VPU_BS_MIN_SIZE ||
+	    p.size > VPU_BS_MAX_SIZE)
+		return -EINVAL;
+	if (!p.high)
+		p.high = p.size - 1;
+	if (!p.low)
+		p.low = p.size / 4;
+	if (p.high >= p.size || p.low >= p.high)
+		return -EINVAL;
+
+	ret = vpu_inst_get(p.instance);
+	if (ret)
+		return ret;
+
+	bs = kzalloc(sizeof(*bs), GFP_KERNEL);
+	if (!bs) {
+		vpu_inst_put(p.instance);
+		return -ENOMEM;
+	}
+	bs->mem.size = p.size;
+	if (vpu_alloc_dma_buffer(&bs->mem)) {
+		kfree(bs);
+		vpu_inst_put(p.instance);
+		return -ENOMEM;
+	}
+	bs->instance = p.instance;
+	bs->size = p.size;
+	bs->low = p.low;
+	bs->high = p.high;
+	bs->encode = p.flags & VPU_BS_ENCODE;
+	bs->headers = p.flags & VPU_BS_FRAME_HEADERS;
+	mutex_init(&bs->lock);
+	init_waitqueue_head(&bs->wait);
+
+	mutex_lock(&s->lock);
+	if (s->bs) {
+		ret = -EBUSY;
+	} else {
+		spin_lock_irqsave(&vpu_bs_lock, flags);
+		vpu_bs_inst[p.instance] = bs;
+		spin_unlock_irqrestore(&vpu_bs_lock, flags);
+		s->bs = bs;
+	}
+	mutex_unlock(&s->lock);
+	if (ret) {
+		vpu_free_dma_buffer(&bs->mem);
+		kfree(bs);
+		vpu_inst_put(p.instance);
+		return ret;
+	}
+
+	/* empty: both pointers at the start */
+	clk_prepare(vpu_clk);
+	clk_enable(vpu_clk);
+	WRITE_REG(bs->mem.phy_addr, BIT_RD_PTR_REG(p.instance));
+	WRITE_REG(bs->mem.phy_addr, BIT_WR_PTR_REG(p.instance));
+	clk_disable(vpu_clk);
+	clk_unprepare(vpu_clk);
+
+	p.phy_addr = bs->mem.phy_addr;
+	if (copy_to_user((void __user *)arg, &p, sizeof(p)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Decoding, hands what was written to the VPU and sees how far it has
+ * read. Encoding, gives back the room of what was read.
+ */
+static void vpu_bs_publish(struct vpu_bs *bs)
+{
+	unsigned long flags;
+
+	clk_prepare(vpu_clk);
+	clk_enable(vpu_clk);
+	if (bs->encode) {
+		WRITE_REG(bs->mem.phy_addr + bs->rd,
+			  BIT_RD_PTR_REG(bs->instance));
+	} else {
+		/* the data before the pointer that covers it */
+		wmb();
+		WRITE_REG(bs->mem.phy_addr + bs->wr,
+			  BIT_WR_PTR_REG(bs->instance));
+		spin_lock_irqsave(&vpu_bs_lock, flags);
+		vpu_bs_sync_rd(bs);
+		spin_unlock_irqrestore(&vpu_bs_lock, flags);
+	}
+	clk_disable(vpu_clk);
+	clk_unprepare(vpu_clk);
+}
+
+/*
+ * Copy n bytes between the ring and the caller's buffer, which is an
+ * iov_iter from 3.16 on and a user pointer (done bytes into it) before.
+ * They return how much was copied.
+ */
+static size_t vpu_bs_copy_in(void *dst, void *src, size_t done, size_t n)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	return copy_from_iter(dst, n, src);
+#else
+	return n - copy_from_user(dst, (const char __user *)src + done, n);
+#endif
+}
+
+static size_t vpu_bs_copy_out(void *dst, size_t done, const void *src,
+			      size_t n)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	return copy_to_iter(src, n, dst);
+#else
+	return n - copy_to_user((char __user *)dst + done, src, n);
+#endif
+}
+
+/* copies up to count bytes from src into a decoder's bitstream ring */
+static ssize_t vpu_bs_feed(struct file *filp, size_t count, void *src)
+{
+	struct vpu_bs *bs = vpu_session_bs(filp->private_data);
+	size_t room, done = 0, n, copied;
+	int ret = 0;
+	u32 off;
+
+	if (!bs || bs->encode)
+		return -EINVAL;
+	if (!count)
+		return 0;
+
+	mutex_lock(&bs->lock);
+	if (vpu_bs_used(bs) >= bs->high) {
+		if (filp->f_flags & O_NONBLOCK)
+			ret = -EAGAIN;
+		else
+			ret = wait_event_interruptible(bs->wait,
+					vpu_bs_used(bs) <= bs->low);
+		if (ret)
+			goto out;
+	}
+
+	room = min_t(size_t, count, bs->high - vpu_bs_used(bs));
+	while (done < room) {
+		off = bs->wr;
+		n = min_t(size_t, room - done, bs->size - off);
+		copied = vpu_bs_copy_in(bs->mem.cpu_addr + off, src, done, n);
+		WRITE_ONCE(bs->wr, (off + copied) & (bs->size - 1));
+		done += copied;
+		if (copied != n)
+			break;
+	}
+	if (done)
+		vpu_bs_publish(bs);
+	else
+		ret = -EFAULT;
+out:
+	mutex_unlock(&bs->lock);
+	return done ? done : ret;
+}
+
+/* copies encoder output to dst, see VPU_BS_FRAME_HEADERS for how much */
+static ssize_t vpu_bs_drain(struct file *filp, size_t count, void *dst)
+{
+	struct vpu_bs *bs = vpu_session_bs(filp->private_data);
+	struct vpu_bs_frame hdr;
+	struct vpu_bs_chunk f;
+	unsigned long flags;
+	size_t done = 0, n, copied;
+	int ret = 0;
+	u32 off, pos;
+
+	if (!bs || !bs->encode)
+		return -EINVAL;
+	if (!count)
+		return 0;
+	if (bs->headers && count < sizeof(hdr))
+		return -EINVAL;
+
+	mutex_lock(&bs->lock);
+	if (!READ_ONCE(bs->nr_frames)) {
+		if (filp->f_flags & O_NONBLOCK)
+			ret = -EAGAIN;
+		else
+			ret = wait_event_interruptible(bs->wait,
+					READ_ONCE(bs->nr_frames));
+		if (ret)
+			goto out;
+	}
+
+	do {
+		spin_lock_irqsave(&vpu_bs_lock, flags);
+		if (!bs->nr_frames) {
+			spin_unlock_irqrestore(&vpu_bs_lock, flags);
+			break;
+		}
+		f = bs->frames[bs->frame_first];
+		spin_unlock_irqrestore(&vpu_bs_lock, flags);
+
+		if (bs->headers && !bs->frame_hdr_done) {
+			hdr.len = f.len;
+			hdr.run_cmd = f.run_cmd;
+			hdr.timestamp_ns = f.ts;
+			if (vpu_bs_copy_out(dst, done, &hdr, sizeof(hdr)) !=
+			    sizeof(hdr)) {
+				ret = -EFAULT;
+				break;
+			}
+			done += sizeof(hdr);
+			bs->frame_hdr_done = true;
+		}
+
+		/* the frame was seen before its data, read it after */
+		rmb();
+		pos = bs->frame_pos;
+		while (pos < f.len && done < count) {
+			off = (f.off + pos) & (bs->size - 1);
+			n = min3(count - done, (size_t)(f.len - pos),
+				 (size_t)(bs->size - off));
+			copied = vpu_bs_copy_out(dst, done,
+						 bs->mem.cpu_addr + off, n);
+			pos += copied;
+			done += copied;
+			if (copied != n) {
+				ret = -EFAULT;
+				break;
+			}
+		}
+
+		spin_lock_irqsave(&vpu_bs_lock, flags);
+		WRITE_ONCE(bs->rd, (f.off + pos) & (bs->size - 1));
+		/* the frame can have grown meanwhile, see vpu_bs_frame_done */
+		if (pos == bs->frames[bs->frame_first].len) {
+			bs->frame_first = (bs->frame_first + 1) %
+					  VPU_BS_MAX_FRAMES;
+			bs->nr_frames--;
+			pos = 0;
+			bs->frame_hdr_done = false;
+		}
+		bs->frame_pos = pos;
+		spin_unlock_irqrestore(&vpu_bs_lock, flags);
+	} while (!bs->headers && !ret && done < count);
+
+	if (done)
+		vpu_bs_publish(bs);
+out:
+	mutex_unlock(&bs->lock);
+	return done ? done : ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+static ssize_t vpu_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	return vpu_bs_feed(iocb->ki_filp, iov_iter_count(from), from);
+}
+
+static ssize_t vpu_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	return vpu_bs_drain(iocb->ki_filp, iov_iter_count(to), to);
+}
+#else
+static ssize_t vpu_write(struct file *filp, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	return vpu_bs_feed(filp, count, (void __force *)buf);
+}
+
+static ssize_t vpu_read(struct file *filp, char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	return vpu_bs_drain(filp, count, (void __force *)buf);
+}
+#endif
+
+/* the instance's codec is closed by now, nothing reads the ring */
+static void vpu_bs_destroy(struct vpu_bs *bs)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&vpu_bs_lock, flags);
+	vpu_bs_inst[bs->instance] = NULL;
+	__clear_bit(bs->instance, &vpu_inst_used);
+	spin_unlock_irqrestore(&vpu_bs_lock, flags);
+	vpu_free_dma_buffer(&bs->mem);
+	kfree(bs);
+}
+
+/*
+ * Takes r off dispatch and waits for its running job. A job the watchdog
+ * does not end (it can be disabled) is failed here.
+ */
+static void vpu_ring_destroy(struct vpu_ring *r)
+{
+	mutex_lock(&vpu_ring_dispatch);
+	spin_lock(&vpu_ring_lock);
+	list_del_init(&r->ready);
+	spin_unlock(&vpu_ring_lock);
+	mutex_unlock(&vpu_ring_dispatch);
+
+	if (!wait_event_timeout(vpu_ring_idle, !READ_ONCE(r->inflight),
+			msecs_to_jiffies(watchdog_ms + VPU_SUSPEND_DRAIN_MS)))
+		vpu_ring_complete(r, 0, -ECANCELED, 0);
+	wait_event(vpu_ring_idle, !READ_ONCE(r->inflight));
+	/* DMA into pinned pages is not cancelled, it is short */
+	wait_event(vpu_ring_idle, !atomic_read(&r->copies));
+
+	vfree(r->hdr);
+	kfree(r);
+}
+
+/*!
+ * @brief undo what a released file left behind
+ *
+ * Its device lock is released, its clock references are dropped and its
+ * buffers are freed, except the registered work buffer. Buffers still
+ * mapped or exported go with their last user.
+ */
+static void vpu_session_release(struct vpu_session *s)
+{
+	unsigned long timeout;
+	int n;
+
+	if (s->ring)
+		vpu_ring_destroy(s->ring);
+
+	if (vpu_hw_owned(s)) {
+		/*
+		 * A job it left running gets watchdog_ms to finish and is
+		 * reset after that, so the next owner finds the VPU idle.
+		 * The watchdog waits meanwhile, then finds no job of ours.
+		 */
+		vpu_lock(VPU_LS_RELEASE);
+		clk_prepare(vpu_clk);
+		clk_enable(vpu_clk);
+		timeout = jiffies + msecs_to_jiffies(watchdog_ms);
+		while (READ_REG(BIT_BUSY_FLAG) &&
+		       time_before(jiffies, timeout))
+			msleep(1);
+		if (READ_REG(BIT_BUSY_FLAG)) {
+			printk(KERN_WARNING "VPU: job of a closed file hung, resetting\n");
+			if (vpu_hw_recover())
+				printk(KERN_ERR "VPU: reset after close failed\n");
+		}
+		clk_disable(vpu_clk);
+		clk_unprepare(vpu_clk);
+
+		/* nobody waits for its interrupt any more */
+		flush_work(&vpu_data.work);
+		irq_status = 0;
+		vpu_hw_release();
+		vpu_unlock();
+	}
+
+	n = atomic_xchg(&s->clk_refs, 0);
+	while (n-- > 0)
+		vpu_clkgate_off();
+
+	if (s->bs)
+		vpu_bs_destroy(s->bs);
+	if (s->map)
+		vpu_map_put(s->map);
+
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_PUT_BUFS);
+	idr_for_each(&s->bufs, vpu_session_put_buf, NULL);
+	vpu_mutex_unlock(&vpu_buf_lock);
+
+	vpu_session_free(s);
+}
+
+/* WAIT4INT: the worker or the watchdog sets irq_status for the waiter */
+static int vpu_wait4int(struct vpu_session *s, u_long timeout)
+{
+	s64 start = ktime_to_ns(ktime_get());
+	s64 now, irq_ns;
+	long left;
+	int ret = 0;
+
+	trace_vpu_wait_sleep(timeout);
+	atomic_inc(&vpu_queued);
+	left = wait_event_interruptible_timeout(vpu_queue, irq_status != 0,
+						msecs_to_jiffies(timeout));
+	atomic_dec(&vpu_queued);
+	now = ktime_to_ns(ktime_get());
+	trace_vpu_wait_wake(left, now - start);
+	if (!left) {
+		printk(KERN_WARNING "VPU blocking: timeout.\n");
+		vpu_stat_inc(wait_timeouts);
+		return -ETIME;
+	}
+	if (signal_pending(current)) {
+		printk(KERN_WARNING "VPU interrupt received.\n");
+		return -ERESTARTSYS;
+	}
+
+	irq_status = 0;
+	/*
+	 * Only a wait ended by an interrupt has an engine; timeouts,
+	 * signals and the watchdog are not sampled.
+	 */
+	irq_ns = atomic64_xchg(&vpu_irq_ns, 0);
+	if (irq_ns) {
+		vpu_hist_add(VPU_HIST_WAIT, vpu_irq_engine, now - start);
+		vpu_hist_add(VPU_HIST_IRQ_WAKE, vpu_irq_engine, now - irq_ns);
+	}
+	/* the job we waited for was killed by the watchdog */
+	spin_lock(&vpu_hw_lock);
+	if (s->job_failed) {
+		s->job_failed = false;
+		ret = -EIO;
+	}
+	spin_unlock(&vpu_hw_lock);
+	return ret;
+}
+
+/*!
+ * @brief execute one ioctl command
+ * @param cmd IO ctrl command
+ * @param compat from a 32-bit caller, pointers inside the argument are
+ * converted with compat_ptr()
+ * @return  0 on success or negative error code on error
+ */
+static long vpu_do_ioctl(struct file *filp, u_int cmd,
+			u_long arg, bool v2, bool compat)
+{
+	struct vpu_session *s = filp->private_data;
+	struct vpu_mem_desc_v2 desc;
+	int ret = 0;
+
+	switch (cmd) {
+	case VPU_IOC_PHYMEM_ALLOC:
+		{
+			struct memalloc_record *rec;
+
+			ret = vpu_get_desc(arg, v2, &desc);
+			if (ret)
+				return ret;
+
+			rec = vpu_buf_alloc(s, desc.size);
+			if (IS_ERR(rec)) {
+				ret = PTR_ERR(rec);
+				break;
+			}
+			rec->mem.virt_uaddr = desc.virt_uaddr;
+
+			vpu_buf_to_desc(&rec->mem, &desc);
+			ret = vpu_put_desc(arg, v2, &desc);
+			if (ret)
+				vpu_buf_free(s, rec->mem.handle);
+
+			break;
+		}
+	case VPU_IOC_PHYMEM_FREE:
+		{
+			if (vpu_get_desc(arg, v2, &desc))
+				return -EACCES;
+
+			pr_debug("[FREE] mem freed handle = 0x%llx\n",
+				 desc.handle);
+			/* nothing to free, as before handles */
+			if (!desc.handle)
+				break;
+
+			ret = vpu_buf_free(s, desc.handle);
+			break;
+		}
+	case VPU_IOC_WAIT4INT:
+		{
+			u_long timeout = (u_long) arg;
+			u32 v2_timeout;
+
+			/* the _V2 call passes the timeout by reference */
+			if (v2) {
+				if (get_user(v2_timeout, (u32 __user *)arg))
+					return -EFAULT;
+				timeout = v2_timeout;
+			}
+			ret = vpu_wait4int(s, timeout);
+			break;
+		}
+	case VPU_IOC_IRAM_SETTING:
+		{
+			ret = copy_to_user((void __user *)arg, &iram,
+					   sizeof(struct iram_setting));
+			if (ret)
+				ret = -EFAULT;
+
+			break;
+		}
+	case VPU_IOC_CLKGATE_SETTING:
+		{
+			u32 clkgate_en;
+
+			if (get_user(clkgate_en, (u32 __user *) arg))
+				return -EFAULT;
+
+			if (clkgate_en) {
+				ret = vpu_admit_job();
+				if (ret)
+					break;
+				vpu_clkgate_on();
+				atomic_inc(&s->clk_refs);
+			} else {
+				/* only what this file turned on */
+				if (!atomic_add_unless(&s->clk_refs, -1, 0))
+					return -EINVAL;
+				vpu_clkgate_off();
+			}
+
+			break;
+		}
+	case VPU_IOC_GET_SHARE_MEM:
+		{
+			vpu_mutex_lock(&vpu_share_lock, VPU_LS_SHARE_MEM);
+			if (!share_mem.cpu_addr) {
+				ret = vpu_get_desc(arg, v2, &desc);
+				if (ret) {
+					vpu_mutex_unlock(&vpu_share_lock);
+					return ret;
+				}
+				share_mem.size = desc.size;
+				share_mem.virt_uaddr = desc.virt_uaddr;
+				if (vpu_alloc_dma_buffer(&share_mem) == -1)
+					ret = -EFAULT;
+			}
+			if (!ret) {
+				vpu_buf_to_desc(&share_mem, &desc);
+				ret = vpu_put_desc(arg, v2, &desc);
+			}
+			vpu_mutex_unlock(&vpu_share_lock);
+			break;
+		}
+	case VPU_IOC_REQ_VSHARE_MEM:
+		{
+			vpu_mutex_lock(&vpu_share_lock, VPU_LS_VSHARE_MEM);
+			/* vmalloc shared memory if not allocated */
+			if (!vshare_mem.cpu_addr) {
+				ret = vpu_get_desc(arg, v2, &desc);
+				if (ret) {
+					vpu_mutex_unlock(&vpu_share_lock);
+					return ret;
+				}
+				vshare_mem.size = desc.size;
+				vshare_mem.virt_uaddr = desc.virt_uaddr;
+				vshare_mem.handle = VPU_VSHARE_MMAP_OFFSET;
+				vshare_mem.cpu_addr = vmalloc_user(desc.size);
+				if (!vshare_mem.cpu_addr)
+					ret = -ENOMEM;
+			}
+			if (!ret) {
+				vpu_buf_to_desc(&vshare_mem, &desc);
+				ret = vpu_put_desc(arg, v2, &desc);
+			}
+			vpu_mutex_unlock(&vpu_share_lock);
+			break;
+		}
+	case VPU_IOC_GET_WORK_ADDR:
+		{
+			vpu_mutex_lock(&vpu_buf_lock, VPU_LS_BITWORK);
+			if (!bitwork_mem.cpu_addr) {
+				ret = vpu_get_desc(arg, v2, &desc);
+				if (ret) {
+					vpu_mutex_unlock(&vpu_buf_lock);
+					return ret;
+				}
+				bitwork_mem.size = desc.size;
+				bitwork_mem.virt_uaddr = desc.virt_uaddr;
+				if (vpu_alloc_dma_buffer(&bitwork_mem) == -1)
+					ret = -EFAULT;
+				else
+					bitwork_owned = true;
+			}
+			if (!ret)
+				vpu_buf_to_desc(&bitwork_mem, &desc);
+			vpu_mutex_unlock(&vpu_buf_lock);
+			if (!ret)
+				ret = vpu_put_desc(arg, v2, &desc);
+			break;
+		}
+	/*
+	 * The following two ioctl is used when user allocates working buffer
+	 * and register it to vpu driver.
+	 */
+	case VPU_IOC_QUERY_BITWORK_MEM:
+		{
+			vpu_mutex_lock(&vpu_buf_lock, VPU_LS_BITWORK);
+			vpu_buf_to_desc(&bitwork_mem, &desc);
+			vpu_mutex_unlock(&vpu_buf_lock);
+			/* the handle may be another file's, map it by address */
+			desc.mmap_offset = desc.phy_addr;
+			ret = vpu_put_desc(arg, v2, &desc);
+			break;
+		}
+	case VPU_IOC_SET_BITWORK_MEM:
+		{
+			struct memalloc_record *rec;
+
+			ret = vpu_get_desc(arg, v2, &desc);
+			if (ret)
+				break;
+
+			/* the buffer must be one of this file's */
+			rec = vpu_session_get(s, desc.handle);
+			ret = -EINVAL;
+			vpu_mutex_lock(&vpu_buf_lock, VPU_LS_BITWORK);
+			/* and not freed since */
+			if (rec && !list_empty(&rec->list)) {
+				if (bitwork_owned) {
+					vpu_free_dma_buffer(&bitwork_mem);
+					bitwork_owned = false;
+				}
+				bitwork_mem = rec->mem;
+				ret = 0;
+			} else if (desc.handle &&
+				   desc.handle == bitwork_mem.handle) {
+				ret = 0;
+			}
+			vpu_mutex_unlock(&vpu_buf_lock);
+			if (rec)
+				vpu_buf_put(rec);
+			break;
+		}
+	case VPU_IOC_SYS_SW_RESET:
+		{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+			/* sleep, rather than spin, while the block resets */
+			ret = vpu_sw_reset();
+#else
+			if (vpu_plat->reset)
+				vpu_plat->reset();
+#endif
+
+			break;
+		}
+	case VPU_IOC_REG_DUMP:
+		break;
+	case VPU_IOC_PHYMEM_DUMP:
+		break;
+	case VPU_IOC_PHYMEM_CHECK:
+	{
+		ret = vpu_get_desc(arg, v2, &desc);
+		if (ret != 0) {
+			printk(KERN_ERR "copy from user failure:%d\n", ret);
+			break;
+		}
+		ret = vpu_is_valid_phy_memory((u32)desc.phy_addr);
+
+		pr_debug("vpu: memory phy:0x%llx %s phy memory\n",
+		       desc.phy_addr, (ret ? "is" : "isn't"));
+		/* borrow .size to pass back the result. */
+		desc.size = ret;
+		ret = vpu_put_desc(arg, v2, &desc);
+		break;
+	}
+	case VPU_IOC_LOCK_DEV:
+		{
+			u32 lock_en;
+
+			if (get_user(lock_en, (u32 __user *) arg))
+				return -EFAULT;
+
+			if (lock_en) {
+				ret = vpu_admit_job();
+				if (ret)
+					break;
+				atomic_inc(&vpu_queued);
+				ret = vpu_hw_acquire(s);
+				atomic_dec(&vpu_queued);
+				if (!ret) {
+					vpu_frm_apply_idle();
+					vpu_wdt_arm();
+				}
+			} else {
+				/* only the holder unlocks */
+				if (!vpu_hw_owned(s))
+					return -EINVAL;
+				vpu_hw_release();
+			}
+
+			break;
+		}
+	case VPU_IOC_VERSION:
+		ret = put_user(VPU_ABI_VERSION, (u32 __user *)arg);
+		break;
+	case VPU_IOC_EXPORT_BUF:
+		ret = vpu_export_buf(s, arg);
+		break;
+	case VPU_IOC_RING_SETUP:
+		ret = vpu_ring_setup(s, arg);
+		break;
+	case VPU_IOC_RING_ENTER:
+		ret = vpu_ring_enter(s, arg);
+		break;
+	case VPU_IOC_BS_SETUP:
+		ret = vpu_bs_setup(s, arg);
+		break;
+	case VPU_IOC_RELEASE_FRAMES:
+		ret = vpu_release_frames(arg);
+		break;
+	case VPU_IOC_COPY:
+		ret = vpu_do_copy(s, arg, compat);
+		break;
+	case VPU_IOC_MAP_SET:
+		ret = vpu_map_set(s, arg, compat);
+		break;
+	case VPU_IOC_SHM_GET:
+		ret = vpu_shm_get(s, arg);
+		break;
+	default:
+		{
+			printk(KERN_ERR "No such IOCTL, cmd is %d\n", cmd);
+			ret = -EINVAL;
+			break;
+		}
+	}
+	return ret;
+}
+
+static long vpu_batch(struct file *filp, u_long arg, bool compat);
+
+/* one command, native or from vpu_compat_ioctl() with arg converted */
+static long vpu_ioctl_cmd(struct file *filp, u_int cmd, u_long arg,
+			  bool compat)
+{
+	u_int legacy_cmd = cmd;
+	bool v2 = false;
+	s64 start = 0;
+	long ret;
+
+	if (cmd == VPU_IOC_BATCH)
+		return vpu_batch(filp, arg, compat);
+
+	/* a _V2 command is the original one with its argument sized */
+	switch (cmd) {
+	case VPU_IOC_PHYMEM_ALLOC_V2:
+	case VPU_IOC_PHYMEM_FREE_V2:
+	case VPU_IOC_WAIT4INT_V2:
+	case VPU_IOC_IRAM_SETTING_V2:
+	case VPU_IOC_CLKGATE_SETTING_V2:
+	case VPU_IOC_GET_WORK_ADDR_V2:
+	case VPU_IOC_REQ_VSHARE_MEM_V2:
+	case VPU_IOC_SYS_SW_RESET_V2:
+	case VPU_IOC_GET_SHARE_MEM_V2:
+	case VPU_IOC_QUERY_BITWORK_MEM_V2:
+	case VPU_IOC_SET_BITWORK_MEM_V2:
+	case VPU_IOC_PHYMEM_CHECK_V2:
+	case VPU_IOC_LOCK_DEV_V2:
+		legacy_cmd = _IO(VPU_IOC_MAGIC, _IOC_NR(cmd) - 32);
+		v2 = true;
+		break;
+	}
+
+	if (unlikely(vpu_rec_on))
+		start = ktime_to_ns(ktime_get());
+	trace_vpu_ioctl_enter(cmd, arg);
+	ret = vpu_do_ioctl(filp, legacy_cmd, arg, v2, compat);
+	trace_vpu_ioctl_exit(cmd, ret);
+	if (unlikely(start))
+		vpu_record_ioctl(filp, legacy_cmd, arg, v2, ret, start);
+	return ret;
+}
+
+/*!
+ * @brief IO ctrl function for vpu file operation
+ * @param cmd IO ctrl command
+ * @return  0 on success or negative error code on error
+ */
+static long vpu_ioctl(struct file *filp, u_int cmd,
+		     u_long arg)
+{
+	return vpu_ioctl_cmd(filp, cmd, arg, false);
+}
+
+#ifdef CONFIG_COMPAT
+/*
+ * Both descriptor layouts are the same for 32 and 64-bit callers, only
+ * pointers need converting. WAIT4INT passes its timeout by value.
+ */
+static long vpu_compat_ioctl(struct file *filp, u_int cmd,
+			     u_long arg)
+{
+	if (cmd != VPU_IOC_WAIT4INT)
+		arg = (u_long)compat_ptr(arg);
+	return vpu_ioctl_cmd(filp, cmd, arg, true);
+}
+#endif
+
+/*!
+ * @brief run a vector of commands in one call
+ *
+ * Each entry goes through the same path as its own ioctl would, so it is
+ * traced and recorded as one. Entries are read and their results written
+ * back one at a time, the vector is never copied whole.
+ *
+ * @return  0 when all entries succeeded, else the error of the failed one
+ */
+static long vpu_batch(struct file *filp, u_long arg, bool compat)
+{
+	struct vpu_batch __user *ub = (struct vpu_batch __user *)arg;
+	struct vpu_batch_entry __user *ue;
+	struct vpu_batch_entry e;
+	struct vpu_batch b;
+	long ret = 0;
+	u32 i, done = 0;
+
+	if (copy_from_user(&b, ub, sizeof(b)))
+		return -EFAULT;
+	if (b.count > VPU_BATCH_MAX)
+		return -E2BIG;
+	ue = (struct vpu_batch_entry __user *)(uintptr_t)b.entries;
+#ifdef CONFIG_COMPAT
+	if (compat)
+		ue = compat_ptr(b.entries);
+#endif
+
+	for (i = 0; i < b.count; i++) {
+		if (copy_from_user(&e, &ue[i], sizeof(e))) {
+			ret = -EFAULT;
+			break;
+		}
+		if (e.cmd == VPU_IOC_BATCH) {
+			ret = -EINVAL;
+		} else {
+#ifdef CONFIG_COMPAT
+			if (compat)
+				ret = vpu_compat_ioctl(filp, e.cmd, e.arg);
+			else
+#endif
+				ret = vpu_ioctl(filp, e.cmd, e.arg);
+			/*
+			 * Restarting would run the entries before this one
+			 * again.
+			 */
+			if (ret == -ERESTARTSYS)
+				ret = -EINTR;
+		}
+		done = i + 1;
+		if (put_user((s32)ret, &ue[i].result)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (ret)
+			break;
+	}
+
+	/* the failed entry counts as run */
+	if (put_user(done, &ub->done))
+		return -EFAULT;
+	return ret;
+}
+
+/* ends a session, the last of which powers the VPU down */
+static int vpu_session_close(struct vpu_session *s)
+{
+	int i, ret = 0;
+	unsigned long timeout;
+
+	vpu_session_release(s);
+
+	vpu_lock(VPU_LS_RELEASE);
+
+	if (open_count > 0 && !(--open_count)) {
+
+		/*
+		 * The last user is gone, nothing left for the watchdog; if it
+		 * runs, it waits for us and then finds no job.
+		 */
+		cancel_delayed_work(&vpu_wdt_work);
+		vpu_frm_forget();
+
+		/* Wait for vpu go to idle state */
+		clk_prepare(vpu_clk);
+		clk_enable(vpu_clk);
+		if (READ_REG(BIT_CUR_PC)) {
+
+			timeout = jiffies + HZ;
+			while (READ_REG(BIT_BUSY_FLAG)) {
+				msleep(1);
+				if (time_after(jiffies, timeout)) {
+					printk(KERN_WARNING "VPU timeout during release\n");
+					break;
+				}
+			}
+			clk_disable(vpu_clk);
+			clk_unprepare(vpu_clk);
+
+			/* Clean up interrupt */
+			cancel_work_sync(&vpu_data.work);
+			flush_workqueue(vpu_data.workqueue);
+			irq_status = 0;
+
+			clk_prepare(vpu_clk);
+			clk_enable(vpu_clk);
+			if (READ_REG(BIT_BUSY_FLAG)) {
+
+				if (cpu_is_mx51() || cpu_is_mx53())
+					ret = -EFAULT;
+
+#ifdef CONFIG_SOC_IMX6Q
+				if (cpu_is_mx6dl() || cpu_is_mx6q()) {
+					if (vpu_bus_idle_handshake(USEC_PER_SEC))
+						ret = -EFAULT;
+					else
+						vpu_hw_reset();
+				}
+#endif
+				if (ret) {
+					printk(KERN_ERR
+						"fatal error: can't gate/power off when VPU is busy\n");
+					/*
+					 * Reset it anyway, as the watchdog does,
+					 * so that it stops writing to the memory
+					 * freed below.
+					 */
+					vpu_hw_reset();
+				}
+			}
+		}
+		clk_disable(vpu_clk);
+		clk_unprepare(vpu_clk);
+
+		vpu_free_buffers();
+
+		/* Free shared memory when vpu device is idle */
+		vpu_free_dma_buffer(&share_mem);
+		vfree(vshare_mem.cpu_addr);
+		vshare_mem.cpu_addr = NULL;
+		vpu_shm_free();
+
+		/* left powered and clocked, as it was found */
+		if (ret)
+			goto out;
+
+		vpu_clk_usercount = atomic_read(&clk_cnt_from_ioc);
+		for (i = 0; i < vpu_clk_usercount; i++) {
+			clk_disable(vpu_clk);
+			clk_unprepare(vpu_clk);
+			atomic_dec(&clk_cnt_from_ioc);
+		}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
+		if (!IS_ERR(vpu_regulator))
+			regulator_disable(vpu_regulator);
+#else
+		/* power down in the background, a reopen just takes a ref */
+		schedule_work(&vpu_power_off_work);
+#endif
+
+	}
+out:
+	vpu_unlock();
+	module_put(vpu_dev_owner());
+	return ret;
+}
+
+/*!
+ * @brief Release function for vpu file operation
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_release(struct inode *inode, struct file *filp)
+{
+	int ret = vpu_session_close(filp->private_data);
+
+	if (unlikely(vpu_rec_on))
+		vpu_record(VPU_REC_RELEASE, filp, 0, 0,
+			   ktime_to_ns(ktime_get()), NULL);
+	return ret;
+}
+
+/*!
+ * @brief fasync function for vpu file operation
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_fasync(int fd, struct file *filp, int mode)
+{
+	return fasync_helper(fd, filp, mode, &vpu_data.async_queue);
+}
+
+/*!
+ * @brief memory map function of harware registers for vpu file operation
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_map_hwregs(struct file *fp, struct vm_area_struct *vm)
+{
+	unsigned long pfn;
+
+	vm->vm_flags |= VM_IO;
+	/*
+	 * Since vpu registers have been mapped with ioremap() at probe
+	 * which L_PTE_XN is 1, and the same physical address must be
+	 * mapped multiple times with same type, so set L_PTE_XN to 1 here.
+	 * Otherwise, there may be unexpected result in video codec.
+	 */
+	vm->vm_page_prot = pgprot_noncachedxn(vm->vm_page_prot);
+	pfn = phy_vpu_base_addr >> PAGE_SHIFT;
+	pr_debug("size=0x%x,  page no.=0x%x\n",
+		 (int)(vm->vm_end - vm->vm_start), (int)pfn);
+	return remap_pfn_range(vm, vm->vm_start, pfn, vm->vm_end - vm->vm_start,
+			       vm->vm_page_prot) ? -EAGAIN : 0;
+}
+
+/* a mapping of an allocated buffer holds a reference on it */
+static void vpu_dma_vm_open(struct vm_area_struct *vm)
+{
+	struct memalloc_record *rec = vm->vm_private_data;
+
+	kref_get(&rec->ref);
+}
+
+static void vpu_dma_vm_close(struct vm_area_struct *vm)
+{
+	vpu_buf_put(vm->vm_private_data);
+}
+
+static const struct vm_operations_struct vpu_dma_vm_ops = {
+	.open = vpu_dma_vm_open,
+	.close = vpu_dma_vm_close,
+};
+
+static bool vpu_buf_contains(const struct vpu_dma_buf *mem, u64 addr,
+			     unsigned long size)
+{
+	return mem->cpu_addr && addr >= mem->phy_addr &&
+		addr + size <= mem->phy_addr + PAGE_ALIGN(mem->size);
+}
+
+/*
+ * Legacy userspace maps by physical address, which has to fall inside a
+ * buffer the driver handed out. Buffers on the allocation list come back
+ * referenced in *found; share and work memory live until the last close.
+ */
+static int vpu_find_dma_mem(unsigned long pgoff, unsigned long size,
+			    struct memalloc_record **found)
+{
+	u64 addr = (u64)pgoff << PAGE_SHIFT;
+	struct memalloc_record *rec;
+	int ret = -EINVAL;
+
+	*found = NULL;
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_MMAP);
+	list_for_each_entry(rec, &head, list) {
+		if (vpu_buf_contains(&rec->mem, addr, size)) {
+			kref_get(&rec->ref);
+			*found = rec;
+			ret = 0;
+			break;
+		}
+	}
+	if (ret && vpu_buf_contains(&bitwork_mem, addr, size))
+		ret = 0;
+	vpu_mutex_unlock(&vpu_buf_lock);
+	if (!ret)
+		return 0;
+
+	vpu_mutex_lock(&vpu_share_lock, VPU_LS_SHARE_MMAP);
+	if (vpu_buf_contains(&share_mem, addr, size))
+		ret = 0;
+	vpu_mutex_unlock(&vpu_share_lock);
+	return ret;
+}
+
+/*!
+ * @brief memory map function of memory for vpu file operation
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_map_dma_mem(struct file *fp, struct vm_area_struct *vm)
+{
+	struct memalloc_record *rec;
+	unsigned long request_size;
+	unsigned long pfn;
+	int ret;
+
+	request_size = vm->vm_end - vm->vm_start;
+
+	pr_debug(" start=0x%x, pgoff=0x%x, size=0x%x\n",
+		 (unsigned int)(vm->vm_start), (unsigned int)(vm->vm_pgoff),
+		 (unsigned int)request_size);
+
+	if (vm->vm_pgoff >= VPU_MMAP_HANDLE_PGOFF) {
+		/* by handle, a buffer of this file */
+		rec = vpu_session_get(fp->private_data,
+				      vm->vm_pgoff - VPU_MMAP_HANDLE_PGOFF);
+		if (!rec)
+			return -EINVAL;
+		if (request_size > PAGE_ALIGN(rec->mem.size)) {
+			vpu_buf_put(rec);
+			return -EINVAL;
+		}
+		pfn = PFN_DOWN(rec->mem.phy_addr);
+	} else {
+		ret = vpu_find_dma_mem(vm->vm_pgoff, request_size, &rec);
+		if (ret)
+			return ret;
+		pfn = vm->vm_pgoff;
+	}
+
+	ret = vpu_remap_dma(vm, pfn);
+	if (rec) {
+		if (ret) {
+			vpu_buf_put(rec);
+		} else {
+			vm->vm_private_data = rec;
+			vm->vm_ops = &vpu_dma_vm_ops;
+		}
+	}
+	return ret;
+}
+
+/* !
+ * @brief memory map function of vmalloced share memory
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_map_vshare_mem(struct file *fp, struct vm_area_struct *vm)
+{
+	int ret = -EINVAL;
+
+	ret = remap_vmalloc_range(vm, vshare_mem.cpu_addr, 0);
+	vm->vm_flags |= VM_IO;
+
+	return ret;
+}
+
+static inline bool vpu_is_shm_pgoff(unsigned long pgoff)
+{
+	u64 off = (u64)pgoff << PAGE_SHIFT;
+
+	return off >= VPU_SHM_MMAP_OFFSET &&
+		off < VPU_SHM_MMAP_OFFSET + VPU_SHM_REGIONS * VPU_SHM_MAX_SIZE &&
+		!((off - VPU_SHM_MMAP_OFFSET) % VPU_SHM_MAX_SIZE);
+}
+
+/* a shared region, or a legacy physical address that matches */
+static int vpu_map_shm(struct file *fp, struct vm_area_struct *vm)
+{
+	unsigned long idx = ((vm->vm_pgoff << PAGE_SHIFT) -
+			     VPU_SHM_MMAP_OFFSET) / VPU_SHM_MAX_SIZE;
+	struct vpu_shm *shm;
+	int ret = 0;
+
+	vpu_mutex_lock(&vpu_share_lock, VPU_LS_SHARE_MMAP);
+	shm = vpu_shm[idx];
+	if (shm)
+		ret = remap_vmalloc_range(vm, shm->hdr, 0);
+	vpu_mutex_unlock(&vpu_share_lock);
+	if (!shm)
+		return vpu_map_dma_mem(fp, vm);
+	return ret;
+}
+
+/* job rings of the file, or a legacy physical address that matches */
+static int vpu_map_ring(struct file *fp, struct vm_area_struct *vm)
+{
+	struct vpu_ring *r = vpu_session_ring(fp->private_data);
+
+	if (!r)
+		return vpu_map_dma_mem(fp, vm);
+	return remap_vmalloc_range(vm, r->hdr, 0);
+}
+
+static void vpu_map_vm_open(struct vm_area_struct *vm)
+{
+	struct vpu_map *m = vm->vm_private_data;
+
+	kref_get(&m->ref);
+}
+
+static void vpu_map_vm_close(struct vm_area_struct *vm)
+{
+	vpu_map_put(vm->vm_private_data);
+}
+
+#ifdef MXC_VPU_HAS_HUGE_FAULT
+/* the segment at off into the set, NULL in a gap */
+static struct vpu_map_seg *vpu_map_find(struct vm_area_struct *vm,
+					unsigned long addr,
+					unsigned long *off)
+{
+	struct vpu_map *m = vm->vm_private_data;
+	u32 lo = 0, hi = m->nr, mid;
+
+	*off = ((vm->vm_pgoff - (VPU_MAP_SET_MMAP_OFFSET >> PAGE_SHIFT)) <<
+		PAGE_SHIFT) + addr - vm->vm_start;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (*off < m->segs[mid].off)
+			hi = mid;
+		else if (*off >= m->segs[mid].off + m->segs[mid].size)
+			lo = mid + 1;
+		else
+			return &m->segs[mid];
+	}
+	return NULL;
+}
+
+static vm_fault_t vpu_map_fault(struct vm_fault *vmf)
+{
+	struct vpu_map_seg *seg;
+	unsigned long off;
+
+	seg = vpu_map_find(vmf->vma, vmf->address, &off);
+	if (!seg)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn(vmf->vma, vmf->address,
+			      PFN_DOWN(seg->rec->mem.phy_addr + off - seg->off));
+}
+
+static vm_fault_t vpu_map_huge_fault(struct vm_fault *vmf,
+				     enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vm = vmf->vma;
+	unsigned long addr = vmf->address & PMD_MASK;
+	struct vpu_map_seg *seg;
+	unsigned long off;
+	phys_addr_t phys;
+
+	if (pe_size != PE_SIZE_PMD || addr < vm->vm_start ||
+	    addr + PMD_SIZE > vm->vm_end)
+		return VM_FAULT_FALLBACK;
+	seg = vpu_map_find(vm, addr, &off);
+	if (!seg || off + PMD_SIZE > seg->off + seg->size)
+		return VM_FAULT_FALLBACK;
+	phys = seg->rec->mem.phy_addr + off - seg->off;
+	if (phys & ~PMD_MASK)
+		return VM_FAULT_FALLBACK;
+	return vmf_insert_pfn_pmd(vmf, phys_to_pfn_t(phys, PFN_DEV),
+				  vmf->flags & FAULT_FLAG_WRITE);
+}
+
+/* puts a set mapping where its PMDs can be used */
+static unsigned long vpu_get_unmapped_area(struct file *fp,
+					   unsigned long addr,
+					   unsigned long len,
+					   unsigned long pgoff,
+					   unsigned long flags)
+{
+	unsigned long ret;
+
+	if (pgoff == VPU_MAP_SET_MMAP_OFFSET >> PAGE_SHIFT && !addr &&
+	    !(flags & MAP_FIXED) && len >= PMD_SIZE) {
+		ret = current->mm->get_unmapped_area(fp, 0, len + PMD_SIZE,
+						     pgoff, flags);
+		if (!IS_ERR_VALUE(ret))
+			return ALIGN(ret, PMD_SIZE);
+	}
+	return current->mm->get_unmapped_area(fp, addr, len, pgoff, flags);
+}
+#else
+/* maps every buffer of m, leaving the gaps */
+static int vpu_map_remap(struct vm_area_struct *vm, struct vpu_map *m)
+{
+	struct vpu_map_seg *seg;
+	u32 i;
+
+	for (i = 0; i < m->nr; i++) {
+		seg = &m->segs[i];
+		if (remap_pfn_range(vm, vm->vm_start + seg->off,
+				    PFN_DOWN(seg->rec->mem.phy_addr),
+				    seg->size, vm->vm_page_prot))
+			return -EAGAIN;
+	}
+	return 0;
+}
+#endif
+
+static const struct vm_operations_struct vpu_map_vm_ops = {
+	.open = vpu_map_vm_open,
+	.close = vpu_map_vm_close,
+#ifdef MXC_VPU_HAS_HUGE_FAULT
+	.fault = vpu_map_fault,
+	.huge_fault = vpu_map_huge_fault,
+#endif
+};
+
+/*
+ * Maps the file's MAP_SET layout, or a legacy physical address that
+ * matches. With huge faults the buffers are faulted in, else they are
+ * all mapped now.
+ */
+static int vpu_map_set_mmap(struct file *fp, struct vm_area_struct *vm)
+{
+	struct vpu_session *s = fp->private_data;
+	struct vpu_map *m;
+
+	mutex_lock(&s->lock);
+	m = s->map;
+	if (m)
+		kref_get(&m->ref);
+	mutex_unlock(&s->lock);
+	if (!m)
+		return vpu_map_dma_mem(fp, vm);
+
+	if (vm->vm_end - vm->vm_start != m->size ||
+	    !(vm->vm_flags & VM_SHARED)) {
+		vpu_map_put(m);
+		return -EINVAL;
+	}
+	vm->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+	vm->vm_page_prot = pgprot_writecombine(vm->vm_page_prot);
+#ifdef MXC_VPU_HAS_HUGE_FAULT
+	vm->vm_flags |= VM_HUGEPAGE;
+#else
+	if (vpu_map_remap(vm, m)) {
+		vpu_map_put(m);
+		return -EAGAIN;
+	}
+#endif
+	vm->vm_private_data = m;
+	vm->vm_ops = &vpu_map_vm_ops;
+	return 0;
+}
+
+/*!
+ * @brief memory map interface for vpu file operation
+ * @return  0 on success or negative error code on error
+ */
+static int vpu_mmap(struct file *fp, struct vm_area_struct *vm)
+{
+	u32 kind;
+	int ret;
+
+	if (vm->vm_pgoff == VPU_VSHARE_MMAP_OFFSET >> PAGE_SHIFT &&
+	    vshare_mem.cpu_addr) {
+		kind = VPU_REC_MMAP_VSHARE;
+		ret = vpu_map_vshare_mem(fp, vm);
+	} else if (vm->vm_pgoff == VPU_RING_MMAP_OFFSET >> PAGE_SHIFT) {
+		kind = VPU_REC_MMAP_RING;
+		ret = vpu_map_ring(fp, vm);
+	} else if (vm->vm_pgoff == VPU_MAP_SET_MMAP_OFFSET >> PAGE_SHIFT) {
+		kind = VPU_REC_MMAP_SET;
+		ret = vpu_map_set_mmap(fp, vm);
+	} else if (vpu_is_shm_pgoff(vm->vm_pgoff)) {
+		kind = VPU_REC_MMAP_SHM;
+		ret = vpu_map_shm(fp, vm);
+	} else if (vm->vm_pgoff) {
+		kind = VPU_REC_MMAP_DMA;
+		ret = vpu_map_dma_mem(fp, vm);
+	} else {
+		kind = VPU_REC_MMAP_REGS;
+		ret = vpu_map_hwregs(fp, vm);
+	}
+
+	if (unlikely(vpu_rec_on)) {
+		u32 a[4] = { vm->vm_pgoff, vm->vm_end - vm->vm_start };
+
+		vpu_record(VPU_REC_MMAP, fp, kind, ret,
+			   ktime_to_ns(ktime_get()), a);
+	}
+	return ret;
+}
+
+/*
+ * Readable with CQEs to consume, writable with room for SQEs. With a
+ * bitstream ring, readable or writable is about that instead (encoder
+ * output to read, or decoder input down to its low mark) and the rings
+ * move to the bands.
+ */
+static vpu_poll_t vpu_poll(struct file *filp, poll_table *wait)
+{
+	struct vpu_ring *r = vpu_session_ring(filp->private_data);
+	struct vpu_bs *bs = vpu_session_bs(filp->private_data);
+	vpu_poll_t mask = 0;
+
+	if (r) {
+		poll_wait(filp, &r->wait, wait);
+		if (vpu_ring_cq_count(r))
+			mask |= bs ? EPOLLRDBAND : EPOLLIN | EPOLLRDNORM;
+		if (READ_ONCE(r->hdr->sq_tail) - READ_ONCE(r->sq_head) <
+		    r->sq_entries)
+			mask |= bs ? EPOLLWRBAND : EPOLLOUT | EPOLLWRNORM;
+	}
+	if (bs) {
+		poll_wait(filp, &bs->wait, wait);
+		if (bs->encode ? READ_ONCE(bs->nr_frames) != 0 :
+		    vpu_bs_used(bs) <= bs->low)
+			mask |= bs->encode ? EPOLLIN | EPOLLRDNORM :
+					     EPOLLOUT | EPOLLWRNORM;
+	}
+	return mask;
+}
+
+const struct file_operations vpu_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_open,
+	.unlocked_ioctl = vpu_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = vpu_compat_ioctl,
+#endif
+	.release = vpu_release,
+	.fasync = vpu_fasync,
+	.mmap = vpu_mmap,
+#ifdef MXC_VPU_HAS_HUGE_FAULT
+	.get_unmapped_area = vpu_get_unmapped_area,
+#endif
+	.poll = vpu_poll,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0)
+	.write_iter = vpu_write_iter,
+	.splice_write = iter_file_splice_write,
+	.read_iter = vpu_read_iter,
+#else
+	.write = vpu_write,
+	.read = vpu_read,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0)
+	.splice_read = generic_file_splice_read,
+#endif
+};
+
+static void vpu_stats_sum(struct vpu_stats *sum)
+{
+	u64 *dst = (u64 *)sum;
+	u64 *src;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		src = (u64 *)per_cpu_ptr(&vpu_stats, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++)
+			dst[i] += src[i];
+	}
+}
+
+static void vpu_stats_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&vpu_stats, cpu), 0,
+		       sizeof(struct vpu_stats));
+	vpu_wdt_recoveries = 0;
+	vpu_stats_since = ktime_to_ns(ktime_get());
+}
+
+/* Busy time of all engines against wall time since the last reset, in % */
+static unsigned int vpu_stats_util(const struct vpu_stats *st)
+{
+	s64 elapsed = ktime_to_ns(ktime_get()) - vpu_stats_since;
+	u64 busy = 0;
+	int i;
+
+	for (i = 0; i < VPU_ENGINE_NUM; i++)
+		busy += st->busy_ns[i];
+	if (elapsed <= 0)
+		return 0;
+	return (unsigned int)div64_u64(busy * 100, elapsed);
+}
+
+static int vpu_stats_show(struct seq_file *m, void *unused)
+{
+	static const char * const engine[VPU_ENGINE_NUM] = { "bit", "jpu" };
+	struct vpu_stats st;
+	int i;
+
+	vpu_stats_sum(&st);
+
+	seq_printf(m, "elapsed_ms %lld\n",
+		   div_s64(ktime_to_ns(ktime_get()) - vpu_stats_since,
+			   NSEC_PER_MSEC));
+	seq_printf(m, "utilization %u%%\n", vpu_stats_util(&st));
+	for (i = 0; i < VPU_ENGINE_NUM; i++) {
+		seq_printf(m, "%s_busy_us %llu\n", engine[i],
+			   div_u64(st.busy_ns[i], NSEC_PER_USEC));
+		seq_printf(m, "%s_jobs %llu\n", engine[i], st.jobs[i]);
+		seq_printf(m, "%s_irqs %llu\n", engine[i], st.irqs[i]);
+	}
+	seq_printf(m, "wait_timeouts %llu\n", st.wait_timeouts);
+	seq_printf(m, "alloc_count %llu\n", st.alloc_count);
+	seq_printf(m, "alloc_bytes %llu\n", st.alloc_bytes);
+	seq_printf(m, "free_count %llu\n", st.free_count);
+	seq_printf(m, "free_bytes %llu\n", st.free_bytes);
+	seq_printf(m, "clk_on %llu\n", st.clk_on);
+	seq_printf(m, "clk_off %llu\n", st.clk_off);
+	seq_printf(m, "pu_on %llu\n", st.pu_on);
+	seq_printf(m, "pu_off %llu\n", st.pu_off);
+	seq_printf(m, "freq_changes %llu\n", st.freq_changes);
+	seq_printf(m, "clk_rate %lu\n", clk_get_rate(vpu_clk));
+	seq_printf(m, "watchdog_recoveries %lu\n", vpu_wdt_recoveries);
+	seq_printf(m, "last_recover_us %lld\n",
+		   div_s64(vpu_wdt_recover_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_reset_us %lld\n",
+		   div_s64(vpu_seq_times.reset_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_pu_up_us %lld\n",
+		   div_s64(vpu_seq_times.pu_up_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_pu_down_us %lld\n",
+		   div_s64(vpu_seq_times.pu_down_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_boot_us %lld\n",
+		   div_s64(vpu_seq_times.boot_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_suspend_us %lld\n",
+		   div_s64(vpu_seq_times.suspend_ns, NSEC_PER_USEC));
+	seq_printf(m, "last_resume_us %lld\n",
+		   div_s64(vpu_seq_times.resume_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static void vpu_hist_reset(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(&vpu_hist, cpu), 0,
+		       sizeof(struct vpu_hist));
+}
+
+static int vpu_hist_show(struct seq_file *m, void *unused)
+{
+	static const char * const name[VPU_HIST_NUM] = {
+		"irq_to_wake", "wait4int", "job",
+	};
+	static const char * const engine[VPU_ENGINE_NUM] = { "bit", "jpu" };
+	struct vpu_hist *h;
+	char lim[16];
+	u64 count;
+	int cpu, i, e, b;
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (!h)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct vpu_hist *c = per_cpu_ptr(&vpu_hist, cpu);
+
+		for (i = 0; i < VPU_HIST_NUM; i++)
+			for (e = 0; e < VPU_ENGINE_NUM; e++)
+				for (b = 0; b < VPU_HIST_BUCKETS; b++)
+					h->bucket[i][e][b] += c->bucket[i][e][b];
+	}
+
+	for (i = 0; i < VPU_HIST_NUM; i++) {
+		for (e = 0; e < VPU_ENGINE_NUM; e++) {
+			seq_printf(m, "%s.%s\n", name[i], engine[e]);
+			for (b = 0; b < VPU_HIST_BUCKETS; b++) {
+				count = h->bucket[i][e][b];
+				if (!count)
+					continue;
+				/* upper bound with its unit, then padded */
+				if (b == VPU_HIST_BUCKETS - 1)
+					snprintf(lim, sizeof(lim), "inf");
+				else
+					snprintf(lim, sizeof(lim), "%luus",
+						 1UL << b);
+				seq_printf(m, "%10lu %-10s %llu\n",
+					   b ? 1UL << (b - 1) : 0, lim, count);
+			}
+		}
+	}
+
+	kfree(h);
+	return 0;
+}
+
+static int vpu_hist_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vpu_hist_show, NULL);
+}
+
+static ssize_t vpu_hist_write(struct file *file, const char __user *buf,
+			      size_t count, loff_t *ppos)
+{
+	vpu_hist_reset();
+	return count;
+}
+
+static const struct file_operations vpu_hist_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_hist_open,
+	.read = seq_read,
+	.write = vpu_hist_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int vpu_lockstat_show(struct seq_file *m, void *unused)
+{
+	static const char * const site[VPU_LS_NUM] = {
+		"dev.open", "dev.release", "dev.suspend", "dev.resume",
+		"dev.watchdog", "buf.alloc", "buf.free", "buf.put_bufs",
+		"buf.bitwork", "buf.mmap", "buf.bench", "share.share_mem",
+		"share.vshare_mem", "share.mmap", "share.shm", "hw.lock_dev",
+	};
+	struct vpu_lockstat *ls;
+	int i;
+
+	seq_printf(m, "%-17s %12s %12s %16s %14s %16s %14s\n", "site",
+		   "acquired", "contended", "wait_ns", "wait_max_ns",
+		   "hold_ns", "hold_max_ns");
+	for (i = 0; i < VPU_LS_NUM; i++) {
+		ls = &vpu_lockstat[i];
+		seq_printf(m, "%-17s %12llu %12llu %16llu %14llu %16llu %14llu\n",
+			   site[i], ls->acquired, ls->contended, ls->wait_ns,
+			   ls->wait_max_ns, ls->hold_ns, ls->hold_max_ns);
+	}
+	return 0;
+}
+
+static int vpu_lockstat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vpu_lockstat_show, NULL);
+}
+
+/*
+ * Not under any of the locks; a reset racing with an update only loses
+ * that update.
+ */
+static ssize_t vpu_lockstat_write(struct file *file, const char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	memset(vpu_lockstat, 0, sizeof(vpu_lockstat));
+	return count;
+}
+
+static const struct file_operations vpu_lockstat_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_lockstat_open,
+	.read = seq_read,
+	.write = vpu_lockstat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static ssize_t vpu_ls_enable_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *ppos)
+{
+	char tmp[4];
+	int len = snprintf(tmp, sizeof(tmp), "%d\n", vpu_ls_on);
+
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+/* "1" starts counting, "0" stops it; mxc_vpu/lockstat keeps the counts */
+static ssize_t vpu_ls_enable_write(struct file *file, const char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	unsigned int on;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &on);
+	if (ret)
+		return ret;
+	WRITE_ONCE(vpu_ls_on, !!on);
+	return count;
+}
+
+static const struct file_operations vpu_ls_enable_fops = {
+	.owner = THIS_MODULE,
+	.read = vpu_ls_enable_read,
+	.write = vpu_ls_enable_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * In-driver micro-benchmarks of the paths userspace cannot time without
+ * syscall noise, driven through debugfs mxc_vpu/bench:
+ *
+ *   echo "alloc <size> <iters>" > bench	DMA buffer + record alloc/free
+ *   echo "iram <size> <iters>" > bench	IRAM pool alloc/free
+ *   echo "wake <iters>" > bench		worker to waiter wake up
+ *   cat bench				last result of each
+ *
+ * "wake" queues a work item of its own on the driver's workqueue and
+ * sleeps until it runs, so it never touches irq_status or vpu_queue of
+ * the files using the device. At most VPU_BENCH_MAX_ITERS per run.
+ */
+#define VPU_BENCH_MAX_ITERS	100000
+
+enum {
+	VPU_BENCH_ALLOC,
+	VPU_BENCH_IRAM,
+	VPU_BENCH_WAKE,
+	VPU_BENCH_NUM,
+};
+
+struct vpu_bench_result {
+	u32 size;
+	u32 iters;
+	u64 ns[2];		/* per op: alloc and free, or wake */
+};
+
+static struct vpu_bench_result vpu_bench[VPU_BENCH_NUM];
+static DEFINE_MUTEX(vpu_bench_lock);
+
+static int vpu_bench_alloc(u32 size, u32 iters, u64 *ns)
+{
+	struct memalloc_record *rec;
+	s64 t0, t1, t2;
+	u32 i;
+
+	for (i = 0; i < iters; i++) {
+		t0 = ktime_to_ns(ktime_get());
+		rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+		if (!rec)
+			return -ENOMEM;
+		kref_init(&rec->ref);
+		rec->mem.size = size;
+		if (vpu_alloc_dma_buffer(&rec->mem) == -1) {
+			kfree(rec);
+			return -ENOMEM;
+		}
+		vpu_mutex_lock(&vpu_buf_lock, VPU_LS_BENCH);
+		list_add(&rec->list, &head);
+		vpu_mutex_unlock(&vpu_buf_lock);
+		t1 = ktime_to_ns(ktime_get());
+
+		vpu_mutex_lock(&vpu_buf_lock, VPU_LS_BENCH);
+		list_del_init(&rec->list);
+		vpu_mutex_unlock(&vpu_buf_lock);
+		vpu_buf_put(rec);
+		t2 = ktime_to_ns(ktime_get());
+
+		ns[0] += t1 - t0;
+		ns[1] += t2 - t1;
+		cond_resched();
+	}
+	return 0;
+}
+
+static int vpu_bench_iram(u32 size, u32 iters, u64 *ns)
+{
+	unsigned long addr;
+	s64 t0, t1;
+	u32 i;
+
+	for (i = 0; i < iters; i++) {
+		t0 = ktime_to_ns(ktime_get());
+		if (!iram_alloc(size, &addr))
+			return -ENOMEM;
+		t1 = ktime_to_ns(ktime_get());
+		iram_free(addr, size);
+		ns[0] += t1 - t0;
+		ns[1] += ktime_to_ns(ktime_get()) - t1;
+		cond_resched();
+	}
+	return 0;
+}
+
+struct vpu_bench_waker {
+	struct work_struct work;
+	wait_queue_head_t queue;
+	int woken;
+};
+
+static void vpu_bench_wake_fn(struct work_struct *w)
+{
+	struct vpu_bench_waker *b =
+		container_of(w, struct vpu_bench_waker, work);
 
-			if (lock_en)
-				mutex_lock(&vpu_data.lock);
-			else
-				mutex_unlock(&vpu_data.lock);
+	WRITE_ONCE(b->woken, 1);
+	wake_up(&b->queue);
+}
 
+static int vpu_bench_wake(u32 iters, u64 *ns)
+{
+	struct vpu_bench_waker b;
+	int ret = 0;
+	s64 t0;
+	u32 i;
+
+	init_waitqueue_head(&b.queue);
+	INIT_WORK_ONSTACK(&b.work, vpu_bench_wake_fn);
+	for (i = 0; i < iters; i++) {
+		b.woken = 0;
+		t0 = ktime_to_ns(ktime_get());
+		queue_work(vpu_data.workqueue, &b.work);
+		if (!wait_event_timeout(b.queue, READ_ONCE(b.woken), HZ)) {
+			ret = -ETIME;
 			break;
 		}
-	default:
-		{
-			printk(KERN_ERR "No such IOCTL, cmd is %d\n", cmd);
-			ret = -EINVAL;
-			break;
-		}
+		ns[0] += ktime_to_ns(ktime_get()) - t0;
+		cond_resched();
 	}
+	flush_work(&b.work);
+	destroy_work_on_stack(&b.work);
 	return ret;
 }
 
-/*!
- * @brief Release function for vpu file operation
- * @return  0 on success or negative error code on error
- */
-static int vpu_release(struct inode *inode, struct file *filp)
+static int vpu_bench_show(struct seq_file *m, void *unused)
 {
-	int i;
-	unsigned long timeout;
-
-	mutex_lock(&vpu_data.lock);
+	struct vpu_bench_result *r;
+
+	mutex_lock(&vpu_bench_lock);
+	r = &vpu_bench[VPU_BENCH_ALLOC];
+	seq_printf(m, "alloc size %u iters %u alloc_ns %llu free_ns %llu\n",
+		   r->size, r->iters, r->ns[0], r->ns[1]);
+	r = &vpu_bench[VPU_BENCH_IRAM];
+	seq_printf(m, "iram size %u iters %u alloc_ns %llu free_ns %llu\n",
+		   r->size, r->iters, r->ns[0], r->ns[1]);
+	r = &vpu_bench[VPU_BENCH_WAKE];
+	seq_printf(m, "wake iters %u wake_ns %llu\n", r->iters, r->ns[0]);
+	mutex_unlock(&vpu_bench_lock);
+	return 0;
+}
 
-	if (open_count > 0 && !(--open_count)) {
+static int vpu_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, vpu_bench_show, NULL);
+}
 
-		/* Wait for vpu go to idle state */
-		clk_prepare(vpu_clk);
-		clk_enable(vpu_clk);
-		if (READ_REG(BIT_CUR_PC)) {
+static ssize_t vpu_bench_write(struct file *file, const char __user *buf,
+			       size_t count, loff_t *ppos)
+{
+	struct vpu_bench_result r = { 0 };
+	char cmd[48], name[8];
+	int which, ret;
+
+	if (count >= sizeof(cmd))
+		return -EINVAL;
+	if (copy_from_user(cmd, buf, count))
+		return -EFAULT;
+	cmd[count] = 0;
+
+	if (sscanf(cmd, "%7s %u %u", name, &r.size, &r.iters) == 3 &&
+	    !strcmp(name, "alloc"))
+		which = VPU_BENCH_ALLOC;
+	else if (sscanf(cmd, "%7s %u %u", name, &r.size, &r.iters) == 3 &&
+		 !strcmp(name, "iram"))
+		which = VPU_BENCH_IRAM;
+	else if (sscanf(cmd, "%7s %u", name, &r.iters) == 2 &&
+		 !strcmp(name, "wake"))
+		which = VPU_BENCH_WAKE;
+	else
+		return -EINVAL;
+	if (!r.iters || r.iters > VPU_BENCH_MAX_ITERS ||
+	    (which != VPU_BENCH_WAKE && !r.size))
+		return -EINVAL;
+
+	mutex_lock(&vpu_bench_lock);
+	if (which == VPU_BENCH_ALLOC)
+		ret = vpu_bench_alloc(r.size, r.iters, r.ns);
+	else if (which == VPU_BENCH_IRAM)
+		ret = vpu_bench_iram(r.size, r.iters, r.ns);
+	else
+		ret = vpu_bench_wake(r.iters, r.ns);
+	if (!ret) {
+		r.ns[0] = div_u64(r.ns[0], r.iters);
+		r.ns[1] = div_u64(r.ns[1], r.iters);
+		vpu_bench[which] = r;
+	}
+	mutex_unlock(&vpu_bench_lock);
 
-			timeout = jiffies + HZ;
-			while (READ_REG(BIT_BUSY_FLAG)) {
-				msleep(1);
-				if (time_after(jiffies, timeout)) {
-					printk(KERN_WARNING "VPU timeout during release\n");
-					break;
-				}
-			}
-			clk_disable(vpu_clk);
-			clk_unprepare(vpu_clk);
+	return ret ? ret : count;
+}
 
-			/* Clean up interrupt */
-			cancel_work_sync(&vpu_data.work);
-			flush_workqueue(vpu_data.workqueue);
-			irq_status = 0;
+static const struct file_operations vpu_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_bench_open,
+	.read = seq_read,
+	.write = vpu_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-			clk_prepare(vpu_clk);
-			clk_enable(vpu_clk);
-			if (READ_REG(BIT_BUSY_FLAG)) {
+/* entries oldest first; stop recording before reading a busy device */
+static ssize_t vpu_rec_read(struct file *file, char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct vpu_rec r;
+	unsigned long flags;
+	unsigned int idx;
+	ssize_t done = 0;
+	bool valid;
+
+	if (*ppos % sizeof(r))
+		return -EINVAL;
+	idx = div_u64(*ppos, sizeof(r));
+
+	while (count - done >= sizeof(r)) {
+		spin_lock_irqsave(&vpu_rec_lock, flags);
+		valid = vpu_rec_buf && idx < vpu_rec_count;
+		if (valid)
+			r = vpu_rec_buf[(vpu_rec_head + record_entries -
+					 vpu_rec_count + idx) % record_entries];
+		spin_unlock_irqrestore(&vpu_rec_lock, flags);
+		if (!valid)
+			break;
 
-				if (cpu_is_mx51() || cpu_is_mx53()) {
-					printk(KERN_ERR
-						"fatal error: can't gate/power off when VPU is busy\n");
-					clk_disable(vpu_clk);
-					clk_unprepare(vpu_clk);
-					mutex_unlock(&vpu_data.lock);
-					return -EFAULT;
-				}
+		if (copy_to_user(buf + done, &r, sizeof(r)))
+			return done ? done : -EFAULT;
+		done += sizeof(r);
+		idx++;
+	}
+	*ppos += done;
+	return done;
+}
 
-#ifdef CONFIG_SOC_IMX6Q
-				if (cpu_is_mx6dl() || cpu_is_mx6q()) {
-					WRITE_REG(0x11, 0x10F0);
-					timeout = jiffies + HZ;
-					while (READ_REG(0x10F4) != 0x77) {
-						msleep(1);
-						if (time_after(jiffies, timeout))
-							break;
-					}
-
-					if (READ_REG(0x10F4) != 0x77) {
-						printk(KERN_ERR
-							"fatal error: can't gate/power off when VPU is busy\n");
-						WRITE_REG(0x0, 0x10F0);
-						clk_disable(vpu_clk);
-						clk_unprepare(vpu_clk);
-						mutex_unlock(&vpu_data.lock);
-						return -EFAULT;
-					} else {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
-						imx_src_reset_vpu();
-#else
-						if (vpu_plat->reset)
-							vpu_plat->reset();
-#endif
-					}
-				}
-#endif
-			}
-		}
-		clk_disable(vpu_clk);
-		clk_unprepare(vpu_clk);
+static const struct file_operations vpu_rec_fops = {
+	.owner = THIS_MODULE,
+	.read = vpu_rec_read,
+	.llseek = default_llseek,
+};
 
-		vpu_free_buffers();
+static ssize_t vpu_rec_enable_read(struct file *file, char __user *buf,
+				   size_t count, loff_t *ppos)
+{
+	char tmp[4];
+	int len = snprintf(tmp, sizeof(tmp), "%d\n", vpu_rec_on);
 
-		/* Free shared memory when vpu device is idle */
-		vpu_free_dma_buffer(&share_mem);
-		share_mem.cpu_addr = 0;
-		vfree((void *)vshare_mem.cpu_addr);
-		vshare_mem.cpu_addr = 0;
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
 
-		vpu_clk_usercount = atomic_read(&clk_cnt_from_ioc);
-		for (i = 0; i < vpu_clk_usercount; i++) {
-			clk_disable(vpu_clk);
-			clk_unprepare(vpu_clk);
-			atomic_dec(&clk_cnt_from_ioc);
-		}
+/* "1" clears the ring and starts recording, "0" stops it */
+static ssize_t vpu_rec_enable_write(struct file *file, const char __user *buf,
+				    size_t count, loff_t *ppos)
+{
+	struct vpu_rec *ring = NULL;
+	unsigned long flags;
+	unsigned int on;
+	int ret;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
-		if (!IS_ERR(vpu_regulator))
-			regulator_disable(vpu_regulator);
-#else
-		imx_gpc_power_up_pu(false);
-		pm_runtime_put_sync_suspend(&vpu_pdev->dev);
-#endif
+	ret = kstrtouint_from_user(buf, count, 0, &on);
+	if (ret)
+		return ret;
+	if (on && !record_entries)
+		return -EINVAL;
+
+	/* the ring is allocated on first use and kept until unload */
+	if (on && !vpu_rec_buf) {
+		ring = vzalloc(record_entries * sizeof(*ring));
+		if (!ring)
+			return -ENOMEM;
+	}
 
+	spin_lock_irqsave(&vpu_rec_lock, flags);
+	if (ring && !vpu_rec_buf) {
+		vpu_rec_buf = ring;
+		ring = NULL;
+	}
+	if (on) {
+		vpu_rec_head = 0;
+		vpu_rec_count = 0;
 	}
-	mutex_unlock(&vpu_data.lock);
+	vpu_rec_on = !!on;
+	spin_unlock_irqrestore(&vpu_rec_lock, flags);
 
-	return 0;
+	vfree(ring);
+	return count;
 }
 
-/*!
- * @brief fasync function for vpu file operation
- * @return  0 on success or negative error code on error
- */
-static int vpu_fasync(int fd, struct file *filp, int mode)
+static const struct file_operations vpu_rec_enable_fops = {
+	.owner = THIS_MODULE,
+	.read = vpu_rec_enable_read,
+	.write = vpu_rec_enable_write,
+	.llseek = default_llseek,
+};
+
+static int vpu_stats_open(struct inode *inode, struct file *file)
 {
-	struct vpu_priv *dev = (struct vpu_priv *)filp->private_data;
-	return fasync_helper(fd, filp, mode, &dev->async_queue);
+	return single_open(file, vpu_stats_show, NULL);
 }
 
-/*!
- * @brief memory map function of harware registers for vpu file operation
- * @return  0 on success or negative error code on error
- */
-static int vpu_map_hwregs(struct file *fp, struct vm_area_struct *vm)
-{
-	unsigned long pfn;
+static const struct file_operations vpu_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = vpu_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-	vm->vm_flags |= VM_IO;
-	/*
-	 * Since vpu registers have been mapped with ioremap() at probe
-	 * which L_PTE_XN is 1, and the same physical address must be
-	 * mapped multiple times with same type, so set L_PTE_XN to 1 here.
-	 * Otherwise, there may be unexpected result in video codec.
-	 */
-	vm->vm_page_prot = pgprot_noncachedxn(vm->vm_page_prot);
-	pfn = phy_vpu_base_addr >> PAGE_SHIFT;
-	pr_debug("size=0x%x,  page no.=0x%x\n",
-		 (int)(vm->vm_end - vm->vm_start), (int)pfn);
-	return remap_pfn_range(vm, vm->vm_start, pfn, vm->vm_end - vm->vm_start,
-			       vm->vm_page_prot) ? -EAGAIN : 0;
+static ssize_t vpu_stats_reset_write(struct file *file,
+				     const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	vpu_stats_reset();
+	vpu_hist_reset();
+	return count;
 }
 
-/*!
- * @brief memory map function of memory for vpu file operation
- * @return  0 on success or negative error code on error
- */
-static int vpu_map_dma_mem(struct file *fp, struct vm_area_struct *vm)
-{
-	int request_size;
-	request_size = vm->vm_end - vm->vm_start;
+static const struct file_operations vpu_stats_reset_fops = {
+	.owner = THIS_MODULE,
+	.write = vpu_stats_reset_write,
+};
 
-	pr_debug(" start=0x%x, pgoff=0x%x, size=0x%x\n",
-		 (unsigned int)(vm->vm_start), (unsigned int)(vm->vm_pgoff),
-		 request_size);
+static ssize_t utilization_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct vpu_stats st;
 
-	vm->vm_flags |= VM_IO;
-	vm->vm_page_prot = pgprot_writecombine(vm->vm_page_prot);
+	vpu_stats_sum(&st);
+	return sprintf(buf, "%u\n", vpu_stats_util(&st));
+}
 
-	return remap_pfn_range(vm, vm->vm_start, vm->vm_pgoff,
-			       request_size, vm->vm_page_prot) ? -EAGAIN : 0;
+static ssize_t jobs_show(struct device *dev,
+			 struct device_attribute *attr, char *buf)
+{
+	struct vpu_stats st;
 
+	vpu_stats_sum(&st);
+	return sprintf(buf, "%llu\n",
+		       st.jobs[VPU_ENGINE_BIT] + st.jobs[VPU_ENGINE_JPU]);
 }
 
-/* !
- * @brief memory map function of vmalloced share memory
- * @return  0 on success or negative error code on error
- */
-static int vpu_map_vshare_mem(struct file *fp, struct vm_area_struct *vm)
+static ssize_t interrupts_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
 {
-	int ret = -EINVAL;
+	struct vpu_stats st;
 
-	ret = remap_vmalloc_range(vm, (void *)(vm->vm_pgoff << PAGE_SHIFT), 0);
-	vm->vm_flags |= VM_IO;
+	vpu_stats_sum(&st);
+	return sprintf(buf, "%llu %llu\n",
+		       st.irqs[VPU_ENGINE_BIT], st.irqs[VPU_ENGINE_JPU]);
+}
 
-	return ret;
+static ssize_t stats_reset_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	vpu_stats_reset();
+	return count;
 }
-/*!
- * @brief memory map interface for vpu file operation
- * @return  0 on success or negative error code on error
- */
-static int vpu_mmap(struct file *fp, struct vm_area_struct *vm)
+
+static DEVICE_ATTR(utilization, S_IRUGO, utilization_show, NULL);
+static DEVICE_ATTR(jobs, S_IRUGO, jobs_show, NULL);
+static DEVICE_ATTR(interrupts, S_IRUGO, interrupts_show, NULL);
+static DEVICE_ATTR(stats_reset, S_IWUSR, NULL, stats_reset_store);
+
+static struct attribute *vpu_stats_attrs[] = {
+	&dev_attr_utilization.attr,
+	&dev_attr_jobs.attr,
+	&dev_attr_interrupts.attr,
+	&dev_attr_stats_reset.attr,
+	NULL,
+};
+
+/* created with the device, before its uevent goes out */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+ATTRIBUTE_GROUPS(vpu_stats);
+#else
+static const struct attribute_group vpu_stats_group = {
+	.attrs = vpu_stats_attrs,
+};
+#endif
+
+static void vpu_stats_init(void)
 {
-	unsigned long offset;
+	vpu_stats_reset();
 
-	offset = vshare_mem.cpu_addr >> PAGE_SHIFT;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+	if (sysfs_create_group(&vpu_dev->kobj, &vpu_stats_group))
+		printk(KERN_WARNING "vpu: failed to create stats attributes\n");
+#endif
 
-	if (vm->vm_pgoff && (vm->vm_pgoff == offset))
-		return vpu_map_vshare_mem(fp, vm);
-	else if (vm->vm_pgoff)
-		return vpu_map_dma_mem(fp, vm);
-	else
-		return vpu_map_hwregs(fp, vm);
+	/* debugfs is best effort, the driver works without it */
+	vpu_debugfs = debugfs_create_dir("mxc_vpu", NULL);
+	if (IS_ERR_OR_NULL(vpu_debugfs)) {
+		vpu_debugfs = NULL;
+		return;
+	}
+	debugfs_create_file("stats", S_IRUGO, vpu_debugfs, NULL,
+			    &vpu_stats_fops);
+	debugfs_create_file("reset", S_IWUSR, vpu_debugfs, NULL,
+			    &vpu_stats_reset_fops);
+	debugfs_create_file("histograms", S_IRUGO | S_IWUSR, vpu_debugfs,
+			    NULL, &vpu_hist_fops);
+	debugfs_create_file("lockstat", S_IRUGO | S_IWUSR, vpu_debugfs,
+			    NULL, &vpu_lockstat_fops);
+	debugfs_create_file("lockstat_enable", S_IRUGO | S_IWUSR, vpu_debugfs,
+			    NULL, &vpu_ls_enable_fops);
+	debugfs_create_file("bench", S_IRUGO | S_IWUSR, vpu_debugfs,
+			    NULL, &vpu_bench_fops);
+	debugfs_create_file("record", S_IRUSR, vpu_debugfs, NULL,
+			    &vpu_rec_fops);
+	debugfs_create_file("record_enable", S_IRUGO | S_IWUSR, vpu_debugfs,
+			    NULL, &vpu_rec_enable_fops);
 }
 
-const struct file_operations vpu_fops = {
-	.owner = THIS_MODULE,
-	.open = vpu_open,
-	.unlocked_ioctl = vpu_ioctl,
-	.release = vpu_release,
-	.fasync = vpu_fasync,
-	.mmap = vpu_mmap,
-};
+static void vpu_stats_exit(void)
+{
+	unsigned long flags;
+	struct vpu_rec *ring;
+
+	debugfs_remove_recursive(vpu_debugfs);
+	vpu_debugfs = NULL;
+
+	spin_lock_irqsave(&vpu_rec_lock, flags);
+	vpu_rec_on = false;
+	ring = vpu_rec_buf;
+	vpu_rec_buf = NULL;
+	spin_unlock_irqrestore(&vpu_rec_lock, flags);
+	vfree(ring);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+	sysfs_remove_group(&vpu_dev->kobj, &vpu_stats_group);
+#endif
+}
 
 /*!
  * This function is called by the driver framework to initialize the vpu device.
@@ -1077,6 +5681,11 @@ static int vpu_dev_probe(struct platform_device *pdev)
 	struct device_node *np = pdev->dev.of_node;
 	u32 iramsize;
 
+	vpu_plat = pdev->dev.platform_data;
+	/* SRC/GPC are only needed when the platform has no hooks of its own */
+	if (!vpu_plat || !vpu_plat->reset || !vpu_plat->pg)
+		vpu_map_pgc_regs();
+
 	err = of_property_read_u32(np, "iramsize", (u32 *)&iramsize);
 	if (!err && iramsize)
 		iram_alloc(iramsize, &addr);
@@ -1108,7 +5717,10 @@ static int vpu_dev_probe(struct platform_device *pdev)
 		return -ENODEV;
 	}
 	phy_vpu_base_addr = res->start;
-	vpu_base = ioremap(res->start, res->end - res->start);
+	if (vpu_plat && vpu_plat->regs)
+		vpu_base = vpu_plat->regs;
+	else
+		vpu_base = ioremap(res->start, res->end - res->start);
 
 	vpu_major = register_chrdev(vpu_major, "mxc_vpu", &vpu_fops);
 	if (vpu_major < 0) {
@@ -1123,12 +5735,19 @@ static int vpu_dev_probe(struct platform_device *pdev)
 		goto err_out_chrdev;
 	}
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0)
+	temp_class = device_create_with_groups(vpu_class, NULL,
+					       MKDEV(vpu_major, 0), NULL,
+					       vpu_stats_groups, "mxc_vpu");
+#else
 	temp_class = device_create(vpu_class, NULL, MKDEV(vpu_major, 0),
 				   NULL, "mxc_vpu");
+#endif
 	if (IS_ERR(temp_class)) {
 		err = PTR_ERR(temp_class);
 		goto err_out_class;
 	}
+	vpu_dev = temp_class;
 
 	vpu_clk = clk_get(&pdev->dev, "vpu_clk");
 	if (IS_ERR(vpu_clk)) {
@@ -1140,19 +5759,19 @@ static int vpu_dev_probe(struct platform_device *pdev)
 	if (vpu_ipi_irq < 0) {
 		printk(KERN_ERR "vpu: unable to get vpu interrupt\n");
 		err = -ENXIO;
-		goto err_out_class;
+		goto err_out_clk;
 	}
 	err = request_irq(vpu_ipi_irq, vpu_ipi_irq_handler, 0, "VPU_CODEC_IRQ",
 			  (void *)(&vpu_data));
 	if (err)
-		goto err_out_class;
+		goto err_out_clk;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
 	vpu_regulator = regulator_get(NULL, "cpu_vddvpu");
 	if (IS_ERR(vpu_regulator)) {
 		if (!(cpu_is_mx51() || cpu_is_mx53())) {
 			printk(KERN_ERR
 				"%s: failed to get vpu regulator\n", __func__);
-			goto err_out_class;
+			goto err_out_clk;
 		} else {
 			/* regulator_get will return error on MX5x,
 			 * just igore it everywhere*/
@@ -1168,13 +5787,13 @@ static int vpu_dev_probe(struct platform_device *pdev)
 		printk(KERN_ERR "vpu: unable to get vpu jpu interrupt\n");
 		err = -ENXIO;
 		free_irq(vpu_ipi_irq, &vpu_data);
-		goto err_out_class;
+		goto err_out_clk;
 	}
 	err = request_irq(vpu_jpu_irq, vpu_jpu_irq_handler, IRQF_TRIGGER_RISING,
 			  "VPU_JPG_IRQ", (void *)(&vpu_data));
 	if (err) {
 		free_irq(vpu_ipi_irq, &vpu_data);
-		goto err_out_class;
+		goto err_out_clk;
 	}
 #endif
 
@@ -1184,33 +5803,81 @@ static int vpu_dev_probe(struct platform_device *pdev)
 
 	vpu_data.workqueue = create_workqueue("vpu_wq");
 	INIT_WORK(&vpu_data.work, vpu_worker_callback);
-	mutex_init(&vpu_data.lock);
+#ifdef MXC_VPU_HAS_DMAENGINE
+	vpu_copy_init();
+#endif
+	mutex_init(&vpu_data.lock.lock);
+	register_pm_notifier(&vpu_pm_nb);
+	vpu_stats_init();
+
+#ifdef CONFIG_MXC_VPU_DEVFREQ
+	err = vpu_devfreq_init(&pdev->dev);
+	if (err) {
+		printk(KERN_WARNING "vpu: devfreq disabled (%d)\n", err);
+		err = 0;
+	}
+#endif
 	printk(KERN_INFO "VPU initialized\n");
 	goto out;
 
+err_out_clk:
+	clk_put(vpu_clk);
 err_out_class:
 	device_destroy(vpu_class, MKDEV(vpu_major, 0));
 	class_destroy(vpu_class);
 err_out_chrdev:
 	unregister_chrdev(vpu_major, "mxc_vpu");
 error:
-	iounmap(vpu_base);
+	if (!vpu_plat || !vpu_plat->regs)
+		iounmap(vpu_base);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	vpu_unmap_pgc_regs();
+#endif
 out:
 	return err;
 }
 
 static int vpu_dev_remove(struct platform_device *pdev)
 {
+	/* opens hold the device's module and unbinding is not offered */
+	WARN_ON(open_count);
+#ifdef CONFIG_MXC_VPU_DEVFREQ
+	vpu_devfreq_exit();
+#endif
 	free_irq(vpu_ipi_irq, &vpu_data);
 #ifdef MXC_VPU_HAS_JPU
 	free_irq(vpu_jpu_irq, &vpu_data);
 #endif
+	vpu_stats_exit();
+	unregister_pm_notifier(&vpu_pm_nb);
+	cancel_delayed_work_sync(&vpu_wdt_work);
 	cancel_work_sync(&vpu_data.work);
 	flush_workqueue(vpu_data.workqueue);
 	destroy_workqueue(vpu_data.workqueue);
+#ifdef MXC_VPU_HAS_DMAENGINE
+	vpu_copy_exit();
+#endif
+
+	if (bitwork_owned)
+		vpu_free_dma_buffer(&bitwork_mem);
+	memset(&bitwork_mem, 0, sizeof(bitwork_mem));
+	bitwork_owned = false;
+	vpu_free_dma_buffer(&pic_para_mem);
+	vpu_free_dma_buffer(&user_data_mem);
+
+	if (vpu_major > 0) {
+		device_destroy(vpu_class, MKDEV(vpu_major, 0));
+		class_destroy(vpu_class);
+		unregister_chrdev(vpu_major, "mxc_vpu");
+		vpu_major = 0;
+	}
 
-	iounmap(vpu_base);
+	if (!vpu_plat || !vpu_plat->regs)
+		iounmap(vpu_base);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	flush_work(&vpu_power_off_work);
+	flush_work(&vpu_reset_work);
+	vpu_unmap_pgc_regs();
 	if (iram.start)
 		iram_free(iram.start, iram.end-iram.start+1);
 #else
@@ -1221,7 +5888,10 @@ static int vpu_dev_remove(struct platform_device *pdev)
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
 	if (!IS_ERR(vpu_regulator))
 		regulator_put(vpu_regulator);
+#else
+	vpu_pdev = NULL;
 #endif
+	clk_put(vpu_clk);
 	return 0;
 }
 
@@ -1233,9 +5903,13 @@ static int vpu_suspend(struct platform_device *pdev, pm_message_t state)
 #endif
 {
 	int i;
-	unsigned long timeout;
+	s64 start = ktime_to_ns(ktime_get());
 
-	mutex_lock(&vpu_data.lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
+	/* a deferred power down must land before we look at the state */
+	flush_work(&vpu_power_off_work);
+#endif
+	vpu_lock(VPU_LS_SUSPEND);
 	if (open_count == 0) {
 		/* VPU is released (all instances are freed),
 		 * clock is already off, context is no longer needed,
@@ -1248,19 +5922,24 @@ static int vpu_suspend(struct platform_device *pdev, pm_message_t state)
 #endif
 		}
 	} else {
-		/* Wait for vpu go to idle state, suspect vpu cannot be changed
-		   to idle state after about 1 sec */
-		timeout = jiffies + HZ;
+		/*
+		 * No new job gets admitted from here on. Let the running one
+		 * finish, and if it does not, reset the VPU and fail that
+		 * job rather than the whole system suspend.
+		 */
+		vpu_suspending = true;
+		wait_event_timeout(vpu_idle_queue, !vpu_is_busy(),
+				   msecs_to_jiffies(VPU_SUSPEND_DRAIN_MS));
+		/* frozen by now, resume restarts it for a job still held */
+		cancel_delayed_work(&vpu_wdt_work);
+
 		clk_prepare(vpu_clk);
 		clk_enable(vpu_clk);
-		while (READ_REG(BIT_BUSY_FLAG)) {
-			msleep(1);
-			if (time_after(jiffies, timeout)) {
-				clk_disable(vpu_clk);
-				clk_unprepare(vpu_clk);
-				mutex_unlock(&vpu_data.lock);
-				return -EAGAIN;
-			}
+		if (READ_REG(BIT_BUSY_FLAG)) {
+			printk(KERN_WARNING "VPU busy at suspend, resetting\n");
+			if (vpu_hw_recover())
+				printk(KERN_ERR "VPU: reset before suspend failed\n");
+			vpu_wdt_complete_job(0, true);
 		}
 		clk_disable(vpu_clk);
 		clk_unprepare(vpu_clk);
@@ -1272,18 +5951,13 @@ static int vpu_suspend(struct platform_device *pdev, pm_message_t state)
 			clk_unprepare(vpu_clk);
 		}
 
-		if (cpu_is_mx53()) {
-			mutex_unlock(&vpu_data.lock);
-			return 0;
-		}
+		if (cpu_is_mx53())
+			goto out;
 
-		if (bitwork_mem.cpu_addr != 0) {
+		if (bitwork_mem.cpu_addr) {
 			clk_prepare(vpu_clk);
 			clk_enable(vpu_clk);
-			/* Save 64 registers from BIT_CODE_BUF_ADDR */
-			for (i = 0; i < 64; i++)
-				regBk[i] = READ_REG(BIT_CODE_BUF_ADDR + (i * 4));
-			pc_before_suspend = READ_REG(BIT_CUR_PC);
+			vpu_save_context();
 			clk_disable(vpu_clk);
 			clk_unprepare(vpu_clk);
 		}
@@ -1299,11 +5973,13 @@ static int vpu_suspend(struct platform_device *pdev, pm_message_t state)
 		if (!IS_ERR(vpu_regulator))
 			regulator_disable(vpu_regulator);
 #else
-		imx_gpc_power_up_pu(false);
+		vpu_pu_power(false);
 #endif
 	}
 
-	mutex_unlock(&vpu_data.lock);
+out:
+	vpu_unlock();
+	vpu_seq_times.suspend_ns = ktime_to_ns(ktime_get()) - start;
 	return 0;
 }
 
@@ -1314,8 +5990,9 @@ static int vpu_resume(struct platform_device *pdev)
 #endif
 {
 	int i;
+	s64 start = ktime_to_ns(ktime_get());
 
-	mutex_lock(&vpu_data.lock);
+	vpu_lock(VPU_LS_RESUME);
 	if (open_count == 0) {
 		/* VPU is released (all instances are freed),
 		 * clock should be kept off, context is no longer needed,
@@ -1340,14 +6017,11 @@ static int vpu_resume(struct platform_device *pdev)
 		if (vpu_plat->pg)
 			vpu_plat->pg(0);
 #else
-		imx_gpc_power_up_pu(true);
+		vpu_pu_power(true);
 #endif
 
-		if (bitwork_mem.cpu_addr != 0) {
-			u32 *p = (u32 *) bitwork_mem.cpu_addr;
-			u32 data, pc;
-			u16 data_hi;
-			u16 data_lo;
+		if (bitwork_mem.cpu_addr) {
+			u32 pc;
 
 			clk_prepare(vpu_clk);
 			clk_enable(vpu_clk);
@@ -1360,46 +6034,8 @@ static int vpu_resume(struct platform_device *pdev)
 				goto recover_clk;
 			}
 
-			/* Restore registers */
-			for (i = 0; i < 64; i++)
-				WRITE_REG(regBk[i], BIT_CODE_BUF_ADDR + (i * 4));
-
-			WRITE_REG(0x0, BIT_RESET_CTRL);
-			WRITE_REG(0x0, BIT_CODE_RUN);
-			/* MX6 RTL has a bug not to init MBC_SET_SUBBLK_EN on reset */
-#ifdef CONFIG_SOC_IMX6Q
-			WRITE_REG(0x0, MBC_SET_SUBBLK_EN);
-#endif
-
-			/*
-			 * Re-load boot code, from the codebuffer in external RAM.
-			 * Thankfully, we only need 4096 bytes, same for all platforms.
-			 */
-			for (i = 0; i < 2048; i += 4) {
-				data = p[(i / 2) + 1];
-				data_hi = (data >> 16) & 0xFFFF;
-				data_lo = data & 0xFFFF;
-				WRITE_REG((i << 16) | data_hi, BIT_CODE_DOWN);
-				WRITE_REG(((i + 1) << 16) | data_lo,
-						BIT_CODE_DOWN);
-
-				data = p[i / 2];
-				data_hi = (data >> 16) & 0xFFFF;
-				data_lo = data & 0xFFFF;
-				WRITE_REG(((i + 2) << 16) | data_hi,
-						BIT_CODE_DOWN);
-				WRITE_REG(((i + 3) << 16) | data_lo,
-						BIT_CODE_DOWN);
-			}
-
-			if (pc_before_suspend) {
-				WRITE_REG(0x1, BIT_BUSY_FLAG);
-				WRITE_REG(0x1, BIT_CODE_RUN);
-				while (READ_REG(BIT_BUSY_FLAG))
-					;
-			} else {
-				printk(KERN_WARNING "PC=0 before suspend\n");
-			}
+			if (vpu_restore_context())
+				printk(KERN_ERR "VPU boot timeout after resume\n");
 			clk_disable(vpu_clk);
 			clk_unprepare(vpu_clk);
 		}
@@ -1412,20 +6048,39 @@ recover_clk:
 		}
 	}
 
-	mutex_unlock(&vpu_data.lock);
+	/* reopen admission, held back jobs go on from here */
+	vpu_suspending = false;
+	wake_up_all(&vpu_admit_queue);
+	vpu_ring_kick();
+	if (READ_ONCE(vpu_wdt_job))
+		vpu_wdt_schedule();
+
+	vpu_unlock();
+	vpu_seq_times.resume_ns = ktime_to_ns(ktime_get()) - start;
 	return 0;
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
 static int vpu_runtime_suspend(struct device *dev)
 {
-	//release_bus_freq(BUS_FREQ_HIGH);
+#ifdef CONFIG_MXC_VPU_DEVFREQ
+	if (vpu_devfreq)
+		devfreq_suspend_device(vpu_devfreq);
+#endif
+	vpu_bus_freq(false);
 	return 0;
 }
 
 static int vpu_runtime_resume(struct device *dev)
 {
-	//request_bus_freq(BUS_FREQ_HIGH);
+#ifdef CONFIG_MXC_VPU_DEVFREQ
+	/* the governor raises the bus together with the top setpoint */
+	if (vpu_devfreq) {
+		devfreq_resume_device(vpu_devfreq);
+		return 0;
+	}
+#endif
+	vpu_bus_freq(true);
 	return 0;
 }
 
@@ -1454,6 +6109,7 @@ MODULE_DEVICE_TABLE(of, vpu_of_match);
 static struct platform_driver mxcvpu_driver = {
 	.driver = {
 		   .name = "mxc_vpu",
+		   .suppress_bind_attrs = true,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 5, 0)
 		   .of_match_table = vpu_of_match,
 #ifdef CONFIG_PM
@@ -1486,17 +6142,6 @@ static int __init vpu_init(void)
 
 static void __exit vpu_exit(void)
 {
-	if (vpu_major > 0) {
-		device_destroy(vpu_class, MKDEV(vpu_major, 0));
-		class_destroy(vpu_class);
-		unregister_chrdev(vpu_major, "mxc_vpu");
-		vpu_major = 0;
-	}
-
-	vpu_free_dma_buffer(&bitwork_mem);
-	vpu_free_dma_buffer(&pic_para_mem);
-	vpu_free_dma_buffer(&user_data_mem);
-
 	/* reset VPU state */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 5, 0)
 	if (!IS_ERR(vpu_regulator))
@@ -1510,17 +6155,19 @@ static void __exit vpu_exit(void)
 	if (!IS_ERR(vpu_regulator))
 		regulator_disable(vpu_regulator);
 #else
-	imx_gpc_power_up_pu(true);
-	clk_prepare(vpu_clk);
-	clk_enable(vpu_clk);
-	imx_src_reset_vpu();
-	clk_disable(vpu_clk);
-	clk_unprepare(vpu_clk);
-	imx_gpc_power_up_pu(false);
+	/* nothing to reset if the device went away before the module */
+	if (vpu_pdev) {
+		flush_work(&vpu_power_off_work);
+		vpu_pu_power(true);
+		clk_prepare(vpu_clk);
+		clk_enable(vpu_clk);
+		vpu_hw_reset();
+		clk_disable(vpu_clk);
+		clk_unprepare(vpu_clk);
+		vpu_pu_power(false);
+	}
 #endif
 
-	clk_put(vpu_clk);
-
 	platform_driver_unregister(&mxcvpu_driver);
 	return;
 }
@@ -1531,3 +6178,9 @@ MODULE_LICENSE("GPL");
 
 module_init(vpu_init);
 module_exit(vpu_exit);
+
+#if defined(CONFIG_MXC_VPU_KUNIT_TEST) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+/* from 6.0, KUnit suites can sit in a module with its own module_init */
+#include "mxc_vpu_test.c"
+#endif
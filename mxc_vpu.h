@@ -33,15 +33,337 @@ struct mxc_vpu_platform_data {
         int  iram_size;
         void (*reset) (void);
         void (*pg) (int);
+        void __iomem *regs;     /* pre-mapped register window, optional */
+        struct module *owner;   /* registered the device, held while open */
 };
 
+/*
+ * Buffer descriptor of the original ioctls. Four 32-bit fields on every
+ * kernel, so 32-bit userspace works unchanged on a 64-bit kernel. The VPU
+ * only addresses 32 bits, and cpu_addr is an opaque handle rather than a
+ * kernel address.
+ */
 struct vpu_mem_desc {
         u32 size;
-        dma_addr_t phy_addr;
-        u32 cpu_addr;           /* cpu address to free the dma mem */
+        u32 phy_addr;
+        u32 cpu_addr;           /* handle to free or share the buffer */
         u32 virt_uaddr;         /* virtual user space address */
 };
 
+/*
+ * Buffer descriptor of the versioned (_V2) ioctls, same layout for 32 and
+ * 64-bit userspace. mmap_offset is what to pass to mmap() for the buffer;
+ * flags must be 0. A buffer from PHYMEM_ALLOC is only known by its handle
+ * to the file that allocated it, and its mmap_offset is above 4GB.
+ */
+struct vpu_mem_desc_v2 {
+        __u32 size;
+        __u32 flags;
+        __u64 handle;
+        __u64 phy_addr;
+        __u64 virt_uaddr;
+        __u64 mmap_offset;
+};
+
+struct vpu_iram_setting {
+        __u32 start;
+        __u32 end;
+};
+
+/*
+ * Argument of VPU_IOC_EXPORT_BUF: handle of a buffer of this file in,
+ * dma-buf file descriptor out. flags is 0 or O_CLOEXEC.
+ */
+struct vpu_export_buf {
+        __u64 handle;
+        __u32 flags;
+        __s32 fd;
+};
+
+/*
+ * VPU_IOC_BATCH runs up to VPU_BATCH_MAX other commands in order in one
+ * call. Each entry holds the command and the argument it would be called
+ * with: a pointer for most, the timeout itself for VPU_IOC_WAIT4INT. The
+ * driver stores each command's result (0 or -errno) and stops at the
+ * first that fails; done is the number of entries it ran, and the call
+ * returns the error of the failed entry. Batches do not nest.
+ */
+#define VPU_BATCH_MAX           64
+
+struct vpu_batch_entry {
+        __u32 cmd;
+        __s32 result;
+        __u64 arg;
+};
+
+struct vpu_batch {
+        __u64 entries;          /* user pointer to count entries */
+        __u32 count;
+        __u32 done;
+};
+
+/*
+ * Submission and completion rings, one pair per open file, set up with
+ * VPU_IOC_RING_SETUP and mapped at the mmap_offset it returns. The
+ * mapping starts with struct vpu_ring_hdr; the SQE and CQE arrays are at
+ * sq_off and cq_off.
+ *
+ * Userspace fills the SQE at sq_tail & (sq_entries - 1) and then bumps
+ * sq_tail; the driver consumes from sq_head. A job takes the device as
+ * LOCK_DEV would, writes the SQE's registers, sets BIT_BUSY_FLAG and
+ * writes run_cmd to BIT_RUN_COMMAND; the next VPU interrupt, or the
+ * watchdog, completes it with a CQE at cq_tail, which userspace reads
+ * from cq_head. While VPU_RING_NEED_WAKEUP is clear the driver looks at
+ * the ring again after each job, so new SQEs need no system call;
+ * when it is set, the new tail needs a VPU_IOC_RING_ENTER. ENTER also
+ * waits for completions, and so does poll().
+ */
+#define VPU_RING_MAX_ENTRIES    1024
+#define VPU_SQE_REGS            30
+#define VPU_RING_NEED_WAKEUP    (1 << 0)
+
+struct vpu_ring_hdr {
+        __u32 sq_head;          /* written by the driver */
+        __u32 sq_tail;          /* written by userspace */
+        __u32 cq_head;          /* written by userspace */
+        __u32 cq_tail;          /* written by the driver */
+        __u32 sq_entries;
+        __u32 cq_entries;
+        __u32 flags;            /* VPU_RING_*, written by the driver */
+        __u32 reserved;
+};
+
+struct vpu_ring_reg {
+        __u32 offset;           /* into the register window, 4-aligned */
+        __u32 value;
+};
+
+struct vpu_sqe {
+        __u64 user_data;        /* copied to the CQE */
+        __u32 run_cmd;          /* BIT_RUN_COMMAND, not 0 */
+        __u16 nr_regs;
+        __u16 flags;            /* 0 */
+        struct vpu_ring_reg regs[VPU_SQE_REGS];
+};
+
+struct vpu_cqe {
+        __u64 user_data;
+        __s32 result;           /* 0, -EIO if the watchdog reset the VPU,
+                                   -EINVAL for a malformed SQE, or
+                                   the error of a VPU_IOC_COPY */
+        __u32 int_reason;       /* BIT_INT_REASON of the interrupt */
+        __u64 duration_ns;      /* from dispatch to completion */
+};
+
+struct vpu_ring_setup {
+        __u32 sq_entries;       /* in: power of two */
+        __u32 cq_entries;       /* in: power of two, >= sq_entries */
+        __u32 sq_off;           /* out */
+        __u32 cq_off;           /* out */
+        __u64 mmap_offset;      /* out */
+        __u32 mmap_size;        /* out */
+        __u32 reserved;
+};
+
+struct vpu_ring_enter {
+        __u32 min_complete;     /* wait until this many CQEs are unread */
+        __u32 timeout_ms;       /* for that wait */
+};
+
+/*
+ * Bitstream ring of a codec instance, owned by the driver. One per open
+ * file, set up with VPU_IOC_BS_SETUP: the driver allocates it, binds it
+ * to the instance's BIT_RD_PTR/BIT_WR_PTR registers and keeps them up to
+ * date from then on. phy_addr and size go to the codec's open
+ * parameters, and compressed data goes in with write() or splice().
+ *
+ * A write stops short of queueing more than high bytes and, unless the
+ * file is O_NONBLOCK, waits for the VPU to drain the ring down to low
+ * bytes when it is that full. poll() reports POLLOUT at or below low;
+ * room in the job SQ is then reported as POLLWRBAND.
+ *
+ * With VPU_BS_ENCODE the ring takes encoder output instead, and low and
+ * high do not apply. What the encoder wrote by the end of each job is a
+ * frame, which read() or splice() hands out in order; the read pointer
+ * follows. With VPU_BS_FRAME_HEADERS every frame is preceded by a
+ * struct vpu_bs_frame, and a read returns at most one frame (the rest
+ * of a frame that did not fit comes with the next read, without a
+ * header); without it the output is one plain stream. poll() reports
+ * POLLIN with a frame to read; CQEs are then reported as POLLRDBAND.
+ */
+#define VPU_BS_ENCODE           (1 << 0)
+#define VPU_BS_FRAME_HEADERS    (1 << 1)
+#define VPU_BS_MAX_INSTANCES    4
+#define VPU_BS_MIN_SIZE         0x1000
+#define VPU_BS_MAX_SIZE         0x1000000
+
+struct vpu_bs_setup {
+        __u32 instance;         /* < VPU_BS_MAX_INSTANCES */
+        __u32 size;             /* power of two */
+        __u32 low;              /* 0 for size / 4 */
+        __u32 high;             /* 0 for size - 1, at most that */
+        __u32 flags;            /* VPU_BS_* */
+        __u32 reserved;
+        __u64 phy_addr;         /* out */
+};
+
+struct vpu_bs_frame {
+        __u32 len;              /* of the frame data that follows */
+        __u32 run_cmd;          /* BIT_RUN_COMMAND of the job */
+        __u64 timestamp_ns;     /* CLOCK_MONOTONIC, at its interrupt */
+};
+
+/*
+ * Gives displayed frame buffers of a decoder instance back to it: bit i
+ * of mask clears bit i of BIT_FRM_DIS_FLG_REG(instance). Any open file
+ * can, without LOCK_DEV. Releases pile up in the driver and are applied
+ * together before the next job starts, as the VPU never sees the
+ * register change under a running job.
+ */
+struct vpu_frame_release {
+        __u32 instance;         /* < VPU_BS_MAX_INSTANCES */
+        __u32 mask;
+};
+
+/*
+ * VPU_IOC_COPY moves height lines of width bytes between user memory and
+ * a buffer of this file, lines user_stride and buf_stride bytes apart
+ * (a plane of a frame; a linear copy is one line). It uses the DMA
+ * engine when the platform has a memcpy channel, and the CPU otherwise
+ * or for copies under the dma_copy_min module parameter. The user pages
+ * are pinned until the copy is done.
+ *
+ * Without VPU_COPY_ASYNC the call returns when the copy is done. With
+ * it, it returns once the copy is started and the copy completes with a
+ * CQE carrying user_data, on the rings of the file, which it needs; the
+ * CQE's int_reason is 0. The copy takes a CQ slot up front, and fails
+ * with EAGAIN when there is none.
+ */
+#define VPU_COPY_TO_USER        (1 << 0)        /* else to the buffer */
+#define VPU_COPY_ASYNC          (1 << 1)
+#define VPU_COPY_MAX_SIZE       0x1000000       /* user span of a copy */
+
+struct vpu_copy {
+        __u64 handle;           /* of the buffer */
+        __u64 user_addr;
+        __u64 user_data;        /* for the CQE */
+        __u32 offset;           /* into the buffer */
+        __u32 width;            /* bytes per line */
+        __u32 height;           /* lines */
+        __u32 user_stride;      /* >= width, unless height is 1 */
+        __u32 buf_stride;       /* >= width, unless height is 1 */
+        __u32 flags;            /* VPU_COPY_* */
+};
+
+/*
+ * VPU_IOC_MAP_SET lays out up to VPU_MAP_SET_MAX buffers of this file in
+ * one mapping, which a single shared mmap() at mmap_offset, of exactly
+ * mmap_size bytes, then maps: one VMA for a frame buffer set instead of
+ * one per buffer. The offset of each buffer in the mapping is written
+ * back to its entry. Where the kernel can map it with PMD entries (a
+ * transparent huge page kernel on an architecture with them), a buffer
+ * of at least that size is placed so that its PMD-aligned parts line
+ * up, and the mapping is faulted in at that size; the gaps left by the
+ * placement are not mapped. A new MAP_SET replaces the layout for the
+ * next mmap(), mappings already made keep theirs.
+ */
+#define VPU_MAP_SET_MAX         64
+
+struct vpu_map_entry {
+        __u64 handle;           /* of the buffer */
+        __u64 offset;           /* out: into the mapping */
+};
+
+struct vpu_map_set {
+        __u64 entries;          /* user pointer to count entries */
+        __u32 count;
+        __u32 reserved;
+        __u64 mmap_offset;      /* out */
+        __u64 mmap_size;        /* out */
+};
+
+/*
+ * Shared regions for processes that use the VPU together, one per codec
+ * instance and one per group, got with VPU_IOC_SHM_GET and mapped at the
+ * mmap_offset it returns. They live, like GET_SHARE_MEM memory, until
+ * the last close of the device; the first GET of a region sizes it.
+ *
+ * A region starts with struct vpu_shm_hdr, which the driver updates on
+ * every job completion: that of the instance the VPU reports at its
+ * interrupt, and that of the group of the file whose job it was (the
+ * LOCK_DEV holder, or the file of a ring job). A file joins a group by
+ * getting its region, and stays in that one. A job the watchdog fails
+ * counts in its group only, as the instance is not known then.
+ *
+ * completed is bumped, with release ordering, after the last_* fields
+ * are written, so polling it tells a job finished without a system
+ * call. The last_* fields are a seqcount: seq is odd while the driver
+ * writes them, and a reader that sees the same even seq before and
+ * after reading them has a consistent snapshot. The rest of the region
+ * from data_off on is left to userspace.
+ */
+#define VPU_SHM_GROUP           (1 << 0)
+#define VPU_SHM_MAX_GROUPS      16
+#define VPU_SHM_MAX_SIZE        0x10000
+#define VPU_SHM_MAGIC           0x4d485356      /* "VSHM" */
+
+struct vpu_shm_hdr {
+        __u32 magic;            /* VPU_SHM_MAGIC */
+        __u32 size;             /* of the region */
+        __u32 data_off;         /* of the userspace part */
+        __u32 id;               /* instance or group */
+        __u32 flags;            /* VPU_SHM_GROUP for a group */
+        __u32 reserved[3];
+        /* written by the driver */
+        __u32 completed;
+        __u32 failed;           /* of those, with a non-zero result */
+        __u32 seq;
+        __s32 last_result;      /* 0, or -EIO if the watchdog failed it */
+        __u32 last_int_reason;  /* BIT_INT_REASON of its interrupt */
+        __u32 reserved2;
+        __u64 last_done_ns;     /* CLOCK_MONOTONIC */
+};
+
+struct vpu_shm_req {
+        __u32 flags;            /* VPU_SHM_* */
+        __u32 id;               /* < VPU_BS_MAX_INSTANCES, or a group
+                                   < VPU_SHM_MAX_GROUPS */
+        __u32 size;             /* 0 for a page, at most
+                                   VPU_SHM_MAX_SIZE; out: the size */
+        __u32 reserved;
+        __u64 mmap_offset;      /* out */
+};
+
+/*
+ * One entry of the ioctl/mmap/interrupt timeline, as read from debugfs
+ * mxc_vpu/record. arg holds the vpu_mem_desc of memory ioctls (size,
+ * phy_addr, cpu_addr, virt_uaddr), the value of scalar ioctls in arg[0],
+ * pgoff and length of an mmap, or the status register of an interrupt.
+ */
+#define VPU_REC_OPEN            1
+#define VPU_REC_RELEASE         2
+#define VPU_REC_IOCTL           3       /* cmd is the ioctl command */
+#define VPU_REC_MMAP            4       /* cmd is VPU_REC_MMAP_* */
+#define VPU_REC_IRQ             5       /* cmd is 0 for BIT, 1 for JPU */
+
+#define VPU_REC_MMAP_REGS       0
+#define VPU_REC_MMAP_DMA        1
+#define VPU_REC_MMAP_VSHARE     2
+#define VPU_REC_MMAP_RING       3
+#define VPU_REC_MMAP_SET        4
+#define VPU_REC_MMAP_SHM        5
+
+struct vpu_rec {
+        u64 ts_ns;              /* monotonic clock at entry */
+        u32 dur_ns;             /* time spent in the driver */
+        u32 client;             /* identifies the open file */
+        u32 type;
+        u32 cmd;
+        s32 ret;
+        u32 arg[4];
+        u32 reserved;
+};
+
 #define VPU_IOC_MAGIC  'V'
 
 #define VPU_IOC_PHYMEM_ALLOC    _IO(VPU_IOC_MAGIC, 0)
@@ -60,6 +382,42 @@ struct vpu_mem_desc {
 #define VPU_IOC_PHYMEM_CHECK    _IO(VPU_IOC_MAGIC, 15)
 #define VPU_IOC_LOCK_DEV        _IO(VPU_IOC_MAGIC, 16)
 
+/*
+ * Versioned ABI: the original commands with their argument size encoded,
+ * numbered 32 + the original number. VPU_IOC_VERSION returns
+ * VPU_ABI_VERSION; a driver without it fails the call with ENOTTY.
+ * Version 3 adds per-file handles and VPU_IOC_EXPORT_BUF, version 4
+ * VPU_IOC_BATCH, version 5 the job rings, version 6 the bitstream ring,
+ * version 7 encoder output through read(), version 8
+ * VPU_IOC_RELEASE_FRAMES, version 9 VPU_IOC_COPY, version 10
+ * VPU_IOC_MAP_SET, version 11 VPU_IOC_SHM_GET.
+ */
+#define VPU_ABI_VERSION         11
+
+#define VPU_IOC_PHYMEM_ALLOC_V2 _IOWR(VPU_IOC_MAGIC, 32, struct vpu_mem_desc_v2)
+#define VPU_IOC_PHYMEM_FREE_V2  _IOW(VPU_IOC_MAGIC, 33, struct vpu_mem_desc_v2)
+#define VPU_IOC_WAIT4INT_V2     _IOW(VPU_IOC_MAGIC, 34, __u32)
+#define VPU_IOC_IRAM_SETTING_V2 _IOR(VPU_IOC_MAGIC, 38, struct vpu_iram_setting)
+#define VPU_IOC_CLKGATE_SETTING_V2 _IOW(VPU_IOC_MAGIC, 39, __u32)
+#define VPU_IOC_GET_WORK_ADDR_V2 _IOWR(VPU_IOC_MAGIC, 40, struct vpu_mem_desc_v2)
+#define VPU_IOC_REQ_VSHARE_MEM_V2 _IOWR(VPU_IOC_MAGIC, 41, struct vpu_mem_desc_v2)
+#define VPU_IOC_SYS_SW_RESET_V2 _IO(VPU_IOC_MAGIC, 43)
+#define VPU_IOC_GET_SHARE_MEM_V2 _IOWR(VPU_IOC_MAGIC, 44, struct vpu_mem_desc_v2)
+#define VPU_IOC_QUERY_BITWORK_MEM_V2 _IOR(VPU_IOC_MAGIC, 45, struct vpu_mem_desc_v2)
+#define VPU_IOC_SET_BITWORK_MEM_V2 _IOW(VPU_IOC_MAGIC, 46, struct vpu_mem_desc_v2)
+#define VPU_IOC_PHYMEM_CHECK_V2 _IOWR(VPU_IOC_MAGIC, 47, struct vpu_mem_desc_v2)
+#define VPU_IOC_LOCK_DEV_V2     _IOW(VPU_IOC_MAGIC, 48, __u32)
+#define VPU_IOC_VERSION         _IOR(VPU_IOC_MAGIC, 64, __u32)
+#define VPU_IOC_EXPORT_BUF      _IOWR(VPU_IOC_MAGIC, 65, struct vpu_export_buf)
+#define VPU_IOC_BATCH           _IOWR(VPU_IOC_MAGIC, 66, struct vpu_batch)
+#define VPU_IOC_RING_SETUP      _IOWR(VPU_IOC_MAGIC, 67, struct vpu_ring_setup)
+#define VPU_IOC_RING_ENTER      _IOW(VPU_IOC_MAGIC, 68, struct vpu_ring_enter)
+#define VPU_IOC_BS_SETUP        _IOWR(VPU_IOC_MAGIC, 69, struct vpu_bs_setup)
+#define VPU_IOC_RELEASE_FRAMES  _IOW(VPU_IOC_MAGIC, 70, struct vpu_frame_release)
+#define VPU_IOC_COPY            _IOW(VPU_IOC_MAGIC, 71, struct vpu_copy)
+#define VPU_IOC_MAP_SET         _IOWR(VPU_IOC_MAGIC, 72, struct vpu_map_set)
+#define VPU_IOC_SHM_GET         _IOWR(VPU_IOC_MAGIC, 73, struct vpu_shm_req)
+
 #define BIT_CODE_RUN                    0x000
 #define BIT_CODE_DOWN                   0x004
 #define BIT_INT_CLEAR                   0x00C
@@ -95,6 +453,7 @@ struct vpu_mem_desc {
 
 #define BIT_BUSY_FLAG                   0x160
 #define BIT_RUN_COMMAND                 0x164
+#define BIT_RUN_INDEX                   0x168
 #define BIT_INT_ENABLE                  0x170
 
 #define BITVAL_PIC_RUN                  8
@@ -114,5 +473,4 @@ void vl2cc_flush(void);
 void vl2cc_disable(void);
 void vl2cc_cleanup(void);
 
-
 #endif
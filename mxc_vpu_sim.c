@@ -0,0 +1,371 @@
+/*
+ * Copyright 2006-2013 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/*!
+ * @file mxc_vpu_sim.c
+ *
+ * @brief Software model of the VPU, so that the mxc_vpu driver can be
+ * exercised and benchmarked on machines without an i.MX VPU.
+ *
+ * The model registers an "mxc_vpu" platform device with a register window
+ * in ordinary memory, two software interrupts, a settable "vpu_clk" and
+ * reset/power gating hooks standing in for SRC and GPC. An hrtimer scans
+ * the register window and plays the BIT and JPU engines:
+ *
+ * - BIT_BUSY_FLAG set starts a job. After job_latency_us (plus up to
+ *   jitter_us) the busy flag drops and, if a BIT_RUN_COMMAND was issued,
+ *   BIT_INT_REASON is loaded with int_reason and the IPI interrupt fires.
+ *   A job without a command is a firmware boot: it only sets BIT_CUR_PC.
+ * - Writing MJPEG_PIC_START_REG starts a JPEG job, which completes with
+ *   jpu_status in MJPEG_PIC_STATUS_REG and the JPU interrupt.
+ * - Every hang_every-th BIT job never completes, to exercise the watchdog.
+ * - The 0x10F0/0x10F4 bus idle handshake is acknowledged right away.
+ *
+ * @ingroup VPU
+ */
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/hrtimer.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/io.h>
+#include <linux/gfp.h>
+#include <linux/clk.h>
+#include <linux/clk-provider.h>
+#include <linux/clkdev.h>
+#include <linux/dma-mapping.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/sizes.h>
+#include "mxc_vpu.h"
+
+#define SIM_REGS_SIZE			SZ_16K
+#define MJPEG_PIC_START_REG		0x3000
+#define SIM_BUS_IDLE_REQ		0x10F0
+#define SIM_BUS_IDLE_ACK		0x10F4
+#define SIM_BOOT_PC			0x100
+
+static unsigned int poll_us = 20;
+module_param(poll_us, uint, 0644);
+MODULE_PARM_DESC(poll_us, "Register window scan period");
+
+static unsigned int job_latency_us = 2000;
+module_param(job_latency_us, uint, 0644);
+MODULE_PARM_DESC(job_latency_us, "Time a BIT or JPU job takes");
+
+static unsigned int jitter_us;
+module_param(jitter_us, uint, 0644);
+MODULE_PARM_DESC(jitter_us, "Random extra job time, up to this much");
+
+static unsigned int int_reason = 0x8;
+module_param(int_reason, uint, 0644);
+MODULE_PARM_DESC(int_reason, "BIT_INT_REASON bits raised when a job is done");
+
+static unsigned int jpu_status = 0x1;
+module_param(jpu_status, uint, 0644);
+MODULE_PARM_DESC(jpu_status, "MJPEG_PIC_STATUS_REG value when a job is done");
+
+static unsigned int hang_every;
+module_param(hang_every, uint, 0644);
+MODULE_PARM_DESC(hang_every, "Hang every Nth BIT job, 0 never");
+
+struct vpu_sim {
+	void *regs;
+	spinlock_t lock;
+	struct hrtimer timer;
+	bool powered;
+	bool bit_running;
+	bool bit_hung;
+	bool jpu_running;
+	ktime_t bit_done;
+	ktime_t jpu_done;
+	unsigned long jobs;
+	int irq_base;
+	unsigned long rate;
+	struct clk_hw clk_hw;
+	struct clk *clk;
+	struct clk_lookup *clk_lookup;
+	struct platform_device *pdev;
+};
+
+static struct vpu_sim sim;
+
+static inline u32 sim_rd(u32 off)
+{
+	return readl_relaxed((void __iomem *)sim.regs + off);
+}
+
+static inline void sim_wr(u32 val, u32 off)
+{
+	writel_relaxed(val, (void __iomem *)sim.regs + off);
+}
+
+static unsigned int sim_latency_us(void)
+{
+	if (!jitter_us)
+		return job_latency_us;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+	return job_latency_us + get_random_u32() % jitter_us;
+#else
+	return job_latency_us + prandom_u32() % jitter_us;
+#endif
+}
+
+static enum hrtimer_restart vpu_sim_poll(struct hrtimer *t)
+{
+	ktime_t now = ktime_get();
+	bool raise_bit = false, raise_jpu = false;
+	u32 cmd;
+
+	spin_lock(&sim.lock);
+	if (!sim.powered)
+		goto out;
+
+	if (sim_rd(SIM_BUS_IDLE_REQ) == 0x11)
+		sim_wr(0x77, SIM_BUS_IDLE_ACK);
+
+	if (sim_rd(BIT_INT_CLEAR)) {
+		sim_wr(0, BIT_INT_CLEAR);
+		sim_wr(0, BIT_INT_STATUS);
+		sim_wr(0, BIT_INT_REASON);
+	}
+
+	if (!sim.bit_running && sim_rd(BIT_BUSY_FLAG)) {
+		sim.bit_running = true;
+		sim.bit_hung = hang_every && !(++sim.jobs % hang_every);
+		sim.bit_done = ktime_add_us(now, sim_latency_us());
+	} else if (sim.bit_running && !sim.bit_hung &&
+		   ktime_compare(now, sim.bit_done) >= 0) {
+		sim.bit_running = false;
+		cmd = sim_rd(BIT_RUN_COMMAND);
+		if (cmd) {
+			sim_wr(0, BIT_RUN_COMMAND);
+			sim_wr(int_reason, BIT_INT_REASON);
+			sim_wr(1, BIT_INT_STATUS);
+			raise_bit = true;
+		} else {
+			sim_wr(SIM_BOOT_PC, BIT_CUR_PC);
+		}
+		sim_wr(0, BIT_BUSY_FLAG);
+	}
+
+	if (!sim.jpu_running && sim_rd(MJPEG_PIC_START_REG)) {
+		sim_wr(0, MJPEG_PIC_START_REG);
+		sim.jpu_running = true;
+		sim.jpu_done = ktime_add_us(now, sim_latency_us());
+	} else if (sim.jpu_running && ktime_compare(now, sim.jpu_done) >= 0) {
+		sim.jpu_running = false;
+		sim_wr(jpu_status, MJPEG_PIC_STATUS_REG);
+		raise_jpu = true;
+	}
+out:
+	spin_unlock(&sim.lock);
+
+	if (raise_bit)
+		generic_handle_irq(sim.irq_base);
+	if (raise_jpu)
+		generic_handle_irq(sim.irq_base + 1);
+
+	hrtimer_forward_now(t, ns_to_ktime((u64)poll_us * NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+}
+
+/* Register state is lost on reset and power down */
+static void vpu_sim_clear(void)
+{
+	memset(sim.regs, 0, SIM_REGS_SIZE);
+	sim.bit_running = false;
+	sim.bit_hung = false;
+	sim.jpu_running = false;
+}
+
+/* Stands in for the SRC VPU reset */
+static void vpu_sim_reset(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim.lock, flags);
+	vpu_sim_clear();
+	spin_unlock_irqrestore(&sim.lock, flags);
+}
+
+/* Stands in for GPC power gating, gate != 0 powers the block off */
+static void vpu_sim_pg(int gate)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sim.lock, flags);
+	if (gate)
+		vpu_sim_clear();
+	sim.powered = !gate;
+	spin_unlock_irqrestore(&sim.lock, flags);
+}
+
+static unsigned long vpu_sim_clk_recalc_rate(struct clk_hw *hw,
+					     unsigned long parent_rate)
+{
+	return sim.rate;
+}
+
+/* Same choice of rates as the MX6 vpu_axi clock */
+static long vpu_sim_clk_round_rate(struct clk_hw *hw, unsigned long rate,
+				   unsigned long *parent_rate)
+{
+	return rate > 264000000 ? 352000000 : 264000000;
+}
+
+static int vpu_sim_clk_set_rate(struct clk_hw *hw, unsigned long rate,
+				unsigned long parent_rate)
+{
+	sim.rate = rate;
+	return 0;
+}
+
+static const struct clk_ops vpu_sim_clk_ops = {
+	.recalc_rate = vpu_sim_clk_recalc_rate,
+	.round_rate = vpu_sim_clk_round_rate,
+	.set_rate = vpu_sim_clk_set_rate,
+};
+
+static int vpu_sim_clk_init(void)
+{
+	struct clk_init_data init = {
+		.name = "vpu_sim_clk",
+		.ops = &vpu_sim_clk_ops,
+	};
+
+	sim.rate = 264000000;
+	sim.clk_hw.init = &init;
+	sim.clk = clk_register(NULL, &sim.clk_hw);
+	if (IS_ERR(sim.clk))
+		return PTR_ERR(sim.clk);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+	sim.clk_lookup = clkdev_create(sim.clk, "vpu_clk", "mxc_vpu");
+#else
+	sim.clk_lookup = clkdev_alloc(sim.clk, "vpu_clk", "mxc_vpu");
+	if (sim.clk_lookup)
+		clkdev_add(sim.clk_lookup);
+#endif
+	if (!sim.clk_lookup) {
+		clk_unregister(sim.clk);
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void vpu_sim_clk_exit(void)
+{
+	clkdev_drop(sim.clk_lookup);
+	clk_unregister(sim.clk);
+}
+
+static int __init vpu_sim_init(void)
+{
+	struct mxc_vpu_platform_data pdata = {
+		.reset = vpu_sim_reset,
+		.pg = vpu_sim_pg,
+		.owner = THIS_MODULE,
+	};
+	struct platform_device_info info = {
+		.name = "mxc_vpu",
+		.id = PLATFORM_DEVID_NONE,
+		.data = &pdata,
+		.size_data = sizeof(pdata),
+		.dma_mask = DMA_BIT_MASK(32),
+	};
+	struct resource res[3];
+	int i, err;
+
+	spin_lock_init(&sim.lock);
+
+	/* below 4G, the driver keeps the register base in a u32 */
+	sim.regs = alloc_pages_exact(SIM_REGS_SIZE,
+				     GFP_KERNEL | GFP_DMA32 | __GFP_ZERO);
+	if (!sim.regs)
+		return -ENOMEM;
+	pdata.regs = (void __iomem *)sim.regs;
+
+	sim.irq_base = irq_alloc_descs(-1, 1, 2, numa_node_id());
+	if (sim.irq_base < 0) {
+		err = sim.irq_base;
+		goto err_regs;
+	}
+	for (i = 0; i < 2; i++) {
+		irq_set_chip_and_handler(sim.irq_base + i, &dummy_irq_chip,
+					 handle_simple_irq);
+		irq_clear_status_flags(sim.irq_base + i, IRQ_NOREQUEST);
+	}
+
+	err = vpu_sim_clk_init();
+	if (err)
+		goto err_irq;
+
+	memset(res, 0, sizeof(res));
+	res[0].name = "vpu_regs";
+	res[0].start = virt_to_phys(sim.regs);
+	res[0].end = res[0].start + SIM_REGS_SIZE - 1;
+	res[0].flags = IORESOURCE_MEM;
+	res[1].name = "vpu_ipi_irq";
+	res[1].start = res[1].end = sim.irq_base;
+	res[1].flags = IORESOURCE_IRQ;
+	res[2].name = "vpu_jpu_irq";
+	res[2].start = res[2].end = sim.irq_base + 1;
+	res[2].flags = IORESOURCE_IRQ;
+	info.res = res;
+	info.num_res = ARRAY_SIZE(res);
+
+	hrtimer_init(&sim.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sim.timer.function = vpu_sim_poll;
+	hrtimer_start(&sim.timer, ns_to_ktime((u64)poll_us * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+
+	sim.pdev = platform_device_register_full(&info);
+	if (IS_ERR(sim.pdev)) {
+		err = PTR_ERR(sim.pdev);
+		goto err_timer;
+	}
+
+	printk(KERN_INFO "VPU simulator: regs@0x%llx irq %d/%d\n",
+	       (unsigned long long)res[0].start, sim.irq_base,
+	       sim.irq_base + 1);
+	return 0;
+
+err_timer:
+	hrtimer_cancel(&sim.timer);
+	vpu_sim_clk_exit();
+err_irq:
+	irq_free_descs(sim.irq_base, 2);
+err_regs:
+	free_pages_exact(sim.regs, SIM_REGS_SIZE);
+	return err;
+}
+
+static void __exit vpu_sim_exit(void)
+{
+	platform_device_unregister(sim.pdev);
+	hrtimer_cancel(&sim.timer);
+	vpu_sim_clk_exit();
+	irq_free_descs(sim.irq_base, 2);
+	free_pages_exact(sim.regs, SIM_REGS_SIZE);
+}
+
+MODULE_AUTHOR("Freescale Semiconductor, Inc.");
+MODULE_DESCRIPTION("Simulated VPU for Freescale i.MX/MXC VPU driver testing");
+MODULE_LICENSE("GPL");
+
+module_init(vpu_sim_init);
+module_exit(vpu_sim_exit);
@@ -0,0 +1,623 @@
+/*
+ * Copyright 2006-2013 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/*!
+ * @file mxc_vpu_test.c
+ *
+ * @brief KUnit tests of the mxc_vpu driver, built into it with
+ * CONFIG_MXC_VPU_KUNIT_TEST: #included at the end of mxc_vpu.c, so they
+ * call its static functions.
+ *
+ * - mxc_vpu_buf: buffer handles of a session, the allocation list and
+ *   the references that keep a freed buffer's memory.
+ * - mxc_vpu_iram: the IRAM pool, skipped on machines without one.
+ * - mxc_vpu_wait: the WAIT4INT handshake of vpu_data.work, irq_status
+ *   and vpu_queue, with the watchdog's completions.
+ *
+ * Tests that touch device state hold vpu_data.lock the way open does,
+ * and are skipped while the device is open. Those that need memory or
+ * the workqueue of a probed device are skipped without one.
+ *
+ * @ingroup VPU
+ */
+
+#include <kunit/test.h>
+
+#define VPU_TEST_WORKERS	4
+
+/* the device to ourselves: no file can open it, so none has a buffer */
+static bool vpu_test_lock(void)
+{
+	vpu_lock(VPU_LS_OPEN);
+	if (!open_count)
+		return true;
+	vpu_unlock();
+	return false;
+}
+
+struct vpu_test_worker {
+	struct work_struct work;
+	struct vpu_session *s;
+	int iters;
+	int errors;
+	unsigned long *pages;
+};
+
+/* runs fn on VPU_TEST_WORKERS unbound workers, returns their errors */
+static int vpu_test_run(struct kunit *test, work_func_t fn,
+			struct vpu_session *s, int iters,
+			unsigned long *pages)
+{
+	struct vpu_test_worker *w;
+	int i, errors = 0;
+
+	w = kunit_kcalloc(test, VPU_TEST_WORKERS, sizeof(*w), GFP_KERNEL);
+	if (!w)
+		return -ENOMEM;
+	for (i = 0; i < VPU_TEST_WORKERS; i++) {
+		INIT_WORK(&w[i].work, fn);
+		w[i].s = s;
+		w[i].iters = iters;
+		w[i].pages = pages;
+		queue_work(system_unbound_wq, &w[i].work);
+	}
+	for (i = 0; i < VPU_TEST_WORKERS; i++) {
+		flush_work(&w[i].work);
+		errors += w[i].errors;
+	}
+	return errors;
+}
+
+/* a record without memory, as far as the list and handles go */
+static struct memalloc_record *vpu_test_rec(void)
+{
+	struct memalloc_record *rec;
+
+	rec = kzalloc(sizeof(*rec), GFP_KERNEL);
+	if (!rec)
+		return NULL;
+	kref_init(&rec->ref);
+	INIT_LIST_HEAD(&rec->list);
+	return rec;
+}
+
+static int vpu_test_session_init(struct kunit *test)
+{
+	test->priv = vpu_session_alloc();
+	return test->priv ? 0 : -ENOMEM;
+}
+
+static void vpu_test_session_exit(struct kunit *test)
+{
+	if (test->priv)
+		vpu_session_free(test->priv);
+}
+
+static void vpu_test_buf_handle(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	struct memalloc_record *rec;
+	u32 handle;
+
+	rec = vpu_test_rec();
+	KUNIT_ASSERT_NOT_NULL(test, rec);
+	KUNIT_ASSERT_EQ(test, vpu_session_add(s, rec), 0);
+	handle = rec->mem.handle;
+	KUNIT_EXPECT_NE(test, handle, 0U);
+	KUNIT_EXPECT_LT(test, handle, VPU_SHARED_HANDLE);
+
+	KUNIT_EXPECT_PTR_EQ(test, vpu_session_get(s, handle), rec);
+	KUNIT_EXPECT_EQ(test, kref_read(&rec->ref), 2U);
+	vpu_buf_put(rec);
+	KUNIT_EXPECT_NULL(test, vpu_session_get(s, 0));
+	KUNIT_EXPECT_NULL(test, vpu_session_get(s, handle + 1));
+	KUNIT_EXPECT_NULL(test, vpu_session_get(s, VPU_SHARED_HANDLE));
+
+	KUNIT_EXPECT_PTR_EQ(test, vpu_session_remove(s, handle), rec);
+	KUNIT_EXPECT_NULL(test, vpu_session_get(s, handle));
+	KUNIT_EXPECT_NULL(test, vpu_session_remove(s, handle));
+	KUNIT_EXPECT_EQ(test, kref_read(&rec->ref), 1U);
+	vpu_buf_put(rec);
+}
+
+static void vpu_test_buf_other_session(struct kunit *test)
+{
+	struct vpu_session *s = test->priv, *other;
+	struct memalloc_record *rec;
+	u32 handle;
+
+	other = vpu_session_alloc();
+	KUNIT_ASSERT_NOT_NULL(test, other);
+	rec = vpu_test_rec();
+	if (!rec || vpu_session_add(s, rec)) {
+		kfree(rec);
+		vpu_session_free(other);
+		KUNIT_FAIL(test, "cannot add a buffer");
+		return;
+	}
+	handle = rec->mem.handle;
+
+	/* handles are per file */
+	KUNIT_EXPECT_NULL(test, vpu_session_get(other, handle));
+	KUNIT_EXPECT_NULL(test, vpu_session_remove(other, handle));
+	KUNIT_EXPECT_EQ(test, vpu_buf_free(other, handle), -EINVAL);
+	KUNIT_EXPECT_PTR_EQ(test, vpu_session_remove(s, handle), rec);
+	vpu_buf_put(rec);
+	vpu_session_free(other);
+}
+
+/* what release does with the buffers of a file */
+static void vpu_test_buf_release(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	struct memalloc_record *rec[3];
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(rec); i++) {
+		rec[i] = vpu_test_rec();
+		KUNIT_ASSERT_NOT_NULL(test, rec[i]);
+		KUNIT_ASSERT_EQ(test, vpu_session_add(s, rec[i]), 0);
+	}
+	if (!vpu_test_lock()) {
+		for (i = 0; i < ARRAY_SIZE(rec); i++)
+			vpu_buf_put(vpu_session_remove(s, rec[i]->mem.handle));
+		kunit_skip(test, "device is open");
+	}
+	/* the last one is still mapped */
+	kref_get(&rec[2]->ref);
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_ALLOC);
+	for (i = 0; i < ARRAY_SIZE(rec); i++)
+		list_add(&rec[i]->list, &head);
+	vpu_mutex_unlock(&vpu_buf_lock);
+
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_PUT_BUFS);
+	idr_for_each(&s->bufs, vpu_session_put_buf, NULL);
+	vpu_mutex_unlock(&vpu_buf_lock);
+	vpu_unlock();
+
+	KUNIT_EXPECT_TRUE(test, list_empty(&rec[2]->list));
+	KUNIT_EXPECT_EQ(test, kref_read(&rec[2]->ref), 1U);
+	vpu_buf_put(rec[2]);
+}
+
+static void vpu_test_buf_alloc(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	struct memalloc_record *rec;
+	u32 size = 3 * PAGE_SIZE + 1;
+	u32 handle;
+
+	if (!vpu_dma_dev())
+		kunit_skip(test, "no device");
+
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	rec = vpu_buf_alloc(s, size);
+	if (IS_ERR(rec)) {
+		vpu_unlock();
+		KUNIT_FAIL(test, "allocation failed (%ld)", PTR_ERR(rec));
+		return;
+	}
+	handle = rec->mem.handle;
+	KUNIT_EXPECT_NOT_NULL(test, rec->mem.cpu_addr);
+	KUNIT_EXPECT_TRUE(test, PAGE_ALIGNED(rec->mem.phy_addr));
+	KUNIT_EXPECT_FALSE(test, list_empty(&rec->list));
+	memset(rec->mem.cpu_addr, 0x5a, size);
+
+	/* a mapping keeps the memory of a freed buffer */
+	KUNIT_EXPECT_PTR_EQ(test, vpu_session_get(s, handle), rec);
+	KUNIT_EXPECT_EQ(test, vpu_buf_free(s, handle), 0);
+	KUNIT_EXPECT_EQ(test, vpu_buf_free(s, handle), -EINVAL);
+	KUNIT_EXPECT_TRUE(test, list_empty(&rec->list));
+	KUNIT_EXPECT_EQ(test, kref_read(&rec->ref), 1U);
+	KUNIT_EXPECT_EQ(test, ((u8 *)rec->mem.cpu_addr)[size - 1], 0x5a);
+	vpu_buf_put(rec);
+	vpu_unlock();
+}
+
+static void vpu_test_handle_fn(struct work_struct *work)
+{
+	struct vpu_test_worker *w =
+		container_of(work, struct vpu_test_worker, work);
+	struct memalloc_record *rec;
+	u32 handle;
+	int i;
+
+	for (i = 0; i < w->iters; i++) {
+		rec = vpu_test_rec();
+		if (!rec || vpu_session_add(w->s, rec)) {
+			kfree(rec);
+			w->errors++;
+			continue;
+		}
+		handle = rec->mem.handle;
+		if (vpu_session_get(w->s, handle) != rec)
+			w->errors++;
+		else
+			vpu_buf_put(rec);
+		if (vpu_session_remove(w->s, handle) != rec)
+			w->errors++;
+		vpu_buf_put(rec);
+		cond_resched();
+	}
+}
+
+static void vpu_test_buf_handle_concurrent(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+
+	KUNIT_EXPECT_EQ(test, vpu_test_run(test, vpu_test_handle_fn, s,
+					   10000, NULL), 0);
+	KUNIT_EXPECT_TRUE(test, idr_is_empty(&s->bufs));
+}
+
+static void vpu_test_alloc_fn(struct work_struct *work)
+{
+	struct vpu_test_worker *w =
+		container_of(work, struct vpu_test_worker, work);
+	struct memalloc_record *rec;
+	u32 handle;
+	int i;
+
+	for (i = 0; i < w->iters; i++) {
+		rec = vpu_buf_alloc(w->s, (i % 4 + 1) * PAGE_SIZE);
+		if (IS_ERR(rec)) {
+			w->errors++;
+			continue;
+		}
+		handle = rec->mem.handle;
+		if (vpu_session_get(w->s, handle) != rec) {
+			w->errors++;
+		} else {
+			/* freed while mapped */
+			if (vpu_buf_free(w->s, handle))
+				w->errors++;
+			vpu_buf_put(rec);
+		}
+		if (vpu_buf_free(w->s, handle) != -EINVAL)
+			w->errors++;
+		cond_resched();
+	}
+}
+
+static int vpu_test_head_len(void)
+{
+	struct memalloc_record *rec;
+	int n = 0;
+
+	vpu_mutex_lock(&vpu_buf_lock, VPU_LS_ALLOC);
+	list_for_each_entry(rec, &head, list)
+		n++;
+	vpu_mutex_unlock(&vpu_buf_lock);
+	return n;
+}
+
+static void vpu_test_buf_alloc_concurrent(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	int n;
+
+	if (!vpu_dma_dev())
+		kunit_skip(test, "no device");
+
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	n = vpu_test_head_len();
+	KUNIT_EXPECT_EQ(test, vpu_test_run(test, vpu_test_alloc_fn, s,
+					   500, NULL), 0);
+	KUNIT_EXPECT_EQ(test, vpu_test_head_len(), n);
+	KUNIT_EXPECT_TRUE(test, idr_is_empty(&s->bufs));
+	vpu_unlock();
+}
+
+static struct kunit_case vpu_test_buf_cases[] = {
+	KUNIT_CASE(vpu_test_buf_handle),
+	KUNIT_CASE(vpu_test_buf_other_session),
+	KUNIT_CASE(vpu_test_buf_release),
+	KUNIT_CASE(vpu_test_buf_alloc),
+	KUNIT_CASE(vpu_test_buf_handle_concurrent),
+	KUNIT_CASE(vpu_test_buf_alloc_concurrent),
+	{}
+};
+
+static struct kunit_suite vpu_test_buf_suite = {
+	.name = "mxc_vpu_buf",
+	.init = vpu_test_session_init,
+	.exit = vpu_test_session_exit,
+	.test_cases = vpu_test_buf_cases,
+};
+
+/* more than the pages of any i.MX IRAM */
+#define VPU_TEST_IRAM_PAGES	1024
+
+static int vpu_test_iram_init(struct kunit *test)
+{
+	unsigned long addr;
+
+	if (!iram_alloc(PAGE_SIZE, &addr))
+		kunit_skip(test, "no IRAM pool");
+	iram_free(addr, PAGE_SIZE);
+	return 0;
+}
+
+static void vpu_test_iram_alloc(struct kunit *test)
+{
+	unsigned long a, b, c;
+
+	KUNIT_ASSERT_NOT_NULL(test, iram_alloc(1, &a));
+	if (!iram_alloc(1, &b)) {
+		iram_free(a, 1);
+		KUNIT_FAIL(test, "second allocation failed");
+		return;
+	}
+	/* a page is the smallest piece of the pool */
+	KUNIT_EXPECT_GE(test, a > b ? a - b : b - a, PAGE_SIZE);
+
+	/* first fit: the page just freed comes back */
+	iram_free(a, 1);
+	KUNIT_EXPECT_NOT_NULL(test, iram_alloc(PAGE_SIZE, &c));
+	KUNIT_EXPECT_EQ(test, c, a);
+	iram_free(c, PAGE_SIZE);
+	iram_free(b, 1);
+}
+
+static void vpu_test_iram_exhaust(struct kunit *test)
+{
+	unsigned long *addr, last;
+	int i, n = 0;
+
+	addr = kunit_kcalloc(test, VPU_TEST_IRAM_PAGES, sizeof(*addr),
+			     GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, addr);
+
+	while (n < VPU_TEST_IRAM_PAGES && iram_alloc(PAGE_SIZE, &addr[n]))
+		n++;
+	KUNIT_EXPECT_GT(test, n, 0);
+	KUNIT_EXPECT_LT(test, n, VPU_TEST_IRAM_PAGES);
+	KUNIT_EXPECT_NULL(test, iram_alloc(PAGE_SIZE, &last));
+
+	if (n) {
+		iram_free(addr[n / 2], PAGE_SIZE);
+		KUNIT_EXPECT_NOT_NULL(test, iram_alloc(PAGE_SIZE, &last));
+		KUNIT_EXPECT_EQ(test, last, addr[n / 2]);
+	}
+	for (i = 0; i < n; i++)
+		iram_free(addr[i], PAGE_SIZE);
+}
+
+/* no page is handed to two workers at once */
+static void vpu_test_iram_fn(struct work_struct *work)
+{
+	struct vpu_test_worker *w =
+		container_of(work, struct vpu_test_worker, work);
+	unsigned long addr, page;
+	u32 size;
+	int i, k;
+
+	for (i = 0; i < w->iters; i++) {
+		size = (i % 2 + 1) * PAGE_SIZE;
+		if (!iram_alloc(size, &addr))
+			continue;
+		for (k = 0; k < size / PAGE_SIZE; k++) {
+			page = ((addr >> PAGE_SHIFT) + k) % VPU_TEST_IRAM_PAGES;
+			if (test_and_set_bit(page, w->pages))
+				w->errors++;
+		}
+		for (k = 0; k < size / PAGE_SIZE; k++) {
+			page = ((addr >> PAGE_SHIFT) + k) % VPU_TEST_IRAM_PAGES;
+			clear_bit(page, w->pages);
+		}
+		iram_free(addr, size);
+		cond_resched();
+	}
+}
+
+static void vpu_test_iram_concurrent(struct kunit *test)
+{
+	unsigned long *pages;
+
+	pages = kunit_kzalloc(test, BITS_TO_LONGS(VPU_TEST_IRAM_PAGES) *
+			      sizeof(long), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, pages);
+	KUNIT_EXPECT_EQ(test, vpu_test_run(test, vpu_test_iram_fn, NULL,
+					   10000, pages), 0);
+}
+
+static struct kunit_case vpu_test_iram_cases[] = {
+	KUNIT_CASE(vpu_test_iram_alloc),
+	KUNIT_CASE(vpu_test_iram_exhaust),
+	KUNIT_CASE(vpu_test_iram_concurrent),
+	{}
+};
+
+static struct kunit_suite vpu_test_iram_suite = {
+	.name = "mxc_vpu_iram",
+	.init = vpu_test_iram_init,
+	.test_cases = vpu_test_iram_cases,
+};
+
+static int vpu_test_wait_init(struct kunit *test)
+{
+	/* vpu_data.workqueue comes with the device */
+	if (!vpu_pdev)
+		kunit_skip(test, "no device");
+	return vpu_test_session_init(test);
+}
+
+/* the interrupt handler's part: queue the worker */
+static void vpu_test_irq(void)
+{
+	queue_work(vpu_data.workqueue, &vpu_data.work);
+}
+
+static void vpu_test_irq_fn(struct work_struct *work)
+{
+	vpu_test_irq();
+}
+
+static void vpu_test_wait_signalled(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	irq_status = 0;
+	vpu_test_irq();
+	flush_work(&vpu_data.work);
+	KUNIT_EXPECT_EQ(test, irq_status, 1);
+	KUNIT_EXPECT_EQ(test, vpu_wait4int(s, 1000), 0);
+	KUNIT_EXPECT_EQ(test, irq_status, 0);
+	vpu_unlock();
+}
+
+static void vpu_test_wait_timeout(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	irq_status = 0;
+	KUNIT_EXPECT_EQ(test, vpu_wait4int(s, 10), -ETIME);
+	vpu_unlock();
+}
+
+static void vpu_test_wait_woken(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	struct delayed_work irq;
+
+	INIT_DELAYED_WORK_ONSTACK(&irq, vpu_test_irq_fn);
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	irq_status = 0;
+	schedule_delayed_work(&irq, msecs_to_jiffies(20));
+	KUNIT_EXPECT_EQ(test, vpu_wait4int(s, 1000), 0);
+	KUNIT_EXPECT_EQ(test, irq_status, 0);
+	flush_delayed_work(&irq);
+	flush_work(&vpu_data.work);
+	irq_status = 0;
+	vpu_unlock();
+	destroy_delayed_work_on_stack(&irq);
+}
+
+/* a LOCK_DEV holder's jobs, ended by the watchdog */
+static void vpu_test_wait_watchdog(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	u32 job, next;
+
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	irq_status = 0;
+	KUNIT_EXPECT_EQ(test, vpu_hw_acquire(s), 0);
+	if (!vpu_hw_owned(s)) {
+		vpu_unlock();
+		return;
+	}
+
+	/* done, but its interrupt got lost */
+	job = vpu_wdt_arm();
+	vpu_wdt_complete_job(job, false);
+	KUNIT_EXPECT_EQ(test, vpu_wait4int(s, 1000), 0);
+
+	/* the next one hung and was reset */
+	spin_lock(&vpu_hw_lock);
+	next = vpu_wdt_job;
+	spin_unlock(&vpu_hw_lock);
+	KUNIT_EXPECT_NE(test, next, job);
+	job = next;
+	vpu_wdt_complete_job(job, true);
+	KUNIT_EXPECT_EQ(test, vpu_wait4int(s, 1000), -EIO);
+	KUNIT_EXPECT_FALSE(test, s->job_failed);
+
+	/* a job is completed once */
+	vpu_wdt_complete_job(job, true);
+	KUNIT_EXPECT_EQ(test, vpu_wait4int(s, 10), -ETIME);
+	KUNIT_EXPECT_FALSE(test, s->job_failed);
+
+	vpu_hw_release();
+	vpu_unlock();
+	/* it finds no job if it ran meanwhile */
+	cancel_delayed_work_sync(&vpu_wdt_work);
+}
+
+struct vpu_test_pinger {
+	struct work_struct work;
+	struct completion ack;
+	int rounds;
+	int missed;
+};
+
+static void vpu_test_ping_fn(struct work_struct *work)
+{
+	struct vpu_test_pinger *p =
+		container_of(work, struct vpu_test_pinger, work);
+	int i;
+
+	for (i = 0; i < p->rounds; i++) {
+		vpu_test_irq();
+		if (!wait_for_completion_timeout(&p->ack, HZ)) {
+			p->missed++;
+			break;
+		}
+	}
+}
+
+/* every completion wakes the waiter once, none is lost */
+static void vpu_test_wait_concurrent(struct kunit *test)
+{
+	struct vpu_session *s = test->priv;
+	struct vpu_test_pinger p = { .rounds = 10000 };
+	int i, ret = 0;
+
+	INIT_WORK_ONSTACK(&p.work, vpu_test_ping_fn);
+	init_completion(&p.ack);
+	if (!vpu_test_lock())
+		kunit_skip(test, "device is open");
+	irq_status = 0;
+	queue_work(system_unbound_wq, &p.work);
+	for (i = 0; i < p.rounds; i++) {
+		ret = vpu_wait4int(s, 1000);
+		if (ret)
+			break;
+		complete(&p.ack);
+	}
+	flush_work(&p.work);
+	flush_work(&vpu_data.work);
+	irq_status = 0;
+	vpu_unlock();
+	destroy_work_on_stack(&p.work);
+
+	KUNIT_EXPECT_EQ(test, ret, 0);
+	KUNIT_EXPECT_EQ(test, i, p.rounds);
+	KUNIT_EXPECT_EQ(test, p.missed, 0);
+}
+
+static struct kunit_case vpu_test_wait_cases[] = {
+	KUNIT_CASE(vpu_test_wait_signalled),
+	KUNIT_CASE(vpu_test_wait_timeout),
+	KUNIT_CASE(vpu_test_wait_woken),
+	KUNIT_CASE(vpu_test_wait_watchdog),
+	KUNIT_CASE(vpu_test_wait_concurrent),
+	{}
+};
+
+static struct kunit_suite vpu_test_wait_suite = {
+	.name = "mxc_vpu_wait",
+	.init = vpu_test_wait_init,
+	.exit = vpu_test_session_exit,
+	.test_cases = vpu_test_wait_cases,
+};
+
+kunit_test_suites(&vpu_test_buf_suite, &vpu_test_iram_suite,
+		  &vpu_test_wait_suite);
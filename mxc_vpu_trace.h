@@ -0,0 +1,179 @@
+/*
+ * Copyright 2006-2013 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU General Public
+ * License. You may obtain a copy of the GNU General Public License
+ * Version 2 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/gpl-license.html
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/*!
+ * @file mxc_vpu_trace.h
+ *
+ * @brief VPU tracepoints for the ioctl, interrupt and power paths
+ *
+ * @ingroup VPU
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mxc_vpu
+
+#if !defined(_MXC_VPU_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MXC_VPU_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(vpu_ioctl_enter,
+	TP_PROTO(unsigned int cmd, unsigned long arg),
+	TP_ARGS(cmd, arg),
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+		__field(unsigned long, arg)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->arg = arg;
+	),
+	TP_printk("cmd=%u arg=0x%lx", _IOC_NR(__entry->cmd), __entry->arg)
+);
+
+TRACE_EVENT(vpu_ioctl_exit,
+	TP_PROTO(unsigned int cmd, long ret),
+	TP_ARGS(cmd, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, cmd)
+		__field(long, ret)
+	),
+	TP_fast_assign(
+		__entry->cmd = cmd;
+		__entry->ret = ret;
+	),
+	TP_printk("cmd=%u ret=%ld", _IOC_NR(__entry->cmd), __entry->ret)
+);
+
+/* status is BIT_INT_REASON for the BIT engine, MJPEG_PIC_STATUS_REG for JPU */
+TRACE_EVENT(vpu_irq,
+	TP_PROTO(int engine, u32 status, int done),
+	TP_ARGS(engine, status, done),
+	TP_STRUCT__entry(
+		__field(int, engine)
+		__field(u32, status)
+		__field(int, done)
+	),
+	TP_fast_assign(
+		__entry->engine = engine;
+		__entry->status = status;
+		__entry->done = done;
+	),
+	TP_printk("engine=%s status=0x%x done=%d",
+		  __entry->engine ? "jpu" : "bit", __entry->status,
+		  __entry->done)
+);
+
+TRACE_EVENT(vpu_worker_wakeup,
+	TP_PROTO(int codec_done),
+	TP_ARGS(codec_done),
+	TP_STRUCT__entry(
+		__field(int, codec_done)
+	),
+	TP_fast_assign(
+		__entry->codec_done = codec_done;
+	),
+	TP_printk("codec_done=%d", __entry->codec_done)
+);
+
+TRACE_EVENT(vpu_wait_sleep,
+	TP_PROTO(unsigned long timeout_ms),
+	TP_ARGS(timeout_ms),
+	TP_STRUCT__entry(
+		__field(unsigned long, timeout_ms)
+	),
+	TP_fast_assign(
+		__entry->timeout_ms = timeout_ms;
+	),
+	TP_printk("timeout=%lums", __entry->timeout_ms)
+);
+
+TRACE_EVENT(vpu_wait_wake,
+	TP_PROTO(long ret, s64 wait_ns),
+	TP_ARGS(ret, wait_ns),
+	TP_STRUCT__entry(
+		__field(long, ret)
+		__field(s64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->ret = ret;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("ret=%ld waited=%lldns", __entry->ret, __entry->wait_ns)
+);
+
+DECLARE_EVENT_CLASS(vpu_dma,
+	TP_PROTO(u32 size, u64 phys, s64 latency_ns),
+	TP_ARGS(size, phys, latency_ns),
+	TP_STRUCT__entry(
+		__field(u32, size)
+		__field(u64, phys)
+		__field(s64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->size = size;
+		__entry->phys = phys;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("size=%u phys=0x%llx latency=%lldns", __entry->size,
+		  __entry->phys, __entry->latency_ns)
+);
+
+DEFINE_EVENT(vpu_dma, vpu_dma_alloc,
+	TP_PROTO(u32 size, u64 phys, s64 latency_ns),
+	TP_ARGS(size, phys, latency_ns)
+);
+
+DEFINE_EVENT(vpu_dma, vpu_dma_free,
+	TP_PROTO(u32 size, u64 phys, s64 latency_ns),
+	TP_ARGS(size, phys, latency_ns)
+);
+
+TRACE_EVENT(vpu_clk_gate,
+	TP_PROTO(int on, int count),
+	TP_ARGS(on, count),
+	TP_STRUCT__entry(
+		__field(int, on)
+		__field(int, count)
+	),
+	TP_fast_assign(
+		__entry->on = on;
+		__entry->count = count;
+	),
+	TP_printk("%s count=%d", __entry->on ? "on" : "off", __entry->count)
+);
+
+TRACE_EVENT(vpu_pu_power,
+	TP_PROTO(int on, s64 latency_ns, int ret),
+	TP_ARGS(on, latency_ns, ret),
+	TP_STRUCT__entry(
+		__field(int, on)
+		__field(s64, latency_ns)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->on = on;
+		__entry->latency_ns = latency_ns;
+		__entry->ret = ret;
+	),
+	TP_printk("%s latency=%lldns ret=%d", __entry->on ? "up" : "down",
+		  __entry->latency_ns, __entry->ret)
+);
+
+#endif /* _MXC_VPU_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mxc_vpu_trace
+#include <trace/define_trace.h>
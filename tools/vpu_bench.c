@@ -0,0 +1,364 @@
+/*
+ * Copyright 2004-2012 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU Lesser General
+ * Public License.  You may obtain a copy of the GNU Lesser General
+ * Public License Version 2.1 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/lgpl-license.html
+ * http://www.gnu.org/copyleft/lgpl.html
+ */
+
+/*!
+ * @file vpu_bench.c
+ *
+ * @brief Latency and throughput benchmark of the /dev/mxc_vpu ioctl ABI
+ *
+ * Every client opens the device on its own and runs the same operation
+ * in a loop; each operation is timed. One JSON object per test and
+ * buffer size is printed on stdout:
+ *
+ *   {"test":"alloc","size":4096,"clients":4,"mode":"thread","ops":4000,
+ *    "errors":0,"ops_per_sec":...,"p50_ns":...,"p99_ns":...,
+ *    "p999_ns":...,"max_ns":...}
+ *
+ * Tests:
+ *   alloc  PHYMEM_ALLOC + PHYMEM_FREE of one buffer
+ *   mmap   mmap + munmap of an allocated DMA buffer
+ *   regs   mmap + munmap of the register window
+ *   share  GET_SHARE_MEM + REQ_VSHARE_MEM
+ *   clk    CLKGATE_SETTING on + off
+ *   wait   LOCK_DEV, start a job through the register window, WAIT4INT,
+ *          unlock. This runs the BIT processor, so it is only meant for
+ *          mxc_vpu_sim or firmware that treats the command as a no-op,
+ *          and is not in the default set.
+ *   wait_batch  the same cycle in two VPU_IOC_BATCH calls instead of six
+ *          ioctls, also not in the default set.
+ *   ring   the same job through the submission and completion rings,
+ *          also not in the default set.
+ *
+ * @ingroup VPU
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "vpu_tool.h"
+
+enum {
+	TEST_ALLOC,
+	TEST_MMAP,
+	TEST_REGS,
+	TEST_SHARE,
+	TEST_CLK,
+	TEST_WAIT,
+	TEST_WAIT_BATCH,
+	TEST_RING,
+	TEST_NUM,
+};
+
+static const char *test_names[TEST_NUM] = {
+	"alloc", "mmap", "regs", "share", "clk", "wait", "wait_batch", "ring",
+};
+
+/* tests that depend on the buffer size */
+static const int test_sized[TEST_NUM] = { 1, 1, 0, 0, 0, 0, 0, 0 };
+
+struct bench_shared {
+	volatile int ready;
+	volatile int go;
+	volatile int errors;
+	uint64_t samples[];
+};
+
+static const char *dev_name = VPU_DEV_NAME;
+static unsigned int iterations = 1000;
+static unsigned int clients = 1;
+static int use_procs;
+static int cur_test;
+static uint32_t cur_size;
+static struct bench_shared *sh;
+
+static void bench_start(void)
+{
+	__sync_fetch_and_add(&sh->ready, 1);
+	while (!sh->go)
+		;
+}
+
+static int bench_op(int fd, void *regs, struct vpu_mem_desc *buf,
+		    struct vpu_ring *ring)
+{
+	struct vpu_mem_desc mem;
+	uint32_t on = 1, off = 0;
+	void *p;
+
+	switch (cur_test) {
+	case TEST_ALLOC:
+		memset(&mem, 0, sizeof(mem));
+		mem.size = cur_size;
+		if (ioctl(fd, VPU_IOC_PHYMEM_ALLOC, &mem) || !mem.phy_addr)
+			return -1;
+		return ioctl(fd, VPU_IOC_PHYMEM_FREE, &mem);
+	case TEST_MMAP:
+		p = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, buf->phy_addr);
+		if (p == MAP_FAILED)
+			return -1;
+		return munmap(p, buf->size);
+	case TEST_REGS:
+		p = mmap(NULL, VPU_REGS_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED)
+			return -1;
+		return munmap(p, VPU_REGS_SIZE);
+	case TEST_SHARE:
+		memset(&mem, 0, sizeof(mem));
+		mem.size = 4096;
+		if (ioctl(fd, VPU_IOC_GET_SHARE_MEM, &mem))
+			return -1;
+		memset(&mem, 0, sizeof(mem));
+		mem.size = 4096;
+		return ioctl(fd, VPU_IOC_REQ_VSHARE_MEM, &mem);
+	case TEST_CLK:
+		if (ioctl(fd, VPU_IOC_CLKGATE_SETTING, &on))
+			return -1;
+		return ioctl(fd, VPU_IOC_CLKGATE_SETTING, &off);
+	case TEST_WAIT:
+		{
+			volatile uint32_t *r = regs;
+			int ret;
+
+			if (ioctl(fd, VPU_IOC_LOCK_DEV, &on))
+				return -1;
+			ret = vpu_run_job(fd, r);
+			ioctl(fd, VPU_IOC_LOCK_DEV, &off);
+			return ret;
+		}
+	case TEST_WAIT_BATCH:
+		return vpu_run_job_batched(fd, regs);
+	case TEST_RING:
+		return vpu_ring_run_job(fd, ring);
+	}
+	return -1;
+}
+
+static void *bench_client(void *arg)
+{
+	unsigned long id = (unsigned long)arg;
+	uint64_t *samples = &sh->samples[id * iterations];
+	struct vpu_mem_desc buf;
+	struct vpu_ring ring = { 0 };
+	void *regs = NULL;
+	unsigned int i;
+	int fd, errors = 0;
+	uint64_t t0;
+
+	memset(&buf, 0, sizeof(buf));
+	fd = open(dev_name, O_RDWR);
+	if (fd < 0) {
+		perror(dev_name);
+		errors = iterations;
+	} else if (cur_test == TEST_MMAP) {
+		buf.size = cur_size;
+		if (ioctl(fd, VPU_IOC_PHYMEM_ALLOC, &buf) || !buf.phy_addr)
+			errors = iterations;
+	} else if (cur_test == TEST_WAIT || cur_test == TEST_WAIT_BATCH) {
+		regs = mmap(NULL, VPU_REGS_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+		if (regs == MAP_FAILED)
+			errors = iterations;
+	} else if (cur_test == TEST_RING) {
+		if (vpu_ring_init(fd, &ring, 8))
+			errors = iterations;
+	}
+
+	bench_start();
+	/* a client stops at its first failure; the rest count as errors */
+	for (i = 0; i < iterations && !errors; i++) {
+		t0 = vpu_now_ns();
+		if (bench_op(fd, regs, &buf, &ring))
+			break;
+		samples[i] = vpu_now_ns() - t0;
+	}
+	if (!errors)
+		errors = iterations - i;
+	for (; i < iterations; i++)
+		samples[i] = UINT64_MAX;
+
+	if (buf.phy_addr)
+		ioctl(fd, VPU_IOC_PHYMEM_FREE, &buf);
+	if (regs && regs != MAP_FAILED)
+		munmap(regs, VPU_REGS_SIZE);
+	if (ring.hdr)
+		munmap((void *)ring.hdr, ring.size);
+	if (fd >= 0)
+		close(fd);
+	__sync_fetch_and_add(&sh->errors, errors);
+	return NULL;
+}
+
+static int bench_run(void)
+{
+	pthread_t *tids = NULL;
+	pid_t *pids = NULL;
+	size_t n = (size_t)clients * iterations, ok;
+	unsigned long i;
+	uint64_t t0, wall;
+
+	sh->ready = sh->go = sh->errors = 0;
+	if (use_procs) {
+		pids = calloc(clients, sizeof(*pids));
+		if (!pids)
+			return -1;
+		for (i = 0; i < clients; i++) {
+			pids[i] = fork();
+			if (pids[i] == 0) {
+				bench_client((void *)i);
+				_exit(0);
+			}
+			if (pids[i] < 0) {
+				perror("fork");
+				return -1;
+			}
+		}
+	} else {
+		tids = calloc(clients, sizeof(*tids));
+		if (!tids)
+			return -1;
+		for (i = 0; i < clients; i++)
+			if (pthread_create(&tids[i], NULL, bench_client,
+					   (void *)i))
+				return -1;
+	}
+
+	while (sh->ready < (int)clients)
+		usleep(1000);
+	t0 = vpu_now_ns();
+	sh->go = 1;
+
+	for (i = 0; i < clients; i++) {
+		if (use_procs)
+			waitpid(pids[i], NULL, 0);
+		else
+			pthread_join(tids[i], NULL);
+	}
+	wall = vpu_now_ns() - t0;
+	free(pids);
+	free(tids);
+
+	/* failed operations sort to the end and are left out */
+	vpu_sort_samples(sh->samples, n);
+	ok = n - sh->errors;
+	printf("{\"test\":\"%s\",\"size\":%u,\"clients\":%u,\"mode\":\"%s\","
+	       "\"ops\":%zu,\"errors\":%d,\"ops_per_sec\":%.1f,"
+	       "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+	       "\"max_ns\":%llu}\n",
+	       test_names[cur_test], test_sized[cur_test] ? cur_size : 0,
+	       clients, use_procs ? "process" : "thread", ok, sh->errors,
+	       wall ? ok * 1e9 / wall : 0.0,
+	       (unsigned long long)vpu_percentile(sh->samples, ok, 500),
+	       (unsigned long long)vpu_percentile(sh->samples, ok, 990),
+	       (unsigned long long)vpu_percentile(sh->samples, ok, 999),
+	       (unsigned long long)(ok ? sh->samples[ok - 1] : 0));
+	fflush(stdout);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-t test,...] [-s size,...] [-n iterations]\n"
+		"          [-c clients] [-P]\n"
+		"  tests: alloc mmap regs share clk wait wait_batch ring\n"
+		"         (default: all but the wait and ring tests)\n"
+		"  -P     run clients as processes instead of threads\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	char *tests = "alloc,mmap,regs,share,clk";
+	char *sizes = "4096,65536,1048576";
+	unsigned int enabled = 0;
+	char *tok, *save;
+	int opt, t;
+
+	while ((opt = getopt(argc, argv, "d:t:s:n:c:Ph")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 't':
+			tests = optarg;
+			break;
+		case 's':
+			sizes = optarg;
+			break;
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			use_procs = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!iterations || !clients)
+		usage(argv[0]);
+
+	tests = strdup(tests);
+	for (tok = strtok_r(tests, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		for (t = 0; t < TEST_NUM; t++)
+			if (!strcmp(tok, test_names[t]))
+				break;
+		if (t == TEST_NUM)
+			usage(argv[0]);
+		enabled |= 1 << t;
+	}
+
+	/* shared with the clients whether they are threads or processes */
+	sh = mmap(NULL, sizeof(*sh) + sizeof(uint64_t) * clients * iterations,
+		  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	for (t = 0; t < TEST_NUM; t++) {
+		char *list, *s;
+
+		if (!(enabled & (1 << t)))
+			continue;
+		cur_test = t;
+		if (!test_sized[t]) {
+			cur_size = 0;
+			if (bench_run())
+				return 1;
+			continue;
+		}
+		list = strdup(sizes);
+		for (s = strtok_r(list, ",", &save); s;
+		     s = strtok_r(NULL, ",", &save)) {
+			cur_size = strtoul(s, NULL, 0);
+			if (bench_run())
+				return 1;
+		}
+		free(list);
+	}
+	return 0;
+}
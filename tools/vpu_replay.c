@@ -0,0 +1,482 @@
+/*
+ * Copyright 2004-2012 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU Lesser General
+ * Public License.  You may obtain a copy of the GNU Lesser General
+ * Public License Version 2.1 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/lgpl-license.html
+ * http://www.gnu.org/copyleft/lgpl.html
+ */
+
+/*!
+ * @file vpu_replay.c
+ *
+ * @brief Re-issue a recorded /dev/mxc_vpu timeline
+ *
+ * Record on the target with
+ *
+ *   echo 1 > /sys/kernel/debug/mxc_vpu/record_enable
+ *   ... run the workload ...
+ *   echo 0 > /sys/kernel/debug/mxc_vpu/record_enable
+ *   cat /sys/kernel/debug/mxc_vpu/record > trace.bin
+ *
+ * and replay with "vpu_replay [-s speed] [-j] trace.bin". Every recorded
+ * client gets its own thread and open of the device, and issues its
+ * events at the recorded times divided by speed (-s 0 issues them back
+ * to back, which keeps the order within a client only). Buffers are
+ * matched by their recorded addresses, so frees, mmaps and checks go to
+ * the buffer allocated in their place.
+ *
+ * Register accesses are not recorded, so jobs cannot be re-created on
+ * real hardware; WAIT4INT calls are skipped unless -j is given, which
+ * starts a job through the register window before each wait that
+ * succeeded in the recording (mxc_vpu_sim only). Interrupts are counted
+ * but not replayed.
+ *
+ * One JSON object per ioctl is printed with replayed and recorded
+ * latencies, followed by a summary line.
+ *
+ * @ingroup VPU
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "vpu_tool.h"
+
+#define REPLAY_NR		32
+#define REPLAY_MAPS		64
+
+static const char *nr_names[REPLAY_NR] = {
+	[0] = "phymem_alloc",
+	[1] = "phymem_free",
+	[2] = "wait4int",
+	[6] = "iram_setting",
+	[7] = "clkgate_setting",
+	[8] = "get_work_addr",
+	[9] = "req_vshare_mem",
+	[11] = "sys_sw_reset",
+	[12] = "get_share_mem",
+	[13] = "query_bitwork_mem",
+	[14] = "set_bitwork_mem",
+	[15] = "phymem_check",
+	[16] = "lock_dev",
+};
+
+/* a recorded buffer and the one allocated in its place */
+struct replay_buf {
+	struct replay_buf *next;
+	struct vpu_mem_desc old;
+	struct vpu_mem_desc cur;
+};
+
+struct replay_map {
+	void *addr;
+	size_t len;
+};
+
+struct replay_client {
+	pthread_t tid;
+	uint32_t id;
+	struct vpu_rec **ev;
+	size_t n;
+	size_t cap;
+	int fd;
+	volatile uint32_t *regs;
+	struct replay_map maps[REPLAY_MAPS];
+	unsigned int skipped;
+	unsigned int errors;
+	struct vpu_samples lat[REPLAY_NR];
+	struct vpu_samples rec[REPLAY_NR];
+};
+
+static const char *dev_name = VPU_DEV_NAME;
+static double speed = 1.0;
+static int run_jobs;
+static uint64_t rec_t0, run_t0;
+
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct replay_buf *bufs;
+
+static void buf_add(const uint32_t *old, const struct vpu_mem_desc *cur)
+{
+	struct replay_buf *b = calloc(1, sizeof(*b));
+
+	if (!b)
+		return;
+	b->old.size = old[0];
+	b->old.phy_addr = old[1];
+	b->old.cpu_addr = old[2];
+	b->old.virt_uaddr = old[3];
+	b->cur = *cur;
+	pthread_mutex_lock(&buf_lock);
+	b->next = bufs;
+	bufs = b;
+	pthread_mutex_unlock(&buf_lock);
+}
+
+/* finds the buffer recorded at phy (or cpu) address, optionally unlinks it */
+static int buf_find(uint32_t phy, uint32_t cpu, struct vpu_mem_desc *cur,
+		    int unlink)
+{
+	struct replay_buf **p, *b;
+	int found = 0;
+
+	pthread_mutex_lock(&buf_lock);
+	for (p = &bufs; (b = *p); p = &b->next) {
+		if ((phy && phy >= b->old.phy_addr &&
+		     phy < b->old.phy_addr + b->old.size) ||
+		    (cpu && cpu == b->old.cpu_addr)) {
+			*cur = b->cur;
+			if (phy > b->old.phy_addr)
+				cur->phy_addr += phy - b->old.phy_addr;
+			if (unlink) {
+				*p = b->next;
+				free(b);
+			}
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&buf_lock);
+	return found;
+}
+
+static int replay_open(struct replay_client *c)
+{
+	if (c->fd >= 0)
+		return 0;
+	c->fd = open(dev_name, O_RDWR);
+	if (c->fd < 0) {
+		perror(dev_name);
+		return -1;
+	}
+	return 0;
+}
+
+static void replay_close(struct replay_client *c)
+{
+	int i;
+
+	for (i = 0; i < REPLAY_MAPS; i++) {
+		if (c->maps[i].addr)
+			munmap(c->maps[i].addr, c->maps[i].len);
+		c->maps[i].addr = NULL;
+	}
+	c->regs = NULL;
+	if (c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+}
+
+static int replay_mmap(struct replay_client *c, struct vpu_rec *e)
+{
+	struct vpu_mem_desc cur;
+	size_t len = e->arg[1];
+	off_t off = 0;
+	void *p;
+	int i;
+
+	switch (e->cmd) {
+	case VPU_REC_MMAP_REGS:
+		break;
+	case VPU_REC_MMAP_DMA:
+		if (!buf_find(e->arg[0] * getpagesize(), 0, &cur, 0))
+			return 1;
+		off = cur.phy_addr;
+		break;
+	case VPU_REC_MMAP_VSHARE:
+		if (!buf_find(0, e->arg[0] * getpagesize(), &cur, 0))
+			return 1;
+		off = cur.cpu_addr;
+		break;
+	default:
+		return 1;
+	}
+
+	for (i = 0; i < REPLAY_MAPS && c->maps[i].addr; i++)
+		;
+	if (i == REPLAY_MAPS)
+		return 1;
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, off);
+	if (p == MAP_FAILED)
+		return -1;
+	c->maps[i].addr = p;
+	c->maps[i].len = len;
+	if (e->cmd == VPU_REC_MMAP_REGS && !c->regs)
+		c->regs = p;
+	return 0;
+}
+
+/* returns 1 if the event was skipped */
+static int replay_ioctl(struct replay_client *c, struct vpu_rec *e)
+{
+	struct vpu_mem_desc mem, cur;
+	uint32_t v = e->arg[0];
+	unsigned int nr = e->cmd & 0xff;
+	uint32_t iram[2];
+	uint64_t t0 = vpu_now_ns();
+	int ret;
+
+	memset(&mem, 0, sizeof(mem));
+	mem.size = e->arg[0];
+
+	switch (e->cmd) {
+	case VPU_IOC_PHYMEM_ALLOC:
+		ret = ioctl(c->fd, e->cmd, &mem);
+		if (!ret)
+			buf_add(e->arg, &mem);
+		break;
+	case VPU_IOC_PHYMEM_FREE:
+		if (!buf_find(0, e->arg[2], &cur, 1))
+			return 1;
+		ret = ioctl(c->fd, e->cmd, &cur);
+		break;
+	case VPU_IOC_GET_SHARE_MEM:
+	case VPU_IOC_REQ_VSHARE_MEM:
+	case VPU_IOC_GET_WORK_ADDR:
+		ret = ioctl(c->fd, e->cmd, &mem);
+		if (!ret && !buf_find(e->arg[1], e->arg[2], &cur, 0))
+			buf_add(e->arg, &mem);
+		break;
+	case VPU_IOC_SET_BITWORK_MEM:
+	case VPU_IOC_PHYMEM_CHECK:
+		if (!buf_find(e->arg[1], 0, &cur, 0))
+			return 1;
+		cur.size = e->arg[0];
+		ret = ioctl(c->fd, e->cmd, &cur);
+		break;
+	case VPU_IOC_QUERY_BITWORK_MEM:
+		ret = ioctl(c->fd, e->cmd, &mem);
+		break;
+	case VPU_IOC_IRAM_SETTING:
+		ret = ioctl(c->fd, e->cmd, iram);
+		break;
+	case VPU_IOC_CLKGATE_SETTING:
+	case VPU_IOC_LOCK_DEV:
+		ret = ioctl(c->fd, e->cmd, &v);
+		break;
+	case VPU_IOC_SYS_SW_RESET:
+		ret = ioctl(c->fd, e->cmd, 0);
+		break;
+	case VPU_IOC_WAIT4INT:
+		if (!run_jobs || e->ret || !c->regs)
+			return 1;
+		c->regs[BIT_RUN_COMMAND / 4] = BITVAL_PIC_RUN;
+		c->regs[BIT_BUSY_FLAG / 4] = 1;
+		ret = ioctl(c->fd, e->cmd, e->arg[0]);
+		c->regs[BIT_INT_CLEAR / 4] = 1;
+		break;
+	default:
+		return 1;
+	}
+
+	if (ret && !e->ret)
+		c->errors++;
+	if (nr < REPLAY_NR) {
+		vpu_samples_add(&c->lat[nr], vpu_now_ns() - t0);
+		vpu_samples_add(&c->rec[nr], e->dur_ns);
+	}
+	return 0;
+}
+
+static void *replay_client(void *arg)
+{
+	struct replay_client *c = arg;
+	struct vpu_rec *e;
+	uint64_t due, now;
+	size_t i;
+	int r;
+
+	for (i = 0; i < c->n; i++) {
+		e = c->ev[i];
+		if (speed > 0) {
+			due = run_t0 + (uint64_t)((e->ts_ns - rec_t0) / speed);
+			now = vpu_now_ns();
+			if (due > now)
+				usleep((due - now) / 1000);
+		}
+
+		if (e->type == VPU_REC_RELEASE) {
+			replay_close(c);
+			continue;
+		}
+		/* the recording may start after the client opened */
+		if (replay_open(c)) {
+			c->errors++;
+			continue;
+		}
+
+		switch (e->type) {
+		case VPU_REC_IOCTL:
+			r = replay_ioctl(c, e);
+			break;
+		case VPU_REC_MMAP:
+			r = replay_mmap(c, e);
+			break;
+		case VPU_REC_OPEN:
+			r = 0;
+			break;
+		default:
+			r = 1;
+		}
+		if (r > 0)
+			c->skipped++;
+		else if (r < 0)
+			c->errors++;
+	}
+	replay_close(c);
+	return NULL;
+}
+
+static struct replay_client *client_get(struct replay_client **cs,
+					size_t *n, uint32_t id)
+{
+	struct replay_client *c;
+	size_t i;
+
+	for (i = 0; i < *n; i++)
+		if ((*cs)[i].id == id)
+			return &(*cs)[i];
+	c = realloc(*cs, (*n + 1) * sizeof(*c));
+	if (!c)
+		return NULL;
+	*cs = c;
+	c = &c[(*n)++];
+	memset(c, 0, sizeof(*c));
+	c->id = id;
+	c->fd = -1;
+	return c;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-s speed] [-j] trace.bin\n"
+		"  -s     time scale, 2 replays twice as fast, 0 back to back\n"
+		"  -j     start a job before each WAIT4INT (mxc_vpu_sim only)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct replay_client *cs = NULL, *c;
+	struct vpu_rec *recs;
+	struct vpu_samples lat, rec;
+	unsigned long long skipped = 0, errors = 0, irqs = 0;
+	size_t n, ncs = 0, i, k;
+	uint64_t wall, rec_end;
+	struct stat st;
+	int opt, fd, nr;
+
+	while ((opt = getopt(argc, argv, "d:s:jh")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			break;
+		case 'j':
+			run_jobs = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || speed < 0)
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	n = st.st_size / sizeof(*recs);
+	recs = malloc(n * sizeof(*recs) + 1);
+	if (!recs || read(fd, recs, n * sizeof(*recs)) !=
+	    (ssize_t)(n * sizeof(*recs))) {
+		fprintf(stderr, "%s: short read\n", argv[optind]);
+		return 1;
+	}
+	close(fd);
+	if (!n)
+		return 0;
+
+	/* split the timeline per client; interrupts have no client */
+	rec_t0 = rec_end = recs[0].ts_ns;
+	for (i = 0; i < n; i++) {
+		if (recs[i].ts_ns < rec_t0)
+			rec_t0 = recs[i].ts_ns;
+		if (recs[i].ts_ns > rec_end)
+			rec_end = recs[i].ts_ns;
+		if (recs[i].type == VPU_REC_IRQ) {
+			irqs++;
+			continue;
+		}
+		c = client_get(&cs, &ncs, recs[i].client);
+		if (!c)
+			return 1;
+		if (c->n == c->cap) {
+			c->cap = c->cap ? c->cap * 2 : 256;
+			c->ev = realloc(c->ev, c->cap * sizeof(*c->ev));
+			if (!c->ev)
+				return 1;
+		}
+		c->ev[c->n++] = &recs[i];
+	}
+
+	run_t0 = vpu_now_ns();
+	for (i = 0; i < ncs; i++)
+		if (pthread_create(&cs[i].tid, NULL, replay_client, &cs[i]))
+			return 1;
+	for (i = 0; i < ncs; i++)
+		pthread_join(cs[i].tid, NULL);
+	wall = vpu_now_ns() - run_t0;
+
+	for (nr = 0; nr < REPLAY_NR; nr++) {
+		memset(&lat, 0, sizeof(lat));
+		memset(&rec, 0, sizeof(rec));
+		for (i = 0; i < ncs; i++) {
+			for (k = 0; k < cs[i].lat[nr].n; k++) {
+				vpu_samples_add(&lat, cs[i].lat[nr].v[k]);
+				vpu_samples_add(&rec, cs[i].rec[nr].v[k]);
+			}
+		}
+		if (!lat.n)
+			continue;
+		vpu_sort_samples(lat.v, lat.n);
+		vpu_sort_samples(rec.v, rec.n);
+		printf("{\"ioctl\":\"%s\",\"count\":%zu,"
+		       "\"p50_ns\":%llu,\"p99_ns\":%llu,"
+		       "\"rec_p50_ns\":%llu,\"rec_p99_ns\":%llu}\n",
+		       nr_names[nr] ? nr_names[nr] : "unknown", lat.n,
+		       (unsigned long long)vpu_percentile(lat.v, lat.n, 500),
+		       (unsigned long long)vpu_percentile(lat.v, lat.n, 990),
+		       (unsigned long long)vpu_percentile(rec.v, rec.n, 500),
+		       (unsigned long long)vpu_percentile(rec.v, rec.n, 990));
+		free(lat.v);
+		free(rec.v);
+	}
+
+	for (i = 0; i < ncs; i++) {
+		skipped += cs[i].skipped;
+		errors += cs[i].errors;
+	}
+	printf("{\"events\":%zu,\"clients\":%zu,\"irqs\":%llu,"
+	       "\"skipped\":%llu,\"errors\":%llu,\"wall_ns\":%llu,"
+	       "\"recorded_ns\":%llu}\n",
+	       n, ncs, irqs, skipped, errors, (unsigned long long)wall,
+	       (unsigned long long)(rec_end - rec_t0));
+	return 0;
+}
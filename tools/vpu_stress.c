@@ -0,0 +1,322 @@
+/*
+ * Copyright 2004-2012 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU Lesser General
+ * Public License.  You may obtain a copy of the GNU Lesser General
+ * Public License Version 2.1 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/lgpl-license.html
+ * http://www.gnu.org/copyleft/lgpl.html
+ */
+
+/*!
+ * @file vpu_stress.c
+ *
+ * @brief Multi-client contention stress of /dev/mxc_vpu
+ *
+ * Runs 1, 2, 4, ... up to -c clients, each with its own open of the
+ * device, for -T seconds per step. Every client picks operations at
+ * random from a fixed mix:
+ *
+ *   40% alloc  PHYMEM_ALLOC + PHYMEM_FREE
+ *   10% share  GET_SHARE_MEM + REQ_VSHARE_MEM
+ *   20% clk    CLKGATE_SETTING on + off
+ *   30% lock   LOCK_DEV held for -H microseconds (with -j: a job run
+ *              through the register window and WAIT4INT instead, which
+ *              is only meant for mxc_vpu_sim)
+ *
+ * The driver's lock counters (debugfs mxc_vpu/lockstat) are reset and
+ * enabled before and read after each step. One JSON object per step is printed with
+ * throughput, per-operation latency and the lock counters per call site,
+ * which gives the scaling curve of the driver.
+ *
+ * @ingroup VPU
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "vpu_tool.h"
+
+enum {
+	OP_ALLOC,
+	OP_SHARE,
+	OP_CLK,
+	OP_LOCK,
+	OP_NUM,
+};
+
+static const char *op_names[OP_NUM] = { "alloc", "share", "clk", "lock" };
+
+/* cumulative percentages of the operation mix */
+static const int op_mix[OP_NUM] = { 40, 50, 70, 100 };
+
+struct stress_client {
+	pthread_t tid;
+	unsigned int seed;
+	unsigned int errors;
+	struct vpu_samples s[OP_NUM];
+};
+
+static const char *dev_name = VPU_DEV_NAME;
+static const char *lockstat_path = "/sys/kernel/debug/mxc_vpu/lockstat";
+static unsigned int max_clients = 64;
+static unsigned int step_sec = 2;
+static unsigned int hold_us = 100;
+static int run_jobs;
+static volatile int running;
+
+static int stress_op(int fd, volatile uint32_t *regs, int op,
+		     unsigned int *seed)
+{
+	struct vpu_mem_desc mem;
+	uint32_t on = 1, off = 0;
+	int ret;
+
+	switch (op) {
+	case OP_ALLOC:
+		memset(&mem, 0, sizeof(mem));
+		mem.size = 4096 << (rand_r(seed) % 8);
+		if (ioctl(fd, VPU_IOC_PHYMEM_ALLOC, &mem) || !mem.phy_addr)
+			return -1;
+		return ioctl(fd, VPU_IOC_PHYMEM_FREE, &mem);
+	case OP_SHARE:
+		memset(&mem, 0, sizeof(mem));
+		mem.size = 4096;
+		if (ioctl(fd, VPU_IOC_GET_SHARE_MEM, &mem))
+			return -1;
+		memset(&mem, 0, sizeof(mem));
+		mem.size = 4096;
+		return ioctl(fd, VPU_IOC_REQ_VSHARE_MEM, &mem);
+	case OP_CLK:
+		if (ioctl(fd, VPU_IOC_CLKGATE_SETTING, &on))
+			return -1;
+		return ioctl(fd, VPU_IOC_CLKGATE_SETTING, &off);
+	case OP_LOCK:
+		if (ioctl(fd, VPU_IOC_LOCK_DEV, &on))
+			return -1;
+		ret = 0;
+		if (run_jobs)
+			ret = vpu_run_job(fd, regs);
+		else if (hold_us)
+			usleep(hold_us);
+		ioctl(fd, VPU_IOC_LOCK_DEV, &off);
+		return ret;
+	}
+	return -1;
+}
+
+static void *stress_client(void *arg)
+{
+	struct stress_client *c = arg;
+	volatile uint32_t *regs = NULL;
+	uint64_t t0;
+	int fd, op, r;
+
+	fd = open(dev_name, O_RDWR);
+	if (fd < 0) {
+		perror(dev_name);
+		c->errors++;
+		return NULL;
+	}
+	if (run_jobs) {
+		regs = mmap(NULL, VPU_REGS_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+		if (regs == MAP_FAILED) {
+			perror("mmap");
+			c->errors++;
+			close(fd);
+			return NULL;
+		}
+	}
+
+	while (running) {
+		r = rand_r(&c->seed) % 100;
+		for (op = 0; r >= op_mix[op]; op++)
+			;
+		t0 = vpu_now_ns();
+		if (stress_op(fd, regs, op, &c->seed))
+			c->errors++;
+		else
+			vpu_samples_add(&c->s[op], vpu_now_ns() - t0);
+	}
+
+	if (regs)
+		munmap((void *)regs, VPU_REGS_SIZE);
+	close(fd);
+	return NULL;
+}
+
+/* clears the counters and turns counting on, which is off by default */
+static void lockstat_reset(void)
+{
+	char enable[256];
+	FILE *f = fopen(lockstat_path, "w");
+
+	if (!f)
+		return;
+	fputs("0\n", f);
+	fclose(f);
+
+	snprintf(enable, sizeof(enable), "%s_enable", lockstat_path);
+	f = fopen(enable, "w");
+	if (!f)
+		return;
+	fputs("1\n", f);
+	fclose(f);
+}
+
+/* prints the lockstat table as a JSON object keyed by call site */
+static void lockstat_print(void)
+{
+	unsigned long long v[6];
+	char line[256], site[32];
+	FILE *f = fopen(lockstat_path, "r");
+	int first = 1;
+
+	printf(",\"lockstat\":{");
+	if (f) {
+		/* skip the header */
+		if (!fgets(line, sizeof(line), f))
+			line[0] = 0;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "%31s %llu %llu %llu %llu %llu %llu",
+				   site, &v[0], &v[1], &v[2], &v[3], &v[4],
+				   &v[5]) != 7 || !v[0])
+				continue;
+			printf("%s\"%s\":{\"acquired\":%llu,\"contended\":%llu,"
+			       "\"wait_ns\":%llu,\"wait_max_ns\":%llu,"
+			       "\"hold_ns\":%llu,\"hold_max_ns\":%llu}",
+			       first ? "" : ",", site, v[0], v[1], v[2], v[3],
+			       v[4], v[5]);
+			first = 0;
+		}
+		fclose(f);
+	}
+	printf("}");
+}
+
+static int stress_step(unsigned int n)
+{
+	struct stress_client *c;
+	struct vpu_samples all;
+	unsigned long long total = 0, errors = 0;
+	uint64_t t0, wall;
+	unsigned int i;
+	int op;
+
+	c = calloc(n, sizeof(*c));
+	if (!c)
+		return -1;
+
+	lockstat_reset();
+	running = 1;
+	t0 = vpu_now_ns();
+	for (i = 0; i < n; i++) {
+		c[i].seed = (unsigned int)t0 + i;
+		if (pthread_create(&c[i].tid, NULL, stress_client, &c[i])) {
+			n = i;
+			break;
+		}
+	}
+	sleep(step_sec);
+	running = 0;
+	for (i = 0; i < n; i++)
+		pthread_join(c[i].tid, NULL);
+	wall = vpu_now_ns() - t0;
+
+	for (i = 0; i < n; i++) {
+		errors += c[i].errors;
+		for (op = 0; op < OP_NUM; op++)
+			total += c[i].s[op].n;
+	}
+	printf("{\"clients\":%u,\"ops\":%llu,\"errors\":%llu,"
+	       "\"ops_per_sec\":%.1f,\"op\":{",
+	       n, total, errors, wall ? total * 1e9 / wall : 0.0);
+
+	/* merge the clients' samples per operation */
+	for (op = 0; op < OP_NUM; op++) {
+		memset(&all, 0, sizeof(all));
+		for (i = 0; i < n; i++) {
+			size_t k;
+
+			for (k = 0; k < c[i].s[op].n; k++)
+				vpu_samples_add(&all, c[i].s[op].v[k]);
+			free(c[i].s[op].v);
+		}
+		vpu_sort_samples(all.v, all.n);
+		printf("%s\"%s\":{\"count\":%zu,\"p50_ns\":%llu,"
+		       "\"p99_ns\":%llu,\"max_ns\":%llu}",
+		       op ? "," : "", op_names[op], all.n,
+		       (unsigned long long)vpu_percentile(all.v, all.n, 500),
+		       (unsigned long long)vpu_percentile(all.v, all.n, 990),
+		       (unsigned long long)(all.n ? all.v[all.n - 1] : 0));
+		free(all.v);
+	}
+	printf("}");
+	lockstat_print();
+	printf("}\n");
+	fflush(stdout);
+
+	free(c);
+	return 0;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-c max_clients] [-T seconds] [-H hold_us]\n"
+		"          [-l lockstat] [-j]\n"
+		"  -j     run jobs under LOCK_DEV (mxc_vpu_sim only)\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int n;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:c:T:H:l:jh")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_name = optarg;
+			break;
+		case 'c':
+			max_clients = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			step_sec = strtoul(optarg, NULL, 0);
+			break;
+		case 'H':
+			hold_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			lockstat_path = optarg;
+			break;
+		case 'j':
+			run_jobs = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (!max_clients || !step_sec)
+		usage(argv[0]);
+
+	/* powers of two, and max_clients itself as the last step */
+	for (n = 1;; n = n * 2 < max_clients ? n * 2 : max_clients) {
+		if (stress_step(n))
+			return 1;
+		if (n == max_clients)
+			break;
+	}
+	return 0;
+}
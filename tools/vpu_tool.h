@@ -0,0 +1,331 @@
+/*
+ * Copyright 2004-2012 Freescale Semiconductor, Inc. All Rights Reserved.
+ */
+
+/*
+ * The code contained herein is licensed under the GNU Lesser General
+ * Public License.  You may obtain a copy of the GNU Lesser General
+ * Public License Version 2.1 or later at the following locations:
+ *
+ * http://www.opensource.org/licenses/lgpl-license.html
+ * http://www.gnu.org/copyleft/lgpl.html
+ */
+
+/*!
+ * @file vpu_tool.h
+ *
+ * @brief Userspace view of the /dev/mxc_vpu ABI and helpers shared by
+ * the tools in this directory
+ *
+ * mxc_vpu.h is a kernel header, so the ioctl layout is repeated here the
+ * way imx-lib sees it on a 32-bit kernel.
+ *
+ * @ingroup VPU
+ */
+
+#ifndef __VPU_TOOL_H__
+#define __VPU_TOOL_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define VPU_DEV_NAME			"/dev/mxc_vpu"
+
+struct vpu_mem_desc {
+	uint32_t size;
+	uint32_t phy_addr;
+	uint32_t cpu_addr;	/* cpu address to free the dma mem */
+	uint32_t virt_uaddr;	/* virtual user space address */
+};
+
+/* timeline record, see struct vpu_rec in mxc_vpu.h */
+#define VPU_REC_OPEN			1
+#define VPU_REC_RELEASE			2
+#define VPU_REC_IOCTL			3
+#define VPU_REC_MMAP			4
+#define VPU_REC_IRQ			5
+
+#define VPU_REC_MMAP_REGS		0
+#define VPU_REC_MMAP_DMA		1
+#define VPU_REC_MMAP_VSHARE		2
+#define VPU_REC_MMAP_RING		3
+#define VPU_REC_MMAP_SET		4
+#define VPU_REC_MMAP_SHM		5
+
+struct vpu_rec {
+	uint64_t ts_ns;
+	uint32_t dur_ns;
+	uint32_t client;
+	uint32_t type;
+	uint32_t cmd;
+	int32_t ret;
+	uint32_t arg[4];
+	uint32_t reserved;
+};
+
+#define VPU_IOC_MAGIC  'V'
+
+#define VPU_IOC_PHYMEM_ALLOC		_IO(VPU_IOC_MAGIC, 0)
+#define VPU_IOC_PHYMEM_FREE		_IO(VPU_IOC_MAGIC, 1)
+#define VPU_IOC_WAIT4INT		_IO(VPU_IOC_MAGIC, 2)
+#define VPU_IOC_IRAM_SETTING		_IO(VPU_IOC_MAGIC, 6)
+#define VPU_IOC_CLKGATE_SETTING		_IO(VPU_IOC_MAGIC, 7)
+#define VPU_IOC_GET_WORK_ADDR		_IO(VPU_IOC_MAGIC, 8)
+#define VPU_IOC_REQ_VSHARE_MEM		_IO(VPU_IOC_MAGIC, 9)
+#define VPU_IOC_SYS_SW_RESET		_IO(VPU_IOC_MAGIC, 11)
+#define VPU_IOC_GET_SHARE_MEM		_IO(VPU_IOC_MAGIC, 12)
+#define VPU_IOC_QUERY_BITWORK_MEM	_IO(VPU_IOC_MAGIC, 13)
+#define VPU_IOC_SET_BITWORK_MEM		_IO(VPU_IOC_MAGIC, 14)
+#define VPU_IOC_PHYMEM_CHECK		_IO(VPU_IOC_MAGIC, 15)
+#define VPU_IOC_LOCK_DEV		_IO(VPU_IOC_MAGIC, 16)
+
+struct vpu_batch_entry {
+	uint32_t cmd;
+	int32_t result;
+	uint64_t arg;
+};
+
+struct vpu_batch {
+	uint64_t entries;
+	uint32_t count;
+	uint32_t done;
+};
+
+#define VPU_IOC_BATCH			_IOWR(VPU_IOC_MAGIC, 66, struct vpu_batch)
+
+/* job rings, see struct vpu_ring_hdr in mxc_vpu.h */
+#define VPU_SQE_REGS			30
+#define VPU_RING_NEED_WAKEUP		(1 << 0)
+
+struct vpu_ring_hdr {
+	uint32_t sq_head;
+	uint32_t sq_tail;
+	uint32_t cq_head;
+	uint32_t cq_tail;
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+struct vpu_sqe {
+	uint64_t user_data;
+	uint32_t run_cmd;
+	uint16_t nr_regs;
+	uint16_t flags;
+	struct {
+		uint32_t offset;
+		uint32_t value;
+	} regs[VPU_SQE_REGS];
+};
+
+struct vpu_cqe {
+	uint64_t user_data;
+	int32_t result;
+	uint32_t int_reason;
+	uint64_t duration_ns;
+};
+
+struct vpu_ring_setup {
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t sq_off;
+	uint32_t cq_off;
+	uint64_t mmap_offset;
+	uint32_t mmap_size;
+	uint32_t reserved;
+};
+
+struct vpu_ring_enter {
+	uint32_t min_complete;
+	uint32_t timeout_ms;
+};
+
+#define VPU_IOC_RING_SETUP		_IOWR(VPU_IOC_MAGIC, 67, struct vpu_ring_setup)
+#define VPU_IOC_RING_ENTER		_IOW(VPU_IOC_MAGIC, 68, struct vpu_ring_enter)
+
+/* register window, offsets as in mxc_vpu.h */
+#define VPU_REGS_SIZE			0x4000
+#define BIT_INT_CLEAR			0x00C
+#define BIT_BUSY_FLAG			0x160
+#define BIT_RUN_COMMAND			0x164
+#define BITVAL_PIC_RUN			8
+
+/*
+ * Runs one job through the register window and waits for it. The BIT
+ * processor is only told to run, so this is for mxc_vpu_sim (or firmware
+ * that ignores the command). The caller holds LOCK_DEV.
+ */
+static inline int vpu_run_job(int fd, volatile uint32_t *regs)
+{
+	uint32_t on = 1, off = 0;
+	int ret;
+
+	ioctl(fd, VPU_IOC_CLKGATE_SETTING, &on);
+	regs[BIT_RUN_COMMAND / 4] = BITVAL_PIC_RUN;
+	regs[BIT_BUSY_FLAG / 4] = 1;
+	ret = ioctl(fd, VPU_IOC_WAIT4INT, 1000);
+	regs[BIT_INT_CLEAR / 4] = 1;
+	ioctl(fd, VPU_IOC_CLKGATE_SETTING, &off);
+	return ret;
+}
+
+/*
+ * The whole LOCK_DEV/run/unlock cycle of vpu_run_job in two calls: one
+ * batch to take the device and clock, and one to wait and give them back.
+ */
+static inline int vpu_run_job_batched(int fd, volatile uint32_t *regs)
+{
+	uint32_t on = 1, off = 0;
+	struct vpu_batch_entry pre[2] = {
+		{ VPU_IOC_LOCK_DEV, 0, (uintptr_t)&on },
+		{ VPU_IOC_CLKGATE_SETTING, 0, (uintptr_t)&on },
+	};
+	struct vpu_batch_entry post[3] = {
+		{ VPU_IOC_WAIT4INT, 0, 1000 },
+		{ VPU_IOC_CLKGATE_SETTING, 0, (uintptr_t)&off },
+		{ VPU_IOC_LOCK_DEV, 0, (uintptr_t)&off },
+	};
+	struct vpu_batch b = { (uintptr_t)pre, 2, 0 };
+	int ret;
+
+	if (ioctl(fd, VPU_IOC_BATCH, &b)) {
+		/* the clock failed, the lock did not */
+		if (b.done == 2)
+			ioctl(fd, VPU_IOC_LOCK_DEV, &off);
+		return -1;
+	}
+	regs[BIT_RUN_COMMAND / 4] = BITVAL_PIC_RUN;
+	regs[BIT_BUSY_FLAG / 4] = 1;
+	/* the interrupt is cleared by the driver, the clock is off by then */
+	b.entries = (uintptr_t)post;
+	b.count = 3;
+	ret = ioctl(fd, VPU_IOC_BATCH, &b);
+	/* the clock and lock go even if the wait failed */
+	if (ret && b.done == 1) {
+		ioctl(fd, VPU_IOC_CLKGATE_SETTING, &off);
+		ioctl(fd, VPU_IOC_LOCK_DEV, &off);
+	}
+	return ret;
+}
+
+/* a mapped pair of job rings */
+struct vpu_ring {
+	volatile struct vpu_ring_hdr *hdr;
+	struct vpu_sqe *sqes;
+	struct vpu_cqe *cqes;
+	size_t size;
+};
+
+static inline int vpu_ring_init(int fd, struct vpu_ring *r, uint32_t entries)
+{
+	struct vpu_ring_setup p = { entries, entries };
+	void *m;
+
+	if (ioctl(fd, VPU_IOC_RING_SETUP, &p))
+		return -1;
+	m = mmap(NULL, p.mmap_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		 p.mmap_offset);
+	if (m == MAP_FAILED)
+		return -1;
+	r->hdr = m;
+	r->sqes = (struct vpu_sqe *)((char *)m + p.sq_off);
+	r->cqes = (struct vpu_cqe *)((char *)m + p.cq_off);
+	r->size = p.mmap_size;
+	return 0;
+}
+
+/*
+ * Runs one job through the rings and waits for its CQE. Like vpu_run_job
+ * this is for mxc_vpu_sim; no LOCK_DEV is needed, the driver takes the
+ * device for the job.
+ */
+static inline int vpu_ring_run_job(int fd, struct vpu_ring *r)
+{
+	volatile struct vpu_ring_hdr *h = r->hdr;
+	struct vpu_ring_enter e = { 1, 1000 };
+	struct vpu_sqe *sqe;
+	struct vpu_cqe *cqe;
+	uint32_t tail = h->sq_tail, head;
+	int ret;
+
+	sqe = &r->sqes[tail & (h->sq_entries - 1)];
+	sqe->user_data = tail;
+	sqe->run_cmd = BITVAL_PIC_RUN;
+	sqe->nr_regs = 0;
+	sqe->flags = 0;
+	__atomic_store_n(&h->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* while the driver is not idle on this ring, it sees the SQE itself */
+	if (h->flags & VPU_RING_NEED_WAKEUP)
+		ret = ioctl(fd, VPU_IOC_RING_ENTER, &e);
+	else
+		ret = 0;
+	head = h->cq_head;
+	while (!ret && __atomic_load_n(&h->cq_tail, __ATOMIC_ACQUIRE) == head)
+		ret = ioctl(fd, VPU_IOC_RING_ENTER, &e);
+	if (ret)
+		return ret;
+	cqe = &r->cqes[head & (h->cq_entries - 1)];
+	ret = cqe->result;
+	__atomic_store_n(&h->cq_head, head + 1, __ATOMIC_RELEASE);
+	return ret;
+}
+
+static inline uint64_t vpu_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* growable array of latency samples */
+struct vpu_samples {
+	uint64_t *v;
+	size_t n;
+	size_t cap;
+};
+
+static inline void vpu_samples_add(struct vpu_samples *s, uint64_t ns)
+{
+	if (s->n == s->cap) {
+		size_t cap = s->cap ? s->cap * 2 : 4096;
+		uint64_t *v = realloc(s->v, cap * sizeof(*v));
+
+		if (!v)
+			return;
+		s->v = v;
+		s->cap = cap;
+	}
+	s->v[s->n++] = ns;
+}
+
+static int vpu_cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * s must already be sorted with vpu_sort_samples(); pct is in tenths of
+ * a percent (999 = p99.9)
+ */
+static inline uint64_t vpu_percentile(uint64_t *s, size_t n, unsigned int pct)
+{
+	if (!n)
+		return 0;
+	return s[(n - 1) * pct / 1000];
+}
+
+static inline void vpu_sort_samples(uint64_t *s, size_t n)
+{
+	qsort(s, n, sizeof(*s), vpu_cmp_u64);
+}
+
+#endif